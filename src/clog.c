@@ -22,6 +22,11 @@
   SOFTWARE.
  */
 
+// O_DIRECT and fallocate() are Linux extensions
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "clog.h"
 
 // SGR text and color modifier static constants
@@ -158,18 +163,549 @@ static const ClLevel       default_levels[]    = {
   }
 };
 
+// The number of message and record bytes that are formatted on the stack before falling back to 
+// the heap
+#define CL_MESSAGE_LENGTH 1024
+#define CL_RENDER_LENGTH  2048
+
+// The size of a cache line, which handlers and the counters contended by several threads are 
+// aligned to
+#define CL_CACHE_LINE 64
+
+// The number of bytes of records a handler buffers when its flush policy doesn't set the size
+#define CL_FLUSH_LENGTH 65536
+
+// The number of buffers a handler submits through its io_uring, so it can keep filling one while 
+// the others are being written
+#define CL_URING_BUFFERS 4
+
+// The most bytes a single byte takes up once escaped in a JSON string (\u00XX)
+#define CL_JSON_EXPANSION 6
+
+// The block size O_DIRECT writes and their buffers are aligned to
+#define CL_DIRECT_ALIGNMENT 4096
+
+// The split of a mapped file's reservation counter into the offset and the segment generation
+#define CL_MAP_OFFSET_BITS 48
+#define CL_MAP_OFFSET_MASK ((((uint64_t)1) << CL_MAP_OFFSET_BITS) - 1)
+
+// The number of counters logging threads announce themselves in to the handler registry, spread 
+// out so threads mostly don't share one
+#define CL_READER_STRIPES 16
+
+// The rollover boundary of handlers that aren't rolled over based on time, which no record reaches
+#define CL_TIME_NEVER ((time_t)LONG_MAX)
+
+// The number of distinct call sites that binary handlers can describe in their dictionary, call 
+// sites beyond half of it are written as plain text records
+#ifndef CL_SITE_COUNT
+#define CL_SITE_COUNT 8192
+#endif
+
+// The type of each argument a message format string consumes, in the order they're passed
+typedef enum cl_argument_e {
+  CL_ARGUMENT_UNSUPPORTED = 0,
+  CL_ARGUMENT_INT         = 1,
+  CL_ARGUMENT_LONG        = 2,
+  CL_ARGUMENT_LONG_LONG   = 3,
+  CL_ARGUMENT_SIZE        = 4,
+  CL_ARGUMENT_INTMAX      = 5,
+  CL_ARGUMENT_PTRDIFF     = 6,
+  CL_ARGUMENT_DOUBLE      = 7,
+  CL_ARGUMENT_LONG_DOUBLE = 8,
+  CL_ARGUMENT_POINTER     = 9,
+  CL_ARGUMENT_STRING      = 10
+} ClArgument;
+
+// A logging call site whose message format string can be replayed from raw argument bytes. The 
+// pointers the site was first seen with are kept as its lookup key
+typedef struct cl_site_s {
+  unsigned long   id;
+  const char *    filename_key;
+  const char *    message_key;
+  long            line;
+  char *          filename;
+  char *          function;
+  char *          message;
+  unsigned char * signature;
+  unsigned long   signature_length;
+} ClSite;
+
+// The identity of a process, pre-rendered so the format parts that print it only copy it. The 
+// strings are truncated to fit
+#define CL_PROCESS_TEXT_LENGTH 256
+typedef struct cl_process_s {
+  pid_t         id;
+  unsigned long id_length;
+  unsigned long name_length;
+  unsigned long executable_length;
+  unsigned long user_length;
+  unsigned long longest;
+  char          id_text[24];
+  char          name[CL_PROCESS_TEXT_LENGTH];
+  char          executable[PATH_MAX];
+  char          user[CL_PROCESS_TEXT_LENGTH];
+} ClProcess;
+
+// Everything captured about a single logging call, independent of the handlers it's written to. 
+// When site is set, the message can be rebuilt from the raw argument bytes, and may not have been 
+// formatted yet (message is NULL). Structured fields are kept apart from the message, since each 
+// encoding writes them differently. uptime is the nanoseconds since ClInit(), only measured while 
+// some handler prints it. When ticks is set, both are yet to be converted from that TSC reading
+typedef struct cl_record_s {
+  ClLogLevel            level;
+  const char *          filename;
+  long                  line;
+  const char *          function;
+  struct timespec       time;
+  int64_t               uptime;
+  uint64_t              ticks;
+  pid_t                 thread_id;
+  pthread_t             pthread_id;
+  char                  thread_name[CL_THREAD_NAME_LENGTH];
+  const ClProcess *     process;
+  const char *          message;
+  unsigned long         message_length;
+  ClSite *              site;
+  const unsigned char * arguments;
+  unsigned long         arguments_length;
+  const ClField *       fields;
+  unsigned long         fields_length;
+} ClRecord;
+
+// A growable output buffer that starts out on the stack
+typedef struct cl_buffer_s {
+  char *        data;
+  unsigned long length;
+  unsigned long capacity;
+  int           on_heap;
+} ClBuffer;
+
+// A conversion specification of a message format string. The length modifier is kept as a single 
+// character, with 'H' standing for hh and 'q' for ll. other is set for flags only libc handles
+typedef struct cl_spec_s {
+  int  left;
+  int  plus;
+  int  space;
+  int  alternate;
+  int  zero;
+  int  other;
+  int  width;
+  int  width_star;
+  int  precision;
+  int  precision_star;
+  char length;
+  char conversion;
+} ClSpec;
+
+// An argument of a message format string, as read for its conversion. Integers and characters are 
+// held as their promoted type, sign extended, and narrowed according to the length modifier later
+typedef union cl_value_u {
+  long long    i;
+  double       d;
+  long double  ld;
+  const void * p;
+  wint_t       c;
+} ClValue;
+
+// The decimal digits of a non-negative double, most significant first and without leading zeros. 
+// The decimal point goes after the first point digits, which can be negative or past the end
+#define CL_FLOAT_PRECISION 80
+#define CL_FLOAT_DIGITS    400
+typedef struct cl_decimal_s {
+  char digits[CL_FLOAT_DIGITS];
+  int  length;
+  int  point;
+} ClDecimal;
+
+// The rendered output of a time part for a single second. Readers and the writer that refreshes it 
+// coordinate through the sequence number, which is odd while the text is being rewritten. The text 
+// has zeros in place of the sub-second digits, which are filled in for each record at the offsets
+#define CL_TIME_CACHE_LENGTH 64
+#define CL_TIME_FRACTIONS    4
+typedef struct cl_time_cache_s {
+  unsigned long sequence;
+  time_t        time;
+  unsigned long length;
+  unsigned long fractions;
+  unsigned char offsets[CL_TIME_FRACTIONS];
+  unsigned char digits[CL_TIME_FRACTIONS];
+  char          text[CL_TIME_CACHE_LENGTH];
+} ClTimeCache;
+
+// The conversion of TSC ticks to nanoseconds of CLOCK_REALTIME and CLOCK_MONOTONIC, anchored at a 
+// reading of all three. Ticks are scaled by multiplying with scale and shifting right by 32 bits. 
+// Only the background worker (or whoever holds its mutex) recalibrates it, and readers coordinate 
+// with it through the sequence number, which is odd while the calibration is being rewritten
+#define CL_TSC_REFRESH 1000
+typedef struct cl_tsc_s {
+  unsigned long sequence;
+  uint64_t      ticks;
+  int64_t       realtime;
+  int64_t       monotonic;
+  uint64_t      scale;
+  uint64_t      deadline;
+} ClTsc;
+
+// The local timezone's UTC offset, valid for the hour it was looked up in
+typedef struct cl_timezone_s {
+  time_t          valid_from;
+  time_t          valid_until;
+  long            offset;
+  int             is_dst;
+  const char *    zone;
+  pthread_mutex_t mutex;
+} ClTimezone;
+
+// A step of a compiled format, either text of a known length or a field of the record. Time steps 
+// keep the part they were compiled from, for its strftime() format and cache
+typedef struct cl_step_s {
+  ClFormatType   type;
+  const char *   text;
+  unsigned long  length;
+  ClFormatPart * part;
+} ClStep;
+
+// A parsed format compiled into the steps a record is rendered with, in a single block along with 
+// the text they copy. Adjacent string and SGR parts are merged, parts that print nothing are left 
+// out, and the level is prebuilt for every level. bound is the most a record takes up besides its 
+// message, filename and function (which it has messages, filenames and functions steps of), so 
+// the render buffer only has to be reserved once. The plan JSON handlers render with is compiled 
+// alongside it, and escapes those three (and the time), which can take up to 6 times their length
+typedef struct cl_plan_s {
+  unsigned long       length;
+  unsigned long       bound;
+  unsigned long       messages;
+  unsigned long       filenames;
+  unsigned long       functions;
+  unsigned long       processes;
+  int                 thread_names;
+  int                 durations;
+  int                 shareable;
+  int                 escaped;
+  struct cl_plan_s *  json;
+  const char *        level_text[CL_LOG_LEVEL_TRACE+1];
+  unsigned long       level_length[CL_LOG_LEVEL_TRACE+1];
+  ClStep              steps[];
+} ClPlan;
+
+// A slot in the asynchronous ring buffer. The sequence number tells producers and consumers whose 
+// turn it is to use the slot (see Dmitry Vyukov's bounded MPMC queue)
+typedef struct cl_async_slot_s {
+  unsigned long sequence;
+  ClRecord      record;
+  char          message[CL_ASYNC_MESSAGE_LENGTH];
+} ClAsyncSlot;
+
+// A handler along with the configuration ClLog() uses for it, which is replaced as a whole rather 
+// than changed in place
+typedef struct cl_entry_s {
+  ClHandler *    handler;
+  ClLogging      logging;
+  ClLogLevel     min_level;
+  ClLogLevel     max_level;
+  ClEncoding     encoding;
+  char *         format;
+  ClFormatPart * parsed_format;
+  unsigned long  parsed_format_length;
+  ClPlan *       plan;
+} ClEntry;
+
+// An immutable snapshot of the handlers, published whenever one is created, deleted or reconfigured. 
+// Replaced snapshots are kept in a list until they can be freed
+typedef struct cl_registry_s {
+  struct cl_registry_s * retired;
+  unsigned long          length;
+  ClEntry                entries[];
+} ClRegistry;
+
+// The number of logging calls reading a registry, by the parity of the epoch they started in. Each 
+// stripe gets its own cache line
+typedef struct cl_readers_s {
+  unsigned long count[2];
+} __attribute__((aligned(CL_CACHE_LINE))) ClReaders;
+
+// A rolled-over file found next to a handler's file, and its index
+typedef struct cl_rolled_s {
+  unsigned long index;
+  char *        path;
+} ClRolled;
+
+// The kinds of work done by the background worker, so it stays off the logging path
+typedef enum cl_job_type_e {
+  CL_JOB_DELETE   = 0,
+  CL_JOB_COMPRESS = 1
+} ClJobType;
+
+// A unit of work queued for the background worker, on a file belonging to the handler
+typedef struct cl_job_s {
+  ClJobType         type;
+  ClHandler *       handler;
+  char *            path;
+  struct cl_job_s * next;
+} ClJob;
+
+// An io_uring a file handler submits its buffers through, with its rings mapped from the kernel. 
+// A buffer is either being filled (current), in flight at its offset in the file, or free
+typedef struct cl_uring_s {
+  int                   fd;
+  void *                sq_ring;
+  size_t                sq_ring_size;
+  void *                cq_ring;
+  size_t                cq_ring_size;
+  struct io_uring_sqe * sqes;
+  size_t                sqes_size;
+  unsigned int *        sq_tail;
+  unsigned int *        sq_mask;
+  unsigned int *        sq_array;
+  unsigned int *        cq_head;
+  unsigned int *        cq_tail;
+  unsigned int *        cq_mask;
+  struct io_uring_cqe * cqes;
+  int                   registered;
+  char *                buffers[CL_URING_BUFFERS];
+  unsigned long         lengths[CL_URING_BUFFERS];
+  off_t                 offsets[CL_URING_BUFFERS];
+  int                   busy[CL_URING_BUFFERS];
+  unsigned long         current;
+  unsigned long         in_flight;
+  off_t                 offset;
+} ClUring;
+
+// The O_DIRECT descriptor a file handler writes through, and the block-aligned staging buffer its 
+// records are gathered in. The first carry bytes of it are the start of the file's last block, 
+// which is at offset
+typedef struct cl_direct_s {
+  int           fd;
+  char *        staging;
+  unsigned long capacity;
+  unsigned long carry;
+  off_t         offset;
+  off_t         allocated;
+} ClDirect;
+
+// Levels accepted by at least one handler, read inline by the logging macros
+unsigned int cl_level_mask = 0;
+
+// Binary encoding static constants. Every binary entry starts with one of the tags, and the type 
+// layout lets the decoder refuse logs written on an incompatible machine
+static const char          binary_magic[]  = "CLOGBIN";
+static const unsigned char binary_version  = 3;
+static const unsigned char binary_layout[] = {
+  sizeof(int), sizeof(long), sizeof(long long), sizeof(size_t), sizeof(intmax_t), 
+  sizeof(ptrdiff_t), sizeof(double), sizeof(long double), sizeof(void *)
+};
+static const char          binary_header   = 'H';
+static const char          binary_site     = 'S';
+static const char          binary_event    = 'E';
+static const char          binary_text     = 'T';
+
+// What a nanosecond count is divided by to keep the given number of its leading digits
+static const unsigned long fraction_scale[10] = {
+  1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10, 1
+};
+
 // Misc static globals
 static int           is_initialized  = 0;
-static time_t        start_time      = 0;
+static struct timespec start_time    = {0, 0};
+static ClClockSource clock_source    = CL_CLOCK_REALTIME;
+static ClTsc         tsc_clock       = {0, 0, 0, 0, 0, 0};
+static int           uptime_wanted   = 0;
 static ClLevel *     levels          = NULL;
 static ClHandler **  handlers        = NULL;
 static unsigned long handlers_length = 0;
+static ClTimezone    timezone_cache  = {0, 0, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER};
+static unsigned int  text_level_mask   = 0;
+static unsigned int  binary_level_mask = 0;
+
+// Process and thread identity static globals, looked up once rather than for every record
+static ClProcess        process_identity;
+static __thread pid_t   thread_id_cache = 0;
+static __thread char    thread_name_cache[CL_THREAD_NAME_LENGTH];
+
+// Handler registry static globals. The handlers array is only used under the mutex, logging calls 
+// read the published registry without locking, and a replaced registry (or anything it refers to) 
+// is only freed once the readers of the epoch it was replaced in are gone
+static ClRegistry *    registry         = NULL;
+static ClRegistry *    registry_retired = NULL;
+static unsigned long   registry_epoch   = 0;
+static ClReaders       registry_readers[CL_READER_STRIPES];
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Call site dictionary static globals. Lookups are lock-free, sites are only ever added under the 
+// mutex and published once they're complete
+static ClSite *        sites[CL_SITE_COUNT];
+static unsigned long   sites_length = 0;
+static pthread_mutex_t sites_mutex  = PTHREAD_MUTEX_INITIALIZER;
+
+// Background worker static globals. The worker is started along with the first job or timer, the 
+// timers being the handlers it flushes periodically
+static ClJob *         jobs_head    = NULL;
+static ClJob *         jobs_tail    = NULL;
+static int             jobs_running = 0;
+static int             jobs_exiting = 0;
+static int             jobs_busy    = 0;
+static pthread_t       jobs_thread;
+static pthread_mutex_t jobs_mutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jobs_cond    = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  jobs_idle    = PTHREAD_COND_INITIALIZER;
+static ClHandler **    jobs_timers  = NULL;
+static unsigned long   jobs_timers_length = 0;
+
+// Asynchronous mode static globals. The enqueue and dequeue positions are kept on separate cache 
+// lines so producers and the writer thread don't invalidate each other's position on every record
+static ClAsyncSlot * async_slots                            = NULL;
+static unsigned long async_mask                             = 0;
+static ClAsyncPolicy async_policy                           = CL_ASYNC_POLICY_BLOCK;
+static int           async_running                          = 0;
+static int           async_exiting                          = 0;
+static int           async_sleeping                         = 0;
+static unsigned long async_producers                        = 0;
+static ClAsyncStats  async_stats;
+static pthread_t     async_thread;
+static pthread_mutex_t async_mutex                          = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  async_cond                           = PTHREAD_COND_INITIALIZER;
+static unsigned long async_head __attribute__((aligned(CL_CACHE_LINE))) = 0;
+static unsigned long async_tail __attribute__((aligned(CL_CACHE_LINE))) = 0;
 
 // Misc static helper functions
-static unsigned long PrintMessage(ClHandler *handler, ClLogLevel level, const char *filename, 
-                                  long line, const char *function, const char *message, va_list args);
+static void UpdateLevelMask();
+static void PublishRegistry();
+static void SynchronizeRegistry();
+static ClRegistry *EnterRegistry(unsigned long **reader);
+static void ExitRegistry(unsigned long *reader);
+static void AttachFormat(ClHandler *handler, const char *format);
+static void ReleaseFormat(char *format, ClFormatPart *parsed_format, 
+                          unsigned long parsed_format_length, ClPlan *plan);
+static pid_t CurrentThreadId();
+static void CurrentThreadName(char *output);
+static void CaptureTime(ClRecord *record);
+static int StartTsc();
+static void MeasureTsc(const ClTsc *previous, ClTsc *measured);
+static void PublishTsc(const ClTsc *measured);
+static void SampleTsc(uint64_t *ticks, int64_t *realtime, int64_t *monotonic);
+static void ConvertTicks(ClRecord *record);
+static void CacheProcess();
+static void RefreshProcess();
+static void SetProcessId(ClProcess *process, pid_t id);
+static void SetProcessText(ClProcess *process, const char *name, const char *executable, 
+                           const char *user);
+static void DispatchRecord(ClRecord *record);
+static void WriteHandler(ClHandler *handler, const char *data, unsigned long length, 
+                         ClLogLevel level);
+static void StreamWrite(ClHandler *handler, const char *data, unsigned long length, 
+                        ClLogLevel level);
+static void FlushHandler(ClHandler *handler);
+static void RingWrite(ClHandler *handler, const char *data, unsigned long length);
+static void PipeWrite(ClHandler *handler, const char *data, unsigned long length);
+static void PipeWriteRecord(ClHandler *handler, const char *data, unsigned long length);
+static int PipeFlush(ClHandler *handler);
+static void PipeDrop(ClHandler *handler);
+static const char *LastNewline(const char *data, unsigned long length);
+static void DumpRing(ClHandler *handler);
+static void RolloverHandler(ClHandler *handler);
+static int OpenHandler(ClHandler *handler);
+static void ScanRolled(ClHandler *handler);
+static int CompareRolled(const void *a, const void *b);
+static void RetainRolled(ClHandler *handler, char *path);
+static void RolloverOnTime(ClHandler *handler, time_t time);
+static void RolloverInterval(ClRolloverInterval interval, time_t time, time_t *start, time_t *boundary);
+static int StartJobs();
+static void QueueJob(ClJobType type, ClHandler *handler, char *path);
+static void RemoveTimer(ClHandler *handler);
+static uint64_t CurrentMilliseconds();
+static void WaitJobs();
+static void StopJobs();
+static void *JobWorker(void *arg);
+static void RunJob(ClJob *job);
+static int CompressFile(const char *path, const char *compressed);
+static unsigned long FileSize(const char *path);
+static int MapHandler(ClHandler *handler);
+static void UnmapHandler(ClHandler *handler);
+static void MapWrite(ClHandler *handler, const char *data, unsigned long length);
+static void MapClose(ClHandler *handler, time_t boundary, time_t time);
+static void MapRollover(ClHandler *handler);
+static int IoAttach(ClHandler *handler, ClIo io);
+static void IoDetach(ClHandler *handler, int buffered);
+static int UringAttach(ClHandler *handler, unsigned long capacity);
+static void UringDetach(ClHandler *handler);
+static void UringDelete(ClUring *uring);
+static void UringOpen(ClHandler *handler);
+static void UringSubmit(ClHandler *handler);
+static void UringReap(ClUring *uring, int fd, int wait);
+static void UringDrain(ClHandler *handler);
+static void UringWrite(ClHandler *handler, const char *data, unsigned long length);
+static int DirectAttach(ClHandler *handler, unsigned long capacity);
+static void DirectDetach(ClHandler *handler);
+static int DirectOpen(ClHandler *handler);
+static void DirectClose(ClHandler *handler);
+static void DirectFlush(ClHandler *handler);
+static void DirectWrite(ClHandler *handler, const char *data, unsigned long length);
+static void WriteAt(int fd, const char *data, unsigned long length, off_t offset);
+static int RenderMessage(ClEntry *entry, ClRecord *record, ClBuffer *buffer);
+static unsigned long FormatLong(char *output, long value);
+static unsigned long FormatUnsigned(char *output, unsigned long value);
+static char *RenderText(char *output, const char *data, unsigned long length, int escaped);
+static char *EscapeJson(char *output, const char *data, unsigned long length);
+static char *EscapeJsonByte(char *output, unsigned char byte);
+static void EscapeRendered(ClBuffer *buffer, unsigned long start);
+static unsigned long FieldsBound(const ClField *fields, unsigned long fields_length);
+static char *RenderFields(char *output, const ClField *fields, unsigned long fields_length, 
+                          int escaped);
+static char *RenderValue(char *output, const ClField *field, int escaped);
+static void WriteMessage(int fd, const char *data, unsigned long length);
+static void RenderTime(ClFormatPart *part, const struct timespec *time, ClBuffer *buffer);
+static unsigned long FormatTime(const char *format, const struct timespec *time, char *output, 
+                                unsigned long max, ClTimeCache *cache);
+static char *FormatDigits(char *output, unsigned long value, int digits);
+static char *FormatDuration(char *output, int64_t uptime);
+static void LocalTime(time_t time, struct tm *tm);
+static void BufferReserve(ClBuffer *buffer, unsigned long length);
+static void BufferAppend(ClBuffer *buffer, const char *data, unsigned long length);
+static void BufferPrintf(ClBuffer *buffer, const char *format, ...);
+static void BufferVprintf(ClBuffer *buffer, const char *format, va_list args);
+static void FormatMessage(ClBuffer *buffer, const char *format, va_list args);
+static int FormatDirect(ClBuffer *buffer, const char *format, va_list args);
+static unsigned long ReadSpec(const char *format, unsigned long i, ClSpec *spec);
+static void FormatArgument(ClBuffer *buffer, const ClSpec *spec, const ClValue *value);
+static void FormatLibc(ClBuffer *buffer, const ClSpec *spec, const ClValue *value);
+static void FormatInteger(ClBuffer *buffer, const ClSpec *spec, unsigned long long magnitude, 
+                          int negative);
+static void FormatFloat(ClBuffer *buffer, const ClSpec *spec, double value);
+static unsigned long FormatFloatBody(char *output, const ClSpec *spec, double value);
+static void FormatPadded(ClBuffer *buffer, const ClSpec *spec, const char *prefix, 
+                         unsigned long prefix_length, unsigned long zeros, const char *body, 
+                         unsigned long body_length);
+static char *FormatDecimal(char *end, unsigned long long value);
+static void FloatDigits(double value, int fixed, int count, ClDecimal *decimal);
+static void RoundDigits(ClDecimal *decimal, int up);
+static unsigned long FormatShortest(char *output, double value);
+static int AsyncLog(ClRecord *record, const char *message, va_list *args);
+static unsigned long PackFields(ClRecord *record, char *output, unsigned long max);
+static void UnpackFields(ClRecord *record, char *base);
+static ClAsyncSlot *AsyncClaim(unsigned long *pos);
+static int AsyncDequeue(ClAsyncSlot *slot);
+static void AsyncWake();
+static void *AsyncWriter(void *arg);
+static ClSite *FindSite(const char *filename, long line, const char *function, const char *message);
+static void DeleteSites();
+static unsigned long ParseSpecifier(const char *message, unsigned long i, ClArgument *arguments, 
+                                    int *arguments_length);
+static long EncodeArguments(ClSite *site, va_list args, unsigned char *output, unsigned long max);
+static int ReplayMessage(const char *message, const unsigned char *arguments, 
+                         unsigned long arguments_length, ClBuffer *buffer);
+static void EncodeRecord(ClEntry *entry, ClRecord *record, ClBuffer *buffer);
+static void MarkSites(ClHandler *handler, ClRecord *record);
+static void EncodeString(ClBuffer *buffer, const char *string);
+static int DecodeBytes(FILE *input, void *output, unsigned long length);
+static char *DecodeString(FILE *input);
 static void ParseFormat(char *format, ClFormatPart **parsed_format, 
                         unsigned long *parsed_format_length);
+static void DeleteFormat(ClFormatPart *parsed_format, unsigned long parsed_format_length);
+static ClPlan *CompileFormat(ClFormatPart *parsed_format, unsigned long parsed_format_length);
+static ClPlan *CompileJson(ClFormatPart *parsed_format, unsigned long parsed_format_length);
+static void JsonText(ClPlan *plan, char **text, const char *data, unsigned long length, int escape);
+static void DeletePlan(ClPlan *plan);
 static void CreateFormatParts(char *format, ClFormatPart **parsed_format, unsigned long *len, 
                               unsigned long i, unsigned long j);
 static void CopyContext(char *format, ClFormatPart **parsed_format, unsigned long len, 
@@ -184,8 +720,17 @@ void ClInit() {
   if(is_initialized == 0) {
     is_initialized = 1;
 
-    // Record the time when this function is first called
-    time(&start_time);
+    // Record the time when this function is first called, which durations are measured from
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // Keep the cached process ID right in children
+    pthread_atfork(NULL, NULL, RefreshProcess);
+  }
+  CacheProcess();
+
+  // The TSC is calibrated again when it's still in use, since ClCleanup() stopped its refreshes
+  if(__atomic_load_n(&clock_source, __ATOMIC_RELAXED) == CL_CLOCK_TSC && StartTsc() != 0) {
+    __atomic_store_n(&clock_source, CL_CLOCK_REALTIME, __ATOMIC_RELAXED);
   }
   
   // Generate the default severity levels
@@ -219,6 +764,9 @@ void ClInit() {
 void ClCleanup() {
   unsigned long i;
 
+  // Write out anything still waiting to be logged asynchronously
+  ClStopAsync();
+
   // Delete the levels
   for(i = 0; i < default_level_count; i++) {
     if(levels[i].level_string != NULL) {
@@ -230,13 +778,27 @@ void ClCleanup() {
     if(levels[i].sgr_resets != NULL) {
       free(levels[i].sgr_resets);
     }
+    if(levels[i].parsed_level != NULL) {
+      free(levels[i].parsed_level);
+    }
   }
   free(levels);
+  levels = NULL;
 
-  // Delete all of the allocated handlers
-  for(i = 0; i < handlers_length; i++) {
-    ClDeleteHandler(handlers[i]);
+  // Delete all of the allocated handlers, ClDeleteHandler() removes each one from the array
+  while(handlers_length > 0) {
+    ClDeleteHandler(handlers[handlers_length-1]);
+  }
+  if(handlers != NULL) {
+    free(handlers);
+    handlers = NULL;
   }
+
+  // Forget the call sites, binary handlers that would refer to them are gone
+  DeleteSites();
+
+  // Finish deleting old files before returning
+  StopJobs();
 }
 
 
@@ -246,10 +808,103 @@ void ClReset() {
 }
 
 
+int ClStartAsync(unsigned long capacity, ClAsyncPolicy policy) {
+  unsigned long i;
+  unsigned long slots_length = 2;
+
+  if(async_slots != NULL) {
+    return -1;
+  }
+
+  // Round the capacity up to a power of two so positions can be mapped to slots with a mask
+  while(slots_length < capacity && slots_length <= ULONG_MAX/2) {
+    slots_length *= 2;
+  }
+  async_slots = malloc(slots_length*sizeof(ClAsyncSlot));
+  if(async_slots == NULL) {
+    return -1;
+  }
+  for(i = 0; i < slots_length; i++) {
+    async_slots[i].sequence = i;
+  }
+  async_mask = slots_length - 1;
+  async_policy = policy;
+  async_head = 0;
+  async_tail = 0;
+  async_exiting = 0;
+  async_sleeping = 0;
+  memset(&async_stats, 0, sizeof(ClAsyncStats));
+
+  __atomic_store_n(&async_running, 1, __ATOMIC_SEQ_CST);
+  if(pthread_create(&async_thread, NULL, AsyncWriter, NULL) != 0) {
+    __atomic_store_n(&async_running, 0, __ATOMIC_SEQ_CST);
+    free(async_slots);
+    async_slots = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+void ClStopAsync() {
+  if(async_slots == NULL) {
+    return;
+  }
+
+  // Stop accepting new records, then wait for the logging calls that already claimed a slot
+  __atomic_store_n(&async_running, 0, __ATOMIC_SEQ_CST);
+  while(__atomic_load_n(&async_producers, __ATOMIC_SEQ_CST) != 0) {
+    sched_yield();
+  }
+
+  // Let the writer thread drain the ring buffer and exit
+  pthread_mutex_lock(&async_mutex);
+  __atomic_store_n(&async_exiting, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&async_cond);
+  pthread_mutex_unlock(&async_mutex);
+  pthread_join(async_thread, NULL);
+
+  free(async_slots);
+  async_slots = NULL;
+}
+
+
+void ClGetAsyncStats(ClAsyncStats *stats) {
+  stats->enqueued = __atomic_load_n(&async_stats.enqueued, __ATOMIC_RELAXED);
+  stats->dropped_newest = __atomic_load_n(&async_stats.dropped_newest, __ATOMIC_RELAXED);
+  stats->dropped_oldest = __atomic_load_n(&async_stats.dropped_oldest, __ATOMIC_RELAXED);
+  stats->blocked = __atomic_load_n(&async_stats.blocked, __ATOMIC_RELAXED);
+}
+
+
 ClHandler *ClCreateHandler(int fd, FILE *fp, ClStream stream_type, unsigned long stream_max_length, 
                            char *name, char *extension, unsigned long rollover_max, char *format, 
                            ClLogLevel min_level, ClLogLevel max_level) {
-  ClHandler *handler = malloc(sizeof(ClHandler));
+  ClHandler *   handler;
+  const char *  file_name = NULL;
+  const char *  file_extension = NULL;
+  unsigned long names_length = 0;
+
+  // The name, extension and filename of a file live in the same block as the handler, which is 
+  // aligned so its hot fields start a cache line, and is let go of with a single free()
+  if(stream_type == CL_STREAM_FILE || stream_type == CL_STREAM_MMAP) {
+    file_name = (name == NULL || strlen(name) == 0) ? default_name : name;
+    file_extension = (extension == NULL) ? default_extension : extension;
+    names_length = 2*(strlen(file_name)+strlen(file_extension)) + 4;
+  }
+  handler = aligned_alloc(CL_CACHE_LINE, (sizeof(ClHandler)+names_length+CL_CACHE_LINE-1)/
+                                         CL_CACHE_LINE*CL_CACHE_LINE);
+  if(handler == NULL) {
+    return NULL;
+  }
+
+  // Start from a zeroed handler so deleting a partially configured one is safe
+  memset(handler, 0, sizeof(ClHandler));
+  handler->rollover_boundary = CL_TIME_NEVER;
+
+  // Each handler serializes writes to its own stream, so threads writing to different handlers 
+  // never wait on each other
+  pthread_mutex_init(&(handler->lock), NULL);
 
   // Generate a unique ID
   // TODO: Needs portability
@@ -283,40 +938,25 @@ ClHandler *ClCreateHandler(int fd, FILE *fp, ClStream stream_type, unsigned long
     handler->rollover_count = 0;
     handler->rollover_max = 0;
   }
-  else if(stream_type == CL_STREAM_FILE) {
-    // If the stream type is a file but the user didn't specify a name or extension, set default ones
-    if(name == NULL || strlen(name) == 0) {
-      handler->name = malloc((1+strlen(default_name))*sizeof(char));
-      strcpy(handler->name, default_name);
-    }
-    else {
-      handler->name = malloc((1+strlen(name))*sizeof(char));
-      strcpy(handler->name, name);
-    }
-    // Since the user may want a log without any extension, handle an empty extension string later
-    if(extension == NULL) {
-      handler->extension = malloc((1+strlen(default_extension))*sizeof(char));
-      strcpy(handler->extension, default_extension);
-    }
-    else {
-      handler->extension = malloc((1+strlen(extension))*sizeof(char));
-      strcpy(handler->extension, extension);
-    }
+  else if(stream_type == CL_STREAM_FILE || stream_type == CL_STREAM_MMAP) {
+    // If the stream type is a file but the user didn't specify a name or extension, default ones 
+    // were picked above. Since the user may want a log without any extension, an empty extension 
+    // string is handled below
+    handler->name = (char *)(handler+1);
+    strcpy(handler->name, file_name);
+    handler->extension = handler->name+strlen(handler->name)+1;
+    strcpy(handler->extension, file_extension);
+    handler->filename = handler->extension+strlen(handler->extension)+1;
 
     // Use the name and extension to create the filename. If the extension was specified as an empty
     // string, then assume the user does not want an extension i.e. the filename is just the name
     if(extension != NULL && strlen(extension) == 0) {
-      handler->filename = malloc((1+strlen(handler->name))*sizeof(char));
       strcpy(handler->filename, handler->name);
     }
     else {
-      handler->filename = malloc((2+strlen(handler->name)+strlen(handler->extension))*sizeof(char));
-      sprintf(handler->filename, "%s.%s", name, extension);
+      sprintf(handler->filename, "%s.%s", file_name, file_extension);
     }
-    handler->fp = fopen(handler->filename, "a");
-    
-    // Set stream_length to the current EOF
-    handler->stream_length = (unsigned long)ftell(handler->fp);
+
     // Set stream_max_length to the maximum size the file can be in bytes before rollover occurs
     if(stream_max_length < CL_MIN_STREAM_LENGTH) {
       handler->stream_max_length = CL_MIN_STREAM_LENGTH;
@@ -328,23 +968,50 @@ ClHandler *ClCreateHandler(int fd, FILE *fp, ClStream stream_type, unsigned long
       handler->stream_max_length = stream_max_length;
     }
 
-    // TODO: handle pre-existing rollovers
-    handler->rollover_count = 0;
-    if(rollover_max < 0) {
-      handler->rollover_max = 0;
-    }
-    else if(rollover_max > ULONG_MAX) {
+    // Pick up the numbering where earlier rollovers of the file left off, which takes a single scan 
+    // of the directory so that rolling over later doesn't have to probe for a free name
+    if(rollover_max > ULONG_MAX) {
       handler->rollover_max = ULONG_MAX;
     }
     else {
       handler->rollover_max = rollover_max;
     }
+    ScanRolled(handler);
+
+    if(stream_type == CL_STREAM_MMAP) {
+      // Map the first segment, starting a new file right away if the existing one is already full
+      switch(MapHandler(handler)) {
+        case 0:
+          break;
+        case 1:
+          RolloverHandler(handler);
+          if(handler->map != NULL) {
+            break;
+          }
+          // Fallthrough
+        default:
+          ClDeleteHandler(handler);
+          return NULL;
+      }
+    }
+    else {
+      handler->fp = fopen(handler->filename, "a");
+      if(handler->fp == NULL) {
+        ClDeleteHandler(handler);
+        return NULL;
+      }
+      
+      // Set stream_length to the current EOF
+      handler->stream_length = (unsigned long)ftell(handler->fp);
+    }
 
     // Disable SGR output by default
     handler->sgr_output = CL_SGR_OFF;
 
     // Set unused fields to 0/NULL
-    handler->fd = 0;
+    if(stream_type == CL_STREAM_FILE) {
+      handler->fd = 0;
+    }
   }
   else if(stream_type == CL_STREAM_PIPE) {
     // Convert the pipe's write file descriptor into a file pointer struct
@@ -352,11 +1019,16 @@ ClHandler *ClCreateHandler(int fd, FILE *fp, ClStream stream_type, unsigned long
     // C89: Use pipe writing function calls when writing the message, no fp needed
     // handler->fp = fdopen(fd, "a");
 
-    // Store the pipe's write-end file descriptor
+    // Store the pipe's write-end file descriptor, and make sure a slow reader can never block the 
+    // logging thread
     handler->fd = fd;
+    if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+      ClDeleteHandler(handler);
+      return NULL;
+    }
 
     handler->stream_length = 0;
-    // Set stream_max_length to the maximum size the pipe buffer can be in bytes
+    // Set stream_max_length to the maximum number of bytes held back while the pipe is full
     if(stream_max_length < CL_MIN_STREAM_LENGTH) {
       handler->stream_max_length = CL_MIN_STREAM_LENGTH;
     }
@@ -366,6 +1038,11 @@ ClHandler *ClCreateHandler(int fd, FILE *fp, ClStream stream_type, unsigned long
     else {
       handler->stream_max_length = stream_max_length;
     }
+    handler->spill = malloc(handler->stream_max_length*sizeof(char));
+    if(handler->spill == NULL) {
+      ClDeleteHandler(handler);
+      return NULL;
+    }
 
     // Disable SGR output by default
     handler->sgr_output = CL_SGR_OFF;
@@ -379,12 +1056,33 @@ ClHandler *ClCreateHandler(int fd, FILE *fp, ClStream stream_type, unsigned long
     handler->rollover_max = 0;
   }
   else if(stream_type == CL_STREAM_STRING) {
-    // Open a stream in memory that treats a string buffer as a file pointer
-    // TODO: This is POSIX only, needs portability
-    // C89: Create a temporary file or use string appends
+    // Keep the most recent records in a ring of memory, sized to a power of two so positions can be 
+    // mapped into it with a mask
+    handler->stream_max_length = CL_MIN_STREAM_LENGTH;
+    while(handler->stream_max_length < stream_max_length && 
+          handler->stream_max_length <= ULONG_MAX/2) {
+      handler->stream_max_length *= 2;
+    }
+    handler->ring = malloc(handler->stream_max_length*sizeof(char));
+    if(handler->ring == NULL) {
+      ClDeleteHandler(handler);
+      return NULL;
+    }
+    handler->ring_head = 0;
+    handler->ring_dump = NULL;
+
+    // Disable SGR output by default
+    handler->sgr_output = CL_SGR_OFF;
 
-    // TODO
-    // http://man7.org/linux/man-pages/man3/fmemopen.3.html
+    // Set unused fields to 0/NULL
+    handler->fd = 0;
+    handler->fp = NULL;
+    handler->stream_length = 0;
+    handler->name = NULL;
+    handler->extension = NULL;
+    handler->filename = NULL;
+    handler->rollover_count = 0;
+    handler->rollover_max = 0;
   }
   else {
     // Invalid stream_type
@@ -393,17 +1091,6 @@ ClHandler *ClCreateHandler(int fd, FILE *fp, ClStream stream_type, unsigned long
     return NULL;
   }
 
-  // Store and parse the format
-  if(format == NULL || strlen(format) == 0) {
-    handler->format = malloc((1+strlen(default_format))*sizeof(char));
-    strcpy(handler->format, default_format);
-  }
-  else {
-    handler->format = malloc((1+strlen(format))*sizeof(char));
-    strcpy(handler->format, format);
-  }
-  ParseFormat(handler->format, &(handler->parsed_format), &(handler->parsed_format_length));
-
   // Set the logging level range
   if(min_level < CL_LOG_LEVEL_FATAL || min_level > CL_LOG_LEVEL_TRACE) {
     ClDeleteHandler(handler);
@@ -420,12 +1107,17 @@ ClHandler *ClCreateHandler(int fd, FILE *fp, ClStream stream_type, unsigned long
   handler->min_level = min_level;
   handler->max_level = max_level;
 
-  // Save and return the handler pointer
+  // Store and parse the format, then save the handler and let ClLog() see it
+  pthread_mutex_lock(&registry_mutex);
+  AttachFormat(handler, format);
   handlers_length++;
   handlers = (handlers_length == 1) ? 
              malloc(sizeof(ClHandler *)) : 
              realloc(handlers, handlers_length*sizeof(ClHandler *));
   handlers[handlers_length-1] = handler;
+  PublishRegistry();
+  UpdateLevelMask();
+  pthread_mutex_unlock(&registry_mutex);
   return handler;
 }
 
@@ -433,221 +1125,5298 @@ ClHandler *ClCreateHandler(int fd, FILE *fp, ClStream stream_type, unsigned long
 void ClDeleteHandler(ClHandler *handler) {
   unsigned long i;
 
+  // Remove the handler from the array, and wait for the logging calls that may still be writing 
+  // to it before tearing it down
+  pthread_mutex_lock(&registry_mutex);
+  for(i = 0; i < handlers_length; i++) {
+    if(handlers[i] == handler) {
+      memmove(handlers+i, handlers+i+1, (handlers_length-i-1)*sizeof(ClHandler *));
+      handlers_length--;
+      i--;
+      continue;
+    }
+    if(handlers[i]->ring_dump == handler) {
+      handlers[i]->ring_dump = NULL;
+    }
+  }
+  PublishRegistry();
+  UpdateLevelMask();
+  SynchronizeRegistry();
+  if(handler->format != NULL) {
+    ReleaseFormat(handler->format, handler->parsed_format, handler->parsed_format_length, 
+                  handler->plan);
+    handler->format = NULL;
+  }
+  pthread_mutex_unlock(&registry_mutex);
+
+  // Background jobs (and timers) may still refer to the handler
+  if(handler->flush_policy == CL_FLUSH_TIME) {
+    RemoveTimer(handler);
+  }
+  if(handler->rolled_length > 0 || handler->flush_policy == CL_FLUSH_TIME) {
+    WaitJobs();
+  }
+
+  if(handler->io != CL_IO_WRITE) {
+    IoDetach(handler, 0);
+  }
+  if(handler->flush_buffer != NULL) {
+    FlushHandler(handler);
+    free(handler->flush_buffer);
+  }
   if(handler->fp != NULL) {
     fclose(handler->fp);
     handler->fp = NULL;
   }
-  if(handler->name != NULL) {
-    free(handler->name);
+  if(handler->stream_type == CL_STREAM_MMAP && handler->filename != NULL) {
+    // Only keep what was actually written to the segment
+    handler->stream_length = (unsigned long)(handler->map_cursor & CL_MAP_OFFSET_MASK);
+    if(handler->stream_length > handler->stream_max_length) {
+      handler->stream_length = handler->stream_max_length;
+    }
+    UnmapHandler(handler);
+  }
+  if(handler->binary_sites != NULL) {
+    free(handler->binary_sites);
   }
-  if(handler->extension != NULL) {
-    free(handler->extension);
+  if(handler->ring != NULL) {
+    free(handler->ring);
   }
-  if(handler->filename != NULL) {
-    free(handler->filename);
+  for(i = 0; i < handler->rolled_length; i++) {
+    free(handler->rolled[i]);
   }
-  if(handler->format != NULL) {
-    free(handler->format);
+  if(handler->rolled != NULL) {
+    free(handler->rolled);
   }
-  if(handler->parsed_format != NULL && handler->parsed_format_length != 0) {
-    for(i = 0; i < handler->parsed_format_length; i++) {
-      if(handler->parsed_format[i].context != NULL) {
-        free(handler->parsed_format[i].context);
-      }
+  if(handler->spill != NULL) {
+    // Give the pipe one last chance to take the records that were held back
+    if(PipeFlush(handler) != 0) {
+      PipeDrop(handler);
     }
-    free(handler->parsed_format);
+    free(handler->spill);
   }
+  pthread_mutex_destroy(&(handler->lock));
   free(handler);
 }
 
-// TODO: setters and getters (customize level and handler struct fields)
 
-// TODO: function (__FUNCTION__ or __func__) is not portable
-void ClLog(ClLogLevel level, const char *filename, long line, const char *function, 
-           const char *message, ...) {
-  unsigned long i;
-  unsigned long fn_len;
-  char *        fn_rolled;
-  FILE *        tp;
-  va_list       args;
+void ClSetHandlerLogging(ClHandler *handler, ClLogging logging) {
+  pthread_mutex_lock(&registry_mutex);
+  handler->logging = logging;
+  PublishRegistry();
+  UpdateLevelMask();
+  pthread_mutex_unlock(&registry_mutex);
+}
 
-  for(i = 0; i < handlers_length; i++) {
-    if(level >= handlers[i]->min_level && level <= handlers[i]->max_level) {
-      // Handle different methods of printing depending on the stream
-      switch(handlers[i]->stream_type) {
-        case CL_STREAM_CONSOLE:
-          va_start(args, message);
-          PrintMessage(handlers[i], level, filename, line, function, message, args);
-          va_end(args);
-          break;
-        case CL_STREAM_FILE:
-          va_start(args, message);
-          handlers[i]->stream_length += PrintMessage(handlers[i], level, filename, line, function, 
-                                                       message, args);
-          va_end(args);
-
-          // Perform log rollover if necessary
-          if(handlers[i]->stream_length > handlers[i]->stream_max_length) {
-            fn_len = (unsigned long)strlen(handlers[i]->filename);
-            while(1) {
-              // Set fn_rolled to be the new rollover file
-              fn_rolled = malloc((fn_len+3+(int)floor(log10(handlers[i]->rollover_count)))*sizeof(char));
-              sprintf(fn_rolled, "%s.%ld", handlers[i]->filename, handlers[i]->rollover_count);
-
-              // Try opening the new rollover file to see if it already exists
-              tp = fopen(fn_rolled, "r");
-              if(tp != NULL) {
-                // Already exists, free memory and check the next largest rollover number
-                fclose(tp);
-                tp = NULL;
-                free(fn_rolled);
-                handlers[i]->rollover_count++;
-              }
-              else {
-                // Doesn't exists, close and rename the current file to the rolled-over name
-                fclose(handlers[i]->fp);
-                handlers[i]->fp = NULL;
-                rename(handlers[i]->filename, fn_rolled);
-
-                // Create a new empty file with the regular filename to log future messages to
-                handlers[i]->fp = fopen(handlers[i]->filename, "a");
-                handlers[i]->rollover_count++;
-                handlers[i]->stream_length = 0;
-                break;
-              }
-            }
-          }
-          break;
-        case CL_STREAM_PIPE:
-          // TODO
-          break;
-        case CL_STREAM_STRING:
-          // TODO
-          break;
-        default:
-          // TODO: error mechanism?
-          break;
-      }
-    }
+
+int ClSetHandlerLevels(ClHandler *handler, ClLogLevel min_level, ClLogLevel max_level) {
+  if(min_level < CL_LOG_LEVEL_FATAL || max_level > CL_LOG_LEVEL_TRACE || min_level > max_level) {
+    return -1;
   }
+  pthread_mutex_lock(&registry_mutex);
+  handler->min_level = min_level;
+  handler->max_level = max_level;
+  PublishRegistry();
+  UpdateLevelMask();
+  pthread_mutex_unlock(&registry_mutex);
+  return 0;
 }
 
 
-static unsigned long PrintMessage(ClHandler *handler, ClLogLevel level, const char *filename, 
-                                  long line, const char *function, const char *message, va_list args) {
-  unsigned long i;
-  unsigned long len = 0;
-  unsigned long tm_len = 0;
-  unsigned long tm_max = 64;
-  char *        tm;
-  time_t        raw_time;
+void ClSetHandlerFormat(ClHandler *handler, char *format) {
+  char *         previous_format;
+  ClFormatPart * previous_parsed_format;
+  unsigned long  previous_parsed_format_length;
+  ClPlan *       previous_plan;
 
-  for(i = 0; i < handler->parsed_format_length; i++) {
-    switch(handler->parsed_format[i].type) {
-      case CL_FORMAT_TYPE_STRING:
-      case CL_FORMAT_TYPE_SGR_MODIFY:
-      case CL_FORMAT_TYPE_SGR_RESET:
-        len += fprintf(handler->fp, "%s", handler->parsed_format[i].context);
-        break;
-      case CL_FORMAT_TYPE_MESSAGE:
-        len += vfprintf(handler->fp, message, args);
-        break;
-      case CL_FORMAT_TYPE_LEVEL:
-        len += fprintf(handler->fp, "%s", levels[level].parsed_level);
-        break;
-      case CL_FORMAT_TYPE_FILENAME:
-        len += fprintf(handler->fp, "%s", filename);
-        break;
-      case CL_FORMAT_TYPE_LINE_NUMBER:
-        len += fprintf(handler->fp, "%ld", line);
-        break;
-      case CL_FORMAT_TYPE_FUNCTION:
-        len += fprintf(handler->fp, "%s", function);
-        break;
-      case CL_FORMAT_TYPE_TIME:
-        tm = malloc(tm_max*sizeof(char));
-        time(&raw_time);
-        do {
-          tm_len = strftime(tm, tm_max, handler->parsed_format[i].context, localtime(&raw_time));
-          if(tm_len == 0) {
-            tm_max *= 2;
-            tm = realloc(tm, tm_max*sizeof(char));
-          }
-        } while(tm_len == 0);
-        len += fprintf(handler->fp, "%s", tm);
-        free(tm);
-        break;
-      case CL_FORMAT_TYPE_DURATION:
-        // TODO: strftime like function to print duration in terms of weeks/days/hours/minutes/seconds
-        break;
-      case CL_FORMAT_TYPE_ROLLOVER:
-        len += fprintf(handler->fp, "%ld", handler->rollover_count);
-        break;
-      case CL_FORMAT_TYPE_PUBLIC_IP:
-        // TODO
-        break;
-      case CL_FORMAT_TYPE_PRIVATE_IP:
-        // TODO
-        break;
-      case CL_FORMAT_TYPE_PROC_ID:
-        // TODO
-        break;
-      case CL_FORMAT_TYPE_PROC_NAME:
-        // TODO
-        break;
-      case CL_FORMAT_TYPE_PROC_EXEC:
-        // TODO
-        break;
-      case CL_FORMAT_TYPE_PROC_USER:
-        // TODO
-        break;
-      case CL_FORMAT_TYPE_THREAD_ID:
-        // TODO: portability
-        len += fprintf(handler->fp, "%d", (pid_t)syscall(SYS_gettid));
-        break;
-      case CL_FORMAT_TYPE_PTHREAD_ID:
-        // TODO: Not portable, maybe allow the user to pass a function pointer for this?
-        // https://stackoverflow.com/questions/34370172/the-thread-id-returned-by-pthread-self-is-not-the-same-thing-as-the-kernel-thr
-        len += fprintf(handler->fp, "%ld", (long)pthread_self());
-        break;
-      default:
-        // TODO: need to handle? no?
-        break;
+  pthread_mutex_lock(&registry_mutex);
+  previous_format = handler->format;
+  previous_parsed_format = handler->parsed_format;
+  previous_parsed_format_length = handler->parsed_format_length;
+  previous_plan = handler->plan;
+  handler->parsed_format = NULL;
+  handler->plan = NULL;
+  AttachFormat(handler, format);
+
+  // A binary file describes the format in its header, so it starts over in a new file
+  pthread_mutex_lock(&(handler->lock));
+  if(handler->encoding == CL_ENCODING_BINARY && handler->stream_length > 0 && 
+     strcmp(previous_format, handler->format) != 0) {
+    RolloverHandler(handler);
+  }
+  pthread_mutex_unlock(&(handler->lock));
+
+  // The previous format is freed once no logging call can still be rendering with it
+  PublishRegistry();
+  SynchronizeRegistry();
+  ReleaseFormat(previous_format, previous_parsed_format, previous_parsed_format_length, 
+                previous_plan);
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+
+int ClSetHandlerEncoding(ClHandler *handler, ClEncoding encoding) {
+  unsigned long *binary_sites;
+
+  if(encoding == CL_ENCODING_BINARY && handler->stream_type != CL_STREAM_FILE) {
+    return -1;
+  }
+  else if(encoding != CL_ENCODING_BINARY && encoding != CL_ENCODING_TEXT && 
+          encoding != CL_ENCODING_JSON) {
+    return -1;
+  }
+  pthread_mutex_lock(&registry_mutex);
+  if(encoding == handler->encoding) {
+    pthread_mutex_unlock(&registry_mutex);
+    return 0;
+  }
+
+  // Never mix encodings within a single file. Mapped files are written to without the lock, so 
+  // their segment is closed the way writers close it, and other streams are framed by lines
+  if(handler->stream_type == CL_STREAM_FILE) {
+    pthread_mutex_lock(&(handler->lock));
+    if(handler->stream_length > 0) {
+      RolloverHandler(handler);
     }
+    pthread_mutex_unlock(&(handler->lock));
+  }
+  else if(handler->stream_type == CL_STREAM_MMAP) {
+    MapRollover(handler);
   }
 
-  len += fprintf(handler->fp, "\n");
-  fflush(handler->fp);
-  return len;
+  // The call site bitmap has to exist before logging calls see the binary encoding, and can only 
+  // go away once none of them can still be using it
+  if(encoding == CL_ENCODING_BINARY) {
+    // One bit for the file header, plus one for each call site that could be described
+    handler->binary_sites = calloc(CL_SITE_COUNT/(8*sizeof(unsigned long)), sizeof(unsigned long));
+    handler->encoding = encoding;
+    PublishRegistry();
+  }
+  else {
+    binary_sites = handler->binary_sites;
+    handler->encoding = encoding;
+    PublishRegistry();
+    SynchronizeRegistry();
+    handler->binary_sites = NULL;
+    free(binary_sites);
+  }
+  UpdateLevelMask();
+  pthread_mutex_unlock(&registry_mutex);
+  return 0;
 }
 
 
-static void ParseFormat(char *format, ClFormatPart **parsed_format, 
-                        unsigned long *parsed_format_length) {
-  unsigned long i;
-  unsigned long j;
-  unsigned long old_i;
-  unsigned long old_j;
-  unsigned long len = 0;
-  unsigned long format_len = (unsigned long)strlen(format);
+int ClSetHandlerCompression(ClHandler *handler, ClCompression compression) {
+  if(handler->stream_type != CL_STREAM_FILE && handler->stream_type != CL_STREAM_MMAP) {
+    return -1;
+  }
+  if(compression != CL_COMPRESSION_NONE && compression != CL_COMPRESSION_GZIP) {
+    return -1;
+  }
+  // Mapped files are rolled over without the lock, so the policy is also stored atomically
+  pthread_mutex_lock(&(handler->lock));
+  __atomic_store_n(&(handler->compression), compression, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&(handler->lock));
+  return 0;
+}
 
-  // Create the format part(s) that correspond to each specifier, as well as each static string of 
-  // characters within the format string. i and j start at the beginning of the string and i is 
-  // incremented until a specifier is found, at which point the difference between i and j is used 
-  // to capture the static string preceeding the specifier, then the specifier is captured, then j   
-  // is set to the position just after the specifier to prepare for capturing the next sequence.
-  for(i = 0, j = 0; i < format_len; i++) {
-    if(format[i] == '%') {
-      switch(format[i+1]) {
-        case 'm':
-          CreateFormatParts(format, parsed_format, &len, i, j);
-          (*parsed_format)[len].type = CL_FORMAT_TYPE_MESSAGE;
-          (*parsed_format)[len].context = NULL;
-          len++;
-          // Set i to to be the specifier symbol (in this case the 'L') and set j to be the 
-          // character that follows it
-          i++;
-          j = i + 1;
+
+int ClSetHandlerRollover(ClHandler *handler, ClRolloverInterval interval) {
+  struct stat st;
+  time_t      now = time(NULL);
+  time_t      start = 0;
+  time_t      boundary = CL_TIME_NEVER;
+  int         written;
+
+  if(handler->stream_type != CL_STREAM_FILE && handler->stream_type != CL_STREAM_MMAP) {
+    return -1;
+  }
+  if(interval != CL_ROLLOVER_NONE && interval != CL_ROLLOVER_HOURLY && 
+     interval != CL_ROLLOVER_DAILY) {
+    return -1;
+  }
+
+  // A file that already has content belongs to the interval it was last written in. The interval 
+  // is changed under the lock RolloverHandler() holds, and the boundary that writers check without 
+  // it is published last
+  pthread_mutex_lock(&(handler->lock));
+  if(interval != CL_ROLLOVER_NONE) {
+    written = (handler->stream_type == CL_STREAM_MMAP) ? 
+              (__atomic_load_n(&(handler->map_cursor), __ATOMIC_ACQUIRE) & CL_MAP_OFFSET_MASK) > 0 : 
+              handler->stream_length > 0;
+    if(written && stat(handler->filename, &st) == 0) {
+      now = st.st_mtime;
+    }
+    RolloverInterval(interval, now, &start, &boundary);
+  }
+  handler->rollover_interval = interval;
+  handler->rollover_start = start;
+  __atomic_store_n(&(handler->rollover_boundary), boundary, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&(handler->lock));
+  return 0;
+}
+
+
+int ClSetHandlerFlush(ClHandler *handler, ClFlushPolicy policy, unsigned long value, 
+                      ClLogLevel flush_level) {
+  char *        buffer = NULL;
+  unsigned long capacity = 0;
+  ClIo          io;
+  int           result = 0;
+
+  if(handler->stream_type != CL_STREAM_CONSOLE && handler->stream_type != CL_STREAM_FILE) {
+    return -1;
+  }
+  if(policy != CL_FLUSH_RECORD && policy != CL_FLUSH_RECORDS && policy != CL_FLUSH_BYTES && 
+     policy != CL_FLUSH_TIME) {
+    return -1;
+  }
+  if((policy != CL_FLUSH_RECORD && value == 0) || flush_level < CL_LOG_LEVEL_FATAL || 
+     flush_level > CL_LOG_LEVEL_TRACE) {
+    return -1;
+  }
+  if(policy != CL_FLUSH_RECORD) {
+    capacity = (policy == CL_FLUSH_BYTES) ? value : CL_FLUSH_LENGTH;
+    buffer = malloc(capacity*sizeof(char));
+    if(buffer == NULL) {
+      return -1;
+    }
+  }
+
+  // Stop the previous timer first, the background thread won't flush the handler from then on
+  if(handler->flush_policy == CL_FLUSH_TIME) {
+    RemoveTimer(handler);
+    WaitJobs();
+  }
+
+  // The buffers of the io_uring or O_DIRECT backend are sized after the policy, so the backend is 
+  // set up again along with it, or the handler falls back to write() with a buffer of its own
+  pthread_mutex_lock(&(handler->lock));
+  io = handler->io;
+  if(io != CL_IO_WRITE) {
+    IoDetach(handler, 0);
+  }
+  if(handler->flush_buffer != NULL) {
+    FlushHandler(handler);
+    free(handler->flush_buffer);
+  }
+  handler->flush_policy = policy;
+  handler->flush_value = value;
+  handler->flush_level = flush_level;
+  handler->flush_buffer = buffer;
+  handler->flush_capacity = capacity;
+  if(io != CL_IO_WRITE) {
+    result = IoAttach(handler, io);
+  }
+  pthread_mutex_unlock(&(handler->lock));
+
+  if(policy == CL_FLUSH_TIME) {
+    pthread_mutex_lock(&jobs_mutex);
+    if(StartJobs() != 0) {
+      // Without the background thread, records are never held back for long
+      handler->flush_level = CL_LOG_LEVEL_TRACE;
+    }
+    else {
+      handler->flush_deadline = CurrentMilliseconds() + value;
+      jobs_timers = realloc(jobs_timers, (jobs_timers_length+1)*sizeof(ClHandler *));
+      jobs_timers[jobs_timers_length++] = handler;
+      pthread_cond_signal(&jobs_cond);
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+  }
+  return result;
+}
+
+
+void ClFlush() {
+  unsigned long i;
+
+  pthread_mutex_lock(&registry_mutex);
+  for(i = 0; i < handlers_length; i++) {
+    if(handlers[i]->flush_buffer != NULL) {
+      pthread_mutex_lock(&(handlers[i]->lock));
+      FlushHandler(handlers[i]);
+      if(handlers[i]->uring != NULL) {
+        UringDrain(handlers[i]);
+      }
+      pthread_mutex_unlock(&(handlers[i]->lock));
+    }
+    else if(handlers[i]->spill != NULL) {
+      pthread_mutex_lock(&(handlers[i]->lock));
+      PipeFlush(handlers[i]);
+      pthread_mutex_unlock(&(handlers[i]->lock));
+    }
+  }
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+
+int ClSetHandlerIo(ClHandler *handler, ClIo io) {
+  int result = 0;
+
+  if(handler->stream_type != CL_STREAM_FILE || 
+     (io != CL_IO_WRITE && io != CL_IO_URING && io != CL_IO_DIRECT)) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&(handler->lock));
+  if(io != handler->io) {
+    if(handler->io != CL_IO_WRITE) {
+      IoDetach(handler, 1);
+    }
+    result = IoAttach(handler, io);
+  }
+  pthread_mutex_unlock(&(handler->lock));
+  return result;
+}
+
+
+int ClGetHandlerSnapshot(ClHandler *handler, ClSnapshot *snapshot) {
+  char *        newline;
+  unsigned long offset;
+  unsigned long size = handler->stream_max_length;
+  uint64_t      head;
+
+  memset(snapshot, 0, sizeof(ClSnapshot));
+  if(handler->stream_type != CL_STREAM_STRING) {
+    return -1;
+  }
+
+  // Until the ring wraps around, it's a single span from the start
+  head = __atomic_load_n(&(handler->ring_head), __ATOMIC_ACQUIRE);
+  if(head <= size) {
+    snapshot->first = handler->ring;
+    snapshot->first_length = (unsigned long)head;
+    return 0;
+  }
+
+  // Otherwise the oldest bytes run from the head to the end of the ring, followed by the newest 
+  // from the start of the ring up to the head
+  offset = (unsigned long)(head & (size-1));
+  snapshot->first = handler->ring+offset;
+  snapshot->first_length = size-offset;
+  snapshot->second = handler->ring;
+  snapshot->second_length = offset;
+
+  // The oldest record was partly overwritten, so start at the first complete one
+  newline = memchr(snapshot->first, '\n', snapshot->first_length);
+  if(newline != NULL) {
+    snapshot->first_length -= (unsigned long)(newline+1-snapshot->first);
+    snapshot->first = newline+1;
+  }
+  else {
+    newline = memchr(snapshot->second, '\n', snapshot->second_length);
+    snapshot->first = NULL;
+    snapshot->first_length = 0;
+    if(newline != NULL) {
+      snapshot->second_length -= (unsigned long)(newline+1-snapshot->second);
+      snapshot->second = newline+1;
+    }
+  }
+  if(snapshot->first_length == 0) {
+    snapshot->first = snapshot->second;
+    snapshot->first_length = snapshot->second_length;
+    snapshot->second = NULL;
+    snapshot->second_length = 0;
+  }
+  return 0;
+}
+
+
+int ClSetHandlerDump(ClHandler *handler, ClHandler *target) {
+  if(handler->stream_type != CL_STREAM_STRING || handler == target || 
+     (target != NULL && target->encoding != CL_ENCODING_TEXT)) {
+    return -1;
+  }
+  pthread_mutex_lock(&registry_mutex);
+  handler->ring_dump = target;
+  pthread_mutex_unlock(&registry_mutex);
+  return 0;
+}
+
+
+int ClSetThreadName(const char *name) {
+  unsigned long length;
+
+  if(name == NULL) {
+    return -1;
+  }
+  length = strnlen(name, CL_THREAD_NAME_LENGTH-1);
+  memcpy(thread_name_cache, name, length);
+  thread_name_cache[length] = '\0';
+  return 0;
+}
+
+
+int ClSetClockSource(ClClockSource source) {
+  struct timespec now;
+
+  if(source != CL_CLOCK_REALTIME && source != CL_CLOCK_COARSE && source != CL_CLOCK_TSC) {
+    return -1;
+  }
+  if(source == CL_CLOCK_COARSE && clock_gettime(CLOCK_REALTIME_COARSE, &now) != 0) {
+    return -1;
+  }
+  if(source == CL_CLOCK_TSC) {
+    return StartTsc();
+  }
+  __atomic_store_n(&clock_source, source, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// TODO: setters and getters (customize level and handler struct fields)
+
+// TODO: function (__FUNCTION__ or __func__) is not portable
+void ClLog(ClLogLevel level, const char *filename, long line, const char *function, 
+           const char *message, ...) {
+  int           len;
+  long          encoded;
+  char          data[CL_MESSAGE_LENGTH];
+  ClBuffer      buffer = {data, 0, CL_MESSAGE_LENGTH, 0};
+  unsigned char arguments[CL_MESSAGE_LENGTH];
+  ClSite *      site;
+  ClRecord      record;
+  va_list       args;
+
+  record.level = level;
+  record.filename = filename;
+  record.line = line;
+  record.function = function;
+  CaptureTime(&record);
+  record.thread_id = CurrentThreadId();
+  record.pthread_id = pthread_self();
+  CurrentThreadName(record.thread_name);
+  record.process = &process_identity;
+  record.site = NULL;
+  record.arguments = NULL;
+  record.arguments_length = 0;
+  record.fields = NULL;
+  record.fields_length = 0;
+
+  // In asynchronous mode, the record is handed off to the writer thread as-is
+  if(__atomic_load_n(&async_running, __ATOMIC_RELAXED)) {
+    va_start(args, message);
+    len = AsyncLog(&record, message, &args);
+    va_end(args);
+    if(len) {
+      return;
+    }
+  }
+
+  // Binary handlers only need the raw arguments, which are much cheaper to capture than the text. 
+  // If no text handler wants the record either, formatting the message is skipped altogether
+  if(__atomic_load_n(&binary_level_mask, __ATOMIC_RELAXED) & (1u << level)) {
+    site = FindSite(filename, line, function, message);
+    if(site != NULL) {
+      va_start(args, message);
+      encoded = EncodeArguments(site, args, arguments, CL_MESSAGE_LENGTH);
+      va_end(args);
+      if(encoded >= 0) {
+        record.site = site;
+        record.arguments = arguments;
+        record.arguments_length = (unsigned long)encoded;
+      }
+    }
+    if(record.site != NULL && 
+       (__atomic_load_n(&text_level_mask, __ATOMIC_RELAXED) & (1u << level)) == 0) {
+      record.message = NULL;
+      record.message_length = 0;
+      DispatchRecord(&record);
+      return;
+    }
+  }
+
+  // Format the message once up front rather than once per handler, on the stack unless it's long
+  va_start(args, message);
+  FormatMessage(&buffer, message, args);
+  va_end(args);
+  record.message = buffer.data;
+  record.message_length = buffer.length;
+
+  DispatchRecord(&record);
+
+  if(buffer.on_heap) {
+    free(buffer.data);
+  }
+}
+
+
+void ClLogKv(ClLogLevel level, const char *filename, long line, const char *function, 
+             const char *message, const ClField *fields, unsigned long fields_length) {
+  ClRecord record;
+
+  record.level = level;
+  record.filename = filename;
+  record.line = line;
+  record.function = function;
+  CaptureTime(&record);
+  record.thread_id = CurrentThreadId();
+  record.pthread_id = pthread_self();
+  CurrentThreadName(record.thread_name);
+  record.process = &process_identity;
+  record.message = (message != NULL) ? message : "";
+  record.message_length = strlen(record.message);
+  record.site = NULL;
+  record.arguments = NULL;
+  record.arguments_length = 0;
+  record.fields = fields;
+  record.fields_length = fields_length;
+
+  // The message is used as it is, so there's nothing to format, only the fields to copy when the 
+  // record is handed off to the writer thread
+  if(__atomic_load_n(&async_running, __ATOMIC_RELAXED) && AsyncLog(&record, record.message, NULL)) {
+    return;
+  }
+  DispatchRecord(&record);
+}
+
+
+int ClDecode(FILE *input, FILE *output) {
+  int           tag;
+  int           status = 0;
+  char          magic[sizeof(binary_magic)];
+  char          stack_buffer[CL_RENDER_LENGTH];
+  char          stack_message[CL_MESSAGE_LENGTH];
+  char *        text = NULL;
+  unsigned char level;
+  unsigned char version;
+  unsigned char layout[sizeof(binary_layout)];
+  unsigned char *arguments = NULL;
+  unsigned long i;
+  unsigned long sites_capacity = 0;
+  uint32_t      id;
+  uint32_t      nanoseconds;
+  uint32_t      length;
+  int32_t       thread_id;
+  int32_t       process_id;
+  int64_t       line;
+  int64_t       seconds;
+  uint64_t      value;
+  uuid_t        handler_id;
+  char *        identity[3] = {NULL, NULL, NULL};
+  ClProcess     process;
+  ClSite **     decoded_sites = NULL;
+  ClSite *      site = NULL;
+  ClHandler     handler;
+  ClEntry       entry;
+  ClRecord      record;
+  ClBuffer      buffer;
+  ClBuffer      message;
+
+  // Records are rendered with a handler that only lives as long as the decoding, configured from 
+  // the header at the start of each file
+  memset(&handler, 0, sizeof(ClHandler));
+  buffer.data = stack_buffer;
+  buffer.capacity = CL_RENDER_LENGTH;
+  buffer.on_heap = 0;
+  message.data = stack_message;
+  message.capacity = CL_MESSAGE_LENGTH;
+  message.on_heap = 0;
+  memset(&process, 0, sizeof(ClProcess));
+
+  while((tag = fgetc(input)) != EOF) {
+    memset(&record, 0, sizeof(ClRecord));
+    site = NULL;
+    buffer.length = 0;
+    message.length = 0;
+
+    if(tag == binary_header) {
+      if(DecodeBytes(input, magic, sizeof(magic)) != 0 || 
+         memcmp(magic, binary_magic, sizeof(magic)) != 0 || 
+         DecodeBytes(input, &version, 1) != 0 || version != binary_version || 
+         DecodeBytes(input, layout, sizeof(layout)) != 0 || 
+         memcmp(layout, binary_layout, sizeof(layout)) != 0 || 
+         DecodeBytes(input, handler_id, sizeof(uuid_t)) != 0 || 
+         DecodeBytes(input, &value, sizeof(uint64_t)) != 0 || 
+         (text = DecodeString(input)) == NULL || 
+         (identity[0] = DecodeString(input)) == NULL || 
+         (identity[1] = DecodeString(input)) == NULL || 
+         (identity[2] = DecodeString(input)) == NULL) {
+        status = -1;
+        break;
+      }
+
+      // Records are printed with the identity of the process that wrote them, not this one's
+      SetProcessText(&process, identity[0], identity[1], identity[2]);
+      for(i = 0; i < 3; i++) {
+        free(identity[i]);
+        identity[i] = NULL;
+      }
+
+      // Site IDs are only meaningful to the handler that assigned them, and stay valid across the 
+      // files it rolls over to
+      if(handler.format == NULL || uuid_compare(handler.id, handler_id) != 0) {
+        for(i = 0; i < sites_capacity; i++) {
+          if(decoded_sites[i] != NULL) {
+            free(decoded_sites[i]->filename);
+            free(decoded_sites[i]->function);
+            free(decoded_sites[i]->message);
+            free(decoded_sites[i]);
+            decoded_sites[i] = NULL;
+          }
+        }
+        uuid_copy(handler.id, handler_id);
+      }
+      handler.rollover_count = (unsigned long)value;
+      if(handler.format == NULL || strcmp(handler.format, text) != 0) {
+        if(handler.format != NULL) {
+          free(handler.format);
+          DeleteFormat(handler.parsed_format, handler.parsed_format_length);
+          DeletePlan(handler.plan);
+          handler.parsed_format = NULL;
+        }
+        handler.format = text;
+        ParseFormat(handler.format, &(handler.parsed_format), &(handler.parsed_format_length));
+        handler.plan = CompileFormat(handler.parsed_format, handler.parsed_format_length);
+      }
+      else {
+        free(text);
+      }
+      text = NULL;
+      continue;
+    }
+    else if(handler.format == NULL) {
+      // Anything else has to come after a header
+      status = -1;
+      break;
+    }
+    else if(tag == binary_site) {
+      site = malloc(sizeof(ClSite));
+      memset(site, 0, sizeof(ClSite));
+      if(DecodeBytes(input, &id, sizeof(uint32_t)) != 0 || id == 0 || id > CL_SITE_COUNT || 
+         DecodeBytes(input, &line, sizeof(int64_t)) != 0 || 
+         (site->filename = DecodeString(input)) == NULL || 
+         (site->function = DecodeString(input)) == NULL || 
+         (site->message = DecodeString(input)) == NULL) {
+        free(site->filename);
+        free(site->function);
+        free(site);
+        status = -1;
+        break;
+      }
+      site->id = id;
+      site->line = (long)line;
+      if(id >= sites_capacity) {
+        decoded_sites = realloc(decoded_sites, (id+1)*sizeof(ClSite *));
+        memset(decoded_sites+sites_capacity, 0, (id+1-sites_capacity)*sizeof(ClSite *));
+        sites_capacity = id+1;
+      }
+      if(decoded_sites[id] != NULL) {
+        free(decoded_sites[id]->filename);
+        free(decoded_sites[id]->function);
+        free(decoded_sites[id]->message);
+        free(decoded_sites[id]);
+      }
+      decoded_sites[id] = site;
+      continue;
+    }
+    else if(tag == binary_event) {
+      if(DecodeBytes(input, &id, sizeof(uint32_t)) != 0 || id >= sites_capacity || 
+         decoded_sites[id] == NULL) {
+        status = -1;
+        break;
+      }
+      site = decoded_sites[id];
+      record.filename = site->filename;
+      record.function = site->function;
+      record.line = site->line;
+    }
+    else if(tag != binary_text) {
+      status = -1;
+      break;
+    }
+
+    // Both kinds of records share the same fixed fields
+    if(DecodeBytes(input, &level, 1) != 0 || level >= default_level_count || 
+       DecodeBytes(input, &seconds, sizeof(int64_t)) != 0 || 
+       DecodeBytes(input, &nanoseconds, sizeof(uint32_t)) != 0 || 
+       DecodeBytes(input, &thread_id, sizeof(int32_t)) != 0 || 
+       DecodeBytes(input, &value, sizeof(uint64_t)) != 0 || 
+       DecodeBytes(input, &process_id, sizeof(int32_t)) != 0 || nanoseconds >= 1000000000) {
+      status = -1;
+      break;
+    }
+    record.level = (ClLogLevel)level;
+    record.time.tv_sec = (time_t)seconds;
+    record.time.tv_nsec = (long)nanoseconds;
+    record.ticks = 0;
+    record.thread_id = (pid_t)thread_id;
+    record.pthread_id = (pthread_t)value;
+    if(process.id != (pid_t)process_id || process.id_length == 0) {
+      SetProcessId(&process, (pid_t)process_id);
+    }
+    record.process = &process;
+    if(handler.plan->thread_names) {
+      if((text = DecodeString(input)) == NULL) {
+        status = -1;
+        break;
+      }
+      strncpy(record.thread_name, text, CL_THREAD_NAME_LENGTH-1);
+      free(text);
+      text = NULL;
+    }
+    record.uptime = 0;
+    if(handler.plan->durations && DecodeBytes(input, &(record.uptime), sizeof(int64_t)) != 0) {
+      status = -1;
+      break;
+    }
+
+    if(tag == binary_text) {
+      if(DecodeBytes(input, &line, sizeof(int64_t)) != 0 || 
+         (record.filename = DecodeString(input)) == NULL || 
+         (record.function = DecodeString(input)) == NULL || 
+         (text = DecodeString(input)) == NULL) {
+        free((char *)record.filename);
+        free((char *)record.function);
+        status = -1;
+        break;
+      }
+      record.line = (long)line;
+      record.message = text;
+      record.message_length = strlen(text);
+    }
+    else {
+      // Rebuild the message from the call site's format string and the captured arguments, which 
+      // takes the site to have been described first
+      if(site == NULL || DecodeBytes(input, &length, sizeof(uint32_t)) != 0 || 
+         length > (1u << 24)) {
+        status = -1;
+        break;
+      }
+      arguments = malloc(length+1);
+      if(DecodeBytes(input, arguments, length) != 0 || 
+         ReplayMessage(site->message, arguments, length, &message) != 0) {
+        status = -1;
+        break;
+      }
+      free(arguments);
+      arguments = NULL;
+      record.message = message.data;
+      record.message_length = message.length;
+    }
+
+    entry.handler = &handler;
+    entry.format = handler.format;
+    entry.parsed_format = handler.parsed_format;
+    entry.parsed_format_length = handler.parsed_format_length;
+    entry.plan = handler.plan;
+    RenderMessage(&entry, &record, &buffer);
+    fwrite(buffer.data, 1, buffer.length, output);
+
+    if(tag == binary_text) {
+      free((char *)record.filename);
+      free((char *)record.function);
+      free(text);
+      text = NULL;
+    }
+  }
+
+  if(arguments != NULL) {
+    free(arguments);
+  }
+  free(text);
+  for(i = 0; i < 3; i++) {
+    free(identity[i]);
+  }
+  for(i = 0; i < sites_capacity; i++) {
+    if(decoded_sites[i] != NULL) {
+      free(decoded_sites[i]->filename);
+      free(decoded_sites[i]->function);
+      free(decoded_sites[i]->message);
+      free(decoded_sites[i]);
+    }
+  }
+  if(decoded_sites != NULL) {
+    free(decoded_sites);
+  }
+  if(handler.format != NULL) {
+    free(handler.format);
+    DeleteFormat(handler.parsed_format, handler.parsed_format_length);
+    DeletePlan(handler.plan);
+  }
+  if(buffer.on_heap) {
+    free(buffer.data);
+  }
+  if(message.on_heap) {
+    free(message.data);
+  }
+  return status;
+}
+
+
+static void UpdateLevelMask() {
+  unsigned long i;
+  unsigned int  mask;
+  unsigned int  text_mask = 0;
+  unsigned int  binary_mask = 0;
+  ClLogLevel    level;
+
+  for(i = 0; i < handlers_length; i++) {
+    if(handlers[i]->logging == CL_LOGGING_ON) {
+      mask = 0;
+      for(level = handlers[i]->min_level; level <= handlers[i]->max_level; level++) {
+        mask |= 1u << level;
+      }
+      if(handlers[i]->encoding == CL_ENCODING_BINARY) {
+        binary_mask |= mask;
+      }
+      else {
+        text_mask |= mask;
+      }
+    }
+  }
+  __atomic_store_n(&text_level_mask, text_mask, __ATOMIC_RELAXED);
+  __atomic_store_n(&binary_level_mask, binary_mask, __ATOMIC_RELAXED);
+  __atomic_store_n(&cl_level_mask, text_mask | binary_mask, __ATOMIC_RELAXED);
+}
+
+
+static void PublishRegistry() {
+  unsigned long i;
+  int           durations = 0;
+  ClRegistry *  next = NULL;
+  ClRegistry *  previous;
+
+  if(handlers_length > 0) {
+    next = malloc(sizeof(ClRegistry) + handlers_length*sizeof(ClEntry));
+    next->retired = NULL;
+    next->length = handlers_length;
+  }
+  for(i = 0; i < handlers_length; i++) {
+    next->entries[i].handler = handlers[i];
+    next->entries[i].logging = handlers[i]->logging;
+    next->entries[i].min_level = handlers[i]->min_level;
+    next->entries[i].max_level = handlers[i]->max_level;
+    next->entries[i].encoding = handlers[i]->encoding;
+    next->entries[i].format = handlers[i]->format;
+    next->entries[i].parsed_format = handlers[i]->parsed_format;
+    next->entries[i].parsed_format_length = handlers[i]->parsed_format_length;
+    next->entries[i].plan = handlers[i]->plan;
+    if(handlers[i]->encoding == CL_ENCODING_JSON) {
+      next->entries[i].plan = handlers[i]->plan->json;
+    }
+    durations |= next->entries[i].plan->durations;
+  }
+
+  // The monotonic clock is only read for records while some handler prints the duration
+  __atomic_store_n(&uptime_wanted, durations, __ATOMIC_RELAXED);
+
+  // Swap the registry in. Waiting for the previous one to be let go of is left to whoever has 
+  // something else to free, so adding or enabling a handler never waits on logging calls
+  previous = __atomic_exchange_n(&registry, next, __ATOMIC_SEQ_CST);
+  if(previous != NULL) {
+    previous->retired = registry_retired;
+    registry_retired = previous;
+  }
+}
+
+
+static void SynchronizeRegistry() {
+  unsigned long i;
+  unsigned long epoch;
+  ClRegistry *  previous;
+
+  // Logging calls that start from now on see the current registry, so only those that announced 
+  // themselves under the previous epoch have to be waited for. Each stripe only has to be seen 
+  // empty once, since anyone joining it late backs off when they notice the epoch changed
+  epoch = __atomic_fetch_add(&registry_epoch, 1, __ATOMIC_SEQ_CST);
+  for(i = 0; i < CL_READER_STRIPES; i++) {
+    while(__atomic_load_n(&(registry_readers[i].count[epoch & 1]), __ATOMIC_SEQ_CST) != 0) {
+      sched_yield();
+    }
+  }
+
+  // Nothing can be reading the registries that were replaced before then anymore
+  while(registry_retired != NULL) {
+    previous = registry_retired;
+    registry_retired = previous->retired;
+    free(previous);
+  }
+}
+
+
+static ClRegistry *EnterRegistry(unsigned long **reader) {
+  unsigned long  epoch;
+  unsigned long *count;
+  ClReaders *    readers = &(registry_readers[(unsigned long)CurrentThreadId() % CL_READER_STRIPES]);
+
+  while(1) {
+    epoch = __atomic_load_n(&registry_epoch, __ATOMIC_SEQ_CST);
+    count = &(readers->count[epoch & 1]);
+    __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&registry_epoch, __ATOMIC_SEQ_CST) == epoch) {
+      break;
+    }
+    __atomic_sub_fetch(count, 1, __ATOMIC_RELEASE);
+  }
+  *reader = count;
+  return __atomic_load_n(&registry, __ATOMIC_SEQ_CST);
+}
+
+
+static void ExitRegistry(unsigned long *reader) {
+  __atomic_sub_fetch(reader, 1, __ATOMIC_RELEASE);
+}
+
+
+static void AttachFormat(ClHandler *handler, const char *format) {
+  unsigned long i;
+
+  if(format == NULL || strlen(format) == 0) {
+    format = default_format;
+  }
+  handler->format = malloc((1+strlen(format))*sizeof(char));
+  strcpy(handler->format, format);
+
+  // Handlers with the same format share a single parsed format, which also lets ClLog() render a 
+  // record once for all of them
+  for(i = 0; i < handlers_length; i++) {
+    if(handlers[i] != handler && strcmp(handlers[i]->format, handler->format) == 0) {
+      handler->parsed_format = handlers[i]->parsed_format;
+      handler->parsed_format_length = handlers[i]->parsed_format_length;
+      handler->plan = handlers[i]->plan;
+      return;
+    }
+  }
+  ParseFormat(handler->format, &(handler->parsed_format), &(handler->parsed_format_length));
+  handler->plan = CompileFormat(handler->parsed_format, handler->parsed_format_length);
+}
+
+
+static void ReleaseFormat(char *format, ClFormatPart *parsed_format, 
+                          unsigned long parsed_format_length, ClPlan *plan) {
+  unsigned long i;
+
+  free(format);
+  for(i = 0; i < handlers_length; i++) {
+    if(handlers[i]->parsed_format == parsed_format) {
+      return;
+    }
+  }
+  DeleteFormat(parsed_format, parsed_format_length);
+  DeletePlan(plan);
+}
+
+
+static pid_t CurrentThreadId() {
+  // TODO: portability
+  if(thread_id_cache == 0) {
+    thread_id_cache = (pid_t)syscall(SYS_gettid);
+  }
+  return thread_id_cache;
+}
+
+
+static void CurrentThreadName(char *output) {
+  // Threads that weren't given a name by ClSetThreadName() go by the one the kernel has for them
+  if(thread_name_cache[0] == '\0' && 
+     pthread_getname_np(pthread_self(), thread_name_cache, CL_THREAD_NAME_LENGTH) != 0) {
+    thread_name_cache[0] = '\0';
+  }
+  memcpy(output, thread_name_cache, CL_THREAD_NAME_LENGTH);
+}
+
+
+static void CaptureTime(ClRecord *record) {
+  struct timespec now;
+  ClClockSource   source = __atomic_load_n(&clock_source, __ATOMIC_RELAXED);
+  int             coarse = (source == CL_CLOCK_COARSE);
+
+  // The TSC is only read here, and converted by whoever writes the record out
+#if defined(__x86_64__)
+  if(source == CL_CLOCK_TSC) {
+    record->ticks = __rdtsc();
+    return;
+  }
+#endif
+
+  // Both clocks are read through the vDSO. The monotonic one is only read when a handler prints 
+  // the duration, and a coarse reading can fall a little behind the precise start time
+  clock_gettime(coarse ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &(record->time));
+  record->uptime = 0;
+  record->ticks = 0;
+  if(__atomic_load_n(&uptime_wanted, __ATOMIC_RELAXED)) {
+    clock_gettime(coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &now);
+    record->uptime = (int64_t)(now.tv_sec-start_time.tv_sec)*1000000000 + 
+                     (now.tv_nsec-start_time.tv_nsec);
+    if(record->uptime < 0) {
+      record->uptime = 0;
+    }
+  }
+}
+
+
+static int StartTsc() {
+#if defined(__x86_64__)
+  unsigned int    eax;
+  unsigned int    ebx;
+  unsigned int    ecx;
+  unsigned int    edx;
+  ClTsc           start;
+  ClTsc           measured;
+  struct timespec pause = {0, 10000000};
+
+  // CPUID leaf 0x80000007 sets bit 8 of EDX when the TSC is invariant. Otherwise its rate follows 
+  // the CPU's frequency, and no calibration holds for long
+  if(__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 || (edx & (1u << 8)) == 0) {
+    return -1;
+  }
+
+  // The first rate is measured over a short pause, without holding up the background worker
+  SampleTsc(&(start.ticks), &(start.realtime), &(start.monotonic));
+  start.scale = 0;
+  nanosleep(&pause, NULL);
+  MeasureTsc(&start, &measured);
+
+  // Records are only timestamped with the TSC once it's calibrated, and from then on the 
+  // background worker keeps the calibration fresh
+  pthread_mutex_lock(&jobs_mutex);
+  PublishTsc(&measured);
+  __atomic_store_n(&clock_source, CL_CLOCK_TSC, __ATOMIC_RELAXED);
+  if(StartJobs() == 0) {
+    pthread_cond_signal(&jobs_cond);
+  }
+  pthread_mutex_unlock(&jobs_mutex);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+
+static void MeasureTsc(const ClTsc *previous, ClTsc *measured) {
+  // The rate is measured against the monotonic clock, over the time since the previous sample
+  SampleTsc(&(measured->ticks), &(measured->realtime), &(measured->monotonic));
+  measured->scale = previous->scale;
+  if(measured->ticks > previous->ticks && measured->monotonic > previous->monotonic) {
+    measured->scale = (uint64_t)(((unsigned __int128)(uint64_t)(measured->monotonic-
+                                                                 previous->monotonic) << 32)/
+                                 (measured->ticks-previous->ticks));
+  }
+}
+
+
+static void PublishTsc(const ClTsc *measured) {
+  // Only called with the background worker's mutex held, so there's a single writer at a time
+  __atomic_store_n(&(tsc_clock.sequence), tsc_clock.sequence+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&(tsc_clock.ticks), measured->ticks, __ATOMIC_RELAXED);
+  __atomic_store_n(&(tsc_clock.realtime), measured->realtime, __ATOMIC_RELAXED);
+  __atomic_store_n(&(tsc_clock.monotonic), measured->monotonic, __ATOMIC_RELAXED);
+  __atomic_store_n(&(tsc_clock.scale), measured->scale, __ATOMIC_RELAXED);
+  __atomic_store_n(&(tsc_clock.sequence), tsc_clock.sequence+1, __ATOMIC_RELEASE);
+  tsc_clock.deadline = CurrentMilliseconds() + CL_TSC_REFRESH;
+}
+
+
+static void SampleTsc(uint64_t *ticks, int64_t *realtime, int64_t *monotonic) {
+#if defined(__x86_64__)
+  int             i;
+  uint64_t        before;
+  uint64_t        after;
+  uint64_t        closest = UINT64_MAX;
+  struct timespec real;
+  struct timespec mono;
+
+  // The clocks are read between two TSC readings and matched with the tick halfway between them, 
+  // keeping the closest of a few tries in case one gets interrupted
+  for(i = 0; i < 5; i++) {
+    before = __rdtsc();
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    after = __rdtsc();
+    if(after-before < closest) {
+      closest = after-before;
+      *ticks = before + (after-before)/2;
+      *realtime = (int64_t)real.tv_sec*1000000000 + real.tv_nsec;
+      *monotonic = (int64_t)mono.tv_sec*1000000000 + mono.tv_nsec;
+    }
+  }
+#else
+  *ticks = 0;
+  *realtime = 0;
+  *monotonic = 0;
+#endif
+}
+
+
+static void ConvertTicks(ClRecord *record) {
+  unsigned long sequence;
+  uint64_t      ticks;
+  uint64_t      scale;
+  int64_t       realtime;
+  int64_t       monotonic;
+  int64_t       elapsed;
+
+  do {
+    sequence = __atomic_load_n(&(tsc_clock.sequence), __ATOMIC_ACQUIRE);
+    ticks = __atomic_load_n(&(tsc_clock.ticks), __ATOMIC_RELAXED);
+    realtime = __atomic_load_n(&(tsc_clock.realtime), __ATOMIC_RELAXED);
+    monotonic = __atomic_load_n(&(tsc_clock.monotonic), __ATOMIC_RELAXED);
+    scale = __atomic_load_n(&(tsc_clock.scale), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while((sequence & 1) != 0 || 
+          __atomic_load_n(&(tsc_clock.sequence), __ATOMIC_RELAXED) != sequence);
+
+  // The record may have been taken before the calibration it's converted with, in which case the 
+  // elapsed time is negative
+  elapsed = (int64_t)(((__int128)(int64_t)(record->ticks-ticks)*(__int128)scale) >> 32);
+  realtime += elapsed;
+  record->time.tv_sec = (time_t)(realtime/1000000000);
+  record->time.tv_nsec = (long)(realtime%1000000000);
+  record->uptime = monotonic + elapsed - 
+                   ((int64_t)start_time.tv_sec*1000000000 + start_time.tv_nsec);
+  if(record->uptime < 0) {
+    record->uptime = 0;
+  }
+  record->ticks = 0;
+}
+
+
+static void CacheProcess() {
+  char            executable[PATH_MAX];
+  char            user[CL_PROCESS_TEXT_LENGTH];
+  char            entries[1024];
+  ssize_t         length;
+  struct passwd   entry;
+  struct passwd * result = NULL;
+
+  SetProcessId(&process_identity, getpid());
+  length = readlink("/proc/self/exe", executable, PATH_MAX-1);
+  executable[(length > 0) ? length : 0] = '\0';
+  if(getpwuid_r(geteuid(), &entry, entries, sizeof(entries), &result) != 0 || result == NULL) {
+    snprintf(user, CL_PROCESS_TEXT_LENGTH, "%u", (unsigned int)geteuid());
+  }
+  else {
+    snprintf(user, CL_PROCESS_TEXT_LENGTH, "%s", result->pw_name);
+  }
+  SetProcessText(&process_identity, program_invocation_short_name, executable, user);
+}
+
+
+static void RefreshProcess() {
+  // Runs in the child after a fork, where only the process and thread IDs have changed. Looking up 
+  // anything else isn't safe until the child execs anyway
+  SetProcessId(&process_identity, getpid());
+  thread_id_cache = 0;
+}
+
+
+static void SetProcessId(ClProcess *process, pid_t id) {
+  process->id = id;
+  process->id_length = FormatLong(process->id_text, (long)id);
+}
+
+
+static void SetProcessText(ClProcess *process, const char *name, const char *executable, 
+                           const char *user) {
+  process->name_length = strnlen(name, CL_PROCESS_TEXT_LENGTH-1);
+  memcpy(process->name, name, process->name_length);
+  process->name[process->name_length] = '\0';
+  process->executable_length = strnlen(executable, PATH_MAX-1);
+  memcpy(process->executable, executable, process->executable_length);
+  process->executable[process->executable_length] = '\0';
+  process->user_length = strnlen(user, CL_PROCESS_TEXT_LENGTH-1);
+  memcpy(process->user, user, process->user_length);
+  process->user[process->user_length] = '\0';
+
+  // Records reserve room for the longest string once for each part that prints one
+  process->longest = process->name_length;
+  if(process->executable_length > process->longest) {
+    process->longest = process->executable_length;
+  }
+  if(process->user_length > process->longest) {
+    process->longest = process->user_length;
+  }
+}
+
+
+static void DispatchRecord(ClRecord *record) {
+  unsigned long  i;
+  unsigned long *reader;
+  ClRegistry *   snapshot;
+  ClEntry *      entry;
+  ClHandler *    handler;
+  char           stack_buffer[CL_RENDER_LENGTH];
+  char           stack_message[CL_MESSAGE_LENGTH];
+  char           stack_binary[CL_MESSAGE_LENGTH];
+  ClBuffer       buffer;
+  ClBuffer       message;
+  ClBuffer       binary;
+  ClPlan *       rendered_plan = NULL;
+
+  buffer.data = stack_buffer;
+  buffer.length = 0;
+  buffer.capacity = CL_RENDER_LENGTH;
+  buffer.on_heap = 0;
+  message.data = stack_message;
+  message.length = 0;
+  message.capacity = CL_MESSAGE_LENGTH;
+  message.on_heap = 0;
+  binary.data = stack_binary;
+  binary.length = 0;
+  binary.capacity = CL_MESSAGE_LENGTH;
+  binary.on_heap = 0;
+
+  // A TSC reading is converted now, which is off the logging thread in asynchronous mode
+  if(record->ticks != 0) {
+    ConvertTicks(record);
+  }
+
+  // The handlers and their configuration stay as they were when the record started being written, 
+  // whatever other threads do to them in the meantime
+  snapshot = EnterRegistry(&reader);
+  for(i = 0; snapshot != NULL && i < snapshot->length; i++) {
+    entry = &(snapshot->entries[i]);
+    handler = entry->handler;
+    if(entry->logging == CL_LOGGING_ON && 
+       record->level >= entry->min_level && record->level <= entry->max_level) {
+      // Rolling over based on time only takes comparing against the precomputed end of the interval
+      if(record->time.tv_sec >= __atomic_load_n(&(handler->rollover_boundary), __ATOMIC_RELAXED)) {
+        RolloverOnTime(handler, record->time.tv_sec);
+      }
+
+      // Binary handlers write the call site and raw arguments (or the message, if it was formatted 
+      // because there's no call site) in place of the rendered record
+      if(entry->encoding == CL_ENCODING_BINARY) {
+        binary.length = 0;
+        pthread_mutex_lock(&(handler->lock));
+        EncodeRecord(entry, record, &binary);
+        StreamWrite(handler, binary.data, binary.length, record->level);
+        MarkSites(handler, record);
+        handler->stream_length += binary.length;
+        if(handler->stream_length > handler->stream_max_length) {
+          RolloverHandler(handler);
+        }
+        pthread_mutex_unlock(&(handler->lock));
+        continue;
+      }
+
+      // The message may have been left unformatted for binary handlers, in which case it's 
+      // rebuilt from the arguments the first time a text handler needs it
+      if(record->message == NULL) {
+        if(ReplayMessage(record->site->message, record->arguments, record->arguments_length, 
+                         &message) != 0) {
+          message.length = 0;
+        }
+        record->message = message.data;
+        record->message_length = message.length;
+      }
+
+      // Render the record, unless the previous handler already did so with the same format
+      if(entry->plan != rendered_plan) {
+        buffer.length = 0;
+        rendered_plan = RenderMessage(entry, record, &buffer) ? entry->plan : NULL;
+      }
+
+      WriteHandler(handler, buffer.data, buffer.length, record->level);
+
+      // A fatal record dumps whatever led up to it from the ring to another handler
+      if(record->level == CL_LOG_LEVEL_FATAL && handler->ring_dump != NULL) {
+        DumpRing(handler);
+      }
+    }
+  }
+  ExitRegistry(reader);
+
+  if(buffer.on_heap) {
+    free(buffer.data);
+  }
+  if(message.on_heap) {
+    free(message.data);
+  }
+  if(binary.on_heap) {
+    free(binary.data);
+  }
+}
+
+
+static void WriteHandler(ClHandler *handler, const char *data, unsigned long length, 
+                         ClLogLevel level) {
+  // Handle different methods of printing depending on the stream
+  switch(handler->stream_type) {
+    case CL_STREAM_CONSOLE:
+      pthread_mutex_lock(&(handler->lock));
+      StreamWrite(handler, data, length, level);
+      pthread_mutex_unlock(&(handler->lock));
+      break;
+    case CL_STREAM_FILE:
+      pthread_mutex_lock(&(handler->lock));
+      StreamWrite(handler, data, length, level);
+      handler->stream_length += length;
+
+      // Perform log rollover if necessary
+      if(handler->stream_length > handler->stream_max_length) {
+        RolloverHandler(handler);
+      }
+      pthread_mutex_unlock(&(handler->lock));
+      break;
+    case CL_STREAM_MMAP:
+      MapWrite(handler, data, length);
+      break;
+    case CL_STREAM_PIPE:
+      PipeWrite(handler, data, length);
+      break;
+    case CL_STREAM_STRING:
+      RingWrite(handler, data, length);
+      break;
+    default:
+      // TODO: error mechanism?
+      break;
+  }
+}
+
+
+static void StreamWrite(ClHandler *handler, const char *data, unsigned long length, 
+                        ClLogLevel level) {
+  // Records are dropped for as long as a file that was rolled over can't be opened again
+  if(handler->fp == NULL && OpenHandler(handler) != 0) {
+    return;
+  }
+  if(handler->flush_buffer == NULL) {
+    WriteMessage(fileno(handler->fp), data, length);
+    return;
+  }
+
+  // Buffer the record, making room for it first if needed. A record larger than the whole buffer 
+  // goes straight to the stream instead
+  if(handler->flush_length+length > handler->flush_capacity) {
+    FlushHandler(handler);
+  }
+  if(length > handler->flush_capacity) {
+    if(handler->uring != NULL) {
+      UringWrite(handler, data, length);
+    }
+    else if(handler->direct != NULL) {
+      DirectWrite(handler, data, length);
+    }
+    else {
+      WriteMessage(fileno(handler->fp), data, length);
+    }
+    return;
+  }
+  memcpy(handler->flush_buffer+handler->flush_length, data, length);
+  handler->flush_length += length;
+  handler->flush_records++;
+
+  // Write the buffer out when the record is important enough, or the policy says it's time to (a 
+  // handler only buffers with CL_FLUSH_RECORD to hand each record to its io_uring or O_DIRECT file)
+  if(level <= handler->flush_level || handler->flush_policy == CL_FLUSH_RECORD || 
+     (handler->flush_policy == CL_FLUSH_RECORDS && handler->flush_records >= handler->flush_value) || 
+     (handler->flush_policy == CL_FLUSH_BYTES && handler->flush_length >= handler->flush_value)) {
+    FlushHandler(handler);
+  }
+}
+
+
+static void FlushHandler(ClHandler *handler) {
+  if(handler->uring != NULL) {
+    UringSubmit(handler);
+  }
+  else if(handler->direct != NULL) {
+    DirectFlush(handler);
+  }
+  else if(handler->flush_length > 0 && handler->fp != NULL) {
+    WriteMessage(fileno(handler->fp), handler->flush_buffer, handler->flush_length);
+  }
+  handler->flush_length = 0;
+  handler->flush_records = 0;
+}
+
+
+static void PipeWrite(ClHandler *handler, const char *data, unsigned long length) {
+  const char *  newline;
+  unsigned long skip;
+  char          cut[PIPE_BUF];
+
+  // Writes of up to PIPE_BUF bytes are atomic, so records are cut to that length to keep them from 
+  // interleaving with other writers to the pipe. Several records at once (a ring being dumped) are 
+  // split between records instead
+  while(length > PIPE_BUF) {
+    newline = LastNewline(data, PIPE_BUF);
+    if(newline != NULL) {
+      skip = (unsigned long)(newline+1-data);
+      PipeWriteRecord(handler, data, skip);
+    }
+    else {
+      // A cut record still ends in a newline, so the reader doesn't run it into the next one, and 
+      // whatever was cut off it counts as dropped
+      newline = memchr(data+PIPE_BUF, '\n', length-PIPE_BUF);
+      skip = (newline != NULL) ? (unsigned long)(newline+1-data) : length;
+      memcpy(cut, data, PIPE_BUF-1);
+      cut[PIPE_BUF-1] = '\n';
+      PipeWriteRecord(handler, cut, PIPE_BUF);
+      __atomic_add_fetch(&(handler->dropped_records), 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&(handler->dropped_bytes), skip-(PIPE_BUF-1)-(newline != NULL), 
+                         __ATOMIC_RELAXED);
+    }
+    data += skip;
+    length -= skip;
+  }
+  if(length > 0) {
+    PipeWriteRecord(handler, data, length);
+  }
+}
+
+
+static void PipeWriteRecord(ClHandler *handler, const char *data, unsigned long length) {
+  ssize_t written = -1;
+
+  pthread_mutex_lock(&(handler->lock));
+
+  // Records held back earlier go first, the new one is only written directly if they all made it
+  if(handler->stream_length == 0 || PipeFlush(handler) == 0) {
+    do {
+      written = write(handler->fd, data, length);
+    } while(written < 0 && errno == EINTR);
+  }
+
+  // When the reader has fallen behind, hold the record back, or drop it once there's no room
+  if(written < 0 && (handler->stream_length > 0 || errno == EAGAIN || errno == EWOULDBLOCK)) {
+    if(handler->stream_length+length <= handler->stream_max_length) {
+      memcpy(handler->spill+handler->stream_length, data, length);
+      handler->stream_length += length;
+    }
+    else {
+      __atomic_add_fetch(&(handler->dropped_records), 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&(handler->dropped_bytes), length, __ATOMIC_RELAXED);
+    }
+  }
+  else if(written < 0) {
+    // The reader is gone (or the descriptor is bad), which isn't going to get better by waiting
+    __atomic_add_fetch(&(handler->dropped_records), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(handler->dropped_bytes), length, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&(handler->lock));
+}
+
+
+static int PipeFlush(ClHandler *handler) {
+  const char *  newline;
+  unsigned long length;
+  ssize_t       written;
+
+  // Coalesce the held back records into as few writes as possible, each one holding as many whole 
+  // records as fit in PIPE_BUF bytes so it's still atomic
+  while(handler->stream_length > 0) {
+    length = handler->stream_length;
+    if(length > PIPE_BUF) {
+      newline = LastNewline(handler->spill, PIPE_BUF);
+      length = (newline != NULL) ? (unsigned long)(newline+1-handler->spill) : PIPE_BUF;
+    }
+    written = write(handler->fd, handler->spill, length);
+    if(written < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        // Nobody is ever going to read the held back records
+        PipeDrop(handler);
+      }
+      return -1;
+    }
+    memmove(handler->spill, handler->spill+written, handler->stream_length-(unsigned long)written);
+    handler->stream_length -= (unsigned long)written;
+  }
+  return 0;
+}
+
+
+static void PipeDrop(ClHandler *handler) {
+  unsigned long i;
+  unsigned long records = 0;
+
+  for(i = 0; i < handler->stream_length; i++) {
+    if(handler->spill[i] == '\n') {
+      records++;
+    }
+  }
+  __atomic_add_fetch(&(handler->dropped_records), records, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&(handler->dropped_bytes), handler->stream_length, __ATOMIC_RELAXED);
+  handler->stream_length = 0;
+}
+
+
+static const char *LastNewline(const char *data, unsigned long length) {
+  while(length > 0) {
+    length--;
+    if(data[length] == '\n') {
+      return data+length;
+    }
+  }
+  return NULL;
+}
+
+
+static void RingWrite(ClHandler *handler, const char *data, unsigned long length) {
+  unsigned long offset;
+  unsigned long first;
+  unsigned long size = handler->stream_max_length;
+
+  // Only the end of a record longer than the ring could survive anyway
+  if(length > size) {
+    data += length-size;
+    length = size;
+  }
+
+  // Reserve the range, then copy the record in, wrapping around the end of the ring if needed
+  offset = (unsigned long)(__atomic_fetch_add(&(handler->ring_head), length, __ATOMIC_RELEASE) & 
+                           (size-1));
+  first = (length < size-offset) ? length : size-offset;
+  memcpy(handler->ring+offset, data, first);
+  memcpy(handler->ring, data+first, length-first);
+}
+
+
+static void DumpRing(ClHandler *handler) {
+  ClSnapshot snapshot;
+
+  ClGetHandlerSnapshot(handler, &snapshot);
+  WriteHandler(handler->ring_dump, snapshot.first, snapshot.first_length, CL_LOG_LEVEL_FATAL);
+  WriteHandler(handler->ring_dump, snapshot.second, snapshot.second_length, CL_LOG_LEVEL_FATAL);
+}
+
+
+static void RolloverHandler(ClHandler *handler) {
+  char *        rolled;
+  char *        path;
+  char          stamp[16];
+  unsigned long stamp_length = 0;
+  time_t        now;
+  time_t        boundary;
+
+  // The next index is always free, ClCreateHandler() started counting past the highest one in use. 
+  // With a time-based rollover, the name also tells which interval the file was written in
+  rolled = malloc((strlen(handler->filename)+40)*sizeof(char));
+  if(handler->rollover_interval != CL_ROLLOVER_NONE) {
+    stamp_length = FormatTime((handler->rollover_interval == CL_ROLLOVER_HOURLY) ? "%Y%m%d%H" : 
+                              "%Y%m%d", &(struct timespec){handler->rollover_start, 0}, stamp, 
+                              sizeof(stamp), NULL);
+  }
+  if(stamp_length > 0) {
+    sprintf(rolled, "%s.%.*s.%lu", handler->filename, (int)stamp_length, stamp, 
+            handler->rollover_count);
+  }
+  else {
+    sprintf(rolled, "%s.%lu", handler->filename, handler->rollover_count);
+  }
+
+  // Close and rename the current file to the rolled-over name
+  if(handler->stream_type == CL_STREAM_MMAP) {
+    UnmapHandler(handler);
+  }
+  else {
+    FlushHandler(handler);
+    if(handler->uring != NULL) {
+      UringDrain(handler);
+    }
+    if(handler->direct != NULL) {
+      DirectClose(handler);
+    }
+    if(handler->fp != NULL) {
+      fclose(handler->fp);
+      handler->fp = NULL;
+    }
+  }
+  rename(handler->filename, rolled);
+
+  // Move on to the interval the new file is written in, before a new segment is published to 
+  // other writers
+  now = time(NULL);
+  if(now >= handler->rollover_boundary) {
+    RolloverInterval(handler->rollover_interval, now, &(handler->rollover_start), &boundary);
+    __atomic_store_n(&(handler->rollover_boundary), boundary, __ATOMIC_RELEASE);
+  }
+
+  // Create a new empty file with the regular filename to log future messages to
+  handler->rollover_count++;
+  handler->stream_length = 0;
+  if(handler->stream_type != CL_STREAM_MMAP) {
+    OpenHandler(handler);
+  }
+
+  // A binary file has to describe itself and its call sites from scratch
+  if(handler->binary_sites != NULL) {
+    memset(handler->binary_sites, 0, CL_SITE_COUNT/8);
+  }
+
+  // Compressing the rolled file is left to the background worker, so the next record doesn't 
+  // have to wait for it
+  __atomic_add_fetch(&(handler->rolled_bytes), FileSize(rolled), __ATOMIC_RELAXED);
+  if(__atomic_load_n(&(handler->compression), __ATOMIC_RELAXED) == CL_COMPRESSION_GZIP) {
+    path = malloc((strlen(rolled)+1)*sizeof(char));
+    strcpy(path, rolled);
+    QueueJob(CL_JOB_COMPRESS, handler, path);
+  }
+  RetainRolled(handler, rolled);
+
+  // Writers to a mapped file aren't held back by the lock, and can roll the new segment over as 
+  // soon as they see it, so it's only published once everything above is done
+  if(handler->stream_type == CL_STREAM_MMAP) {
+    MapHandler(handler);
+  }
+}
+
+
+static int OpenHandler(ClHandler *handler) {
+  // Start the file over under its regular name. If it can't be opened, the handler is left without 
+  // one and StreamWrite() tries again with the next record
+  handler->fp = fopen(handler->filename, "a");
+  if(handler->fp == NULL) {
+    return -1;
+  }
+  if(handler->uring != NULL) {
+    UringOpen(handler);
+  }
+  if(handler->direct != NULL) {
+    DirectOpen(handler);
+  }
+  return 0;
+}
+
+
+static void ScanRolled(ClHandler *handler) {
+  char *          base;
+  char *          end;
+  char *          index;
+  unsigned long   digits;
+  unsigned long   i;
+  unsigned long   length;
+  unsigned long   prefix_length;
+  unsigned long   base_length;
+  unsigned long   found_length = 0;
+  DIR *           dir;
+  struct dirent * entry;
+  struct stat     st;
+  ClRolled *      found = NULL;
+
+  handler->rollover_count = 0;
+  handler->rolled_bytes = 0;
+
+  // Rolled files live next to the file itself, as <filename>.<index> or, with a time-based 
+  // rollover, <filename>.<stamp>.<index>, either of them possibly compressed
+  base = strrchr(handler->filename, '/');
+  base = (base != NULL) ? base+1 : handler->filename;
+  prefix_length = (unsigned long)(base-handler->filename);
+  base_length = strlen(base);
+  if(prefix_length > 0) {
+    handler->filename[prefix_length-1] = '\0';
+    dir = opendir((prefix_length > 1) ? handler->filename : "/");
+    handler->filename[prefix_length-1] = '/';
+  }
+  else {
+    dir = opendir(".");
+  }
+  if(dir == NULL) {
+    return;
+  }
+
+  while((entry = readdir(dir)) != NULL) {
+    if(strncmp(entry->d_name, base, base_length) != 0 || entry->d_name[base_length] != '.') {
+      continue;
+    }
+    length = strlen(entry->d_name);
+    if(length > base_length+3 && strcmp(entry->d_name+length-3, ".gz") == 0) {
+      length -= 3;
+    }
+
+    // Anything else next to the file isn't ours to count or delete. The stamp is the date, and the 
+    // hour with an hourly rollover, as RolloverHandler() writes it
+    index = entry->d_name+base_length+1;
+    digits = strspn(index, "0123456789");
+    if((digits == 8 || digits == 10) && index+digits < entry->d_name+length && 
+       index[digits] == '.') {
+      index += digits+1;
+      digits = strspn(index, "0123456789");
+    }
+    if(digits == 0 || index+digits != entry->d_name+length) {
+      continue;
+    }
+
+    if(fstatat(dirfd(dir), entry->d_name, &st, 0) == 0) {
+      handler->rolled_bytes += (unsigned long)st.st_size;
+    }
+    found = realloc(found, (found_length+1)*sizeof(ClRolled));
+    found[found_length].index = strtoul(index, &end, 10);
+    found[found_length].path = malloc((prefix_length+length+1)*sizeof(char));
+    memcpy(found[found_length].path, handler->filename, prefix_length);
+    memcpy(found[found_length].path+prefix_length, entry->d_name, length);
+    found[found_length].path[prefix_length+length] = '\0';
+    found_length++;
+  }
+  closedir(dir);
+
+  // Keep track of the rolled files oldest first, so the ones beyond rollover_max can be deleted
+  if(found_length > 0) {
+    qsort(found, found_length, sizeof(ClRolled), CompareRolled);
+  }
+  for(i = 0; i < found_length; i++) {
+    if(i > 0 && found[i].index == found[i-1].index) {
+      // Both a file and its compressed version
+      free(found[i].path);
+      continue;
+    }
+    RetainRolled(handler, found[i].path);
+    handler->rollover_count = found[i].index+1;
+  }
+  if(found != NULL) {
+    free(found);
+  }
+}
+
+
+static int CompareRolled(const void *a, const void *b) {
+  const ClRolled *x = a;
+  const ClRolled *y = b;
+
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+
+static void RetainRolled(ClHandler *handler, char *path) {
+  handler->rolled = realloc(handler->rolled, (handler->rolled_length+1)*sizeof(char *));
+  handler->rolled[handler->rolled_length++] = path;
+
+  // Deleting the oldest files can take a while, so the background worker does it off the hot path
+  while(handler->rollover_max > 0 && handler->rolled_length > handler->rollover_max) {
+    QueueJob(CL_JOB_DELETE, handler, handler->rolled[0]);
+    handler->rolled_length--;
+    memmove(handler->rolled, handler->rolled+1, handler->rolled_length*sizeof(char *));
+  }
+}
+
+
+static void RolloverOnTime(ClHandler *handler, time_t time) {
+  time_t boundary = __atomic_load_n(&(handler->rollover_boundary), __ATOMIC_ACQUIRE);
+
+  if(time < boundary) {
+    return;
+  }
+  if(handler->stream_type == CL_STREAM_MMAP) {
+    MapClose(handler, boundary, time);
+    return;
+  }
+
+  // Another thread may have rolled the file over while this one waited for the lock
+  pthread_mutex_lock(&(handler->lock));
+  if(time >= handler->rollover_boundary && handler->stream_length > 0) {
+    RolloverHandler(handler);
+  }
+  else if(time >= handler->rollover_boundary) {
+    // Nothing was written in the interval, so the file carries on into the next one
+    RolloverInterval(handler->rollover_interval, time, &(handler->rollover_start), &boundary);
+    __atomic_store_n(&(handler->rollover_boundary), boundary, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&(handler->lock));
+}
+
+
+static void RolloverInterval(ClRolloverInterval interval, time_t time, time_t *start, 
+                             time_t *boundary) {
+  struct tm tm;
+
+  if(interval == CL_ROLLOVER_NONE) {
+    *start = 0;
+    *boundary = CL_TIME_NEVER;
+    return;
+  }
+
+  // Local hours start at a whole multiple of an hour past UTC once shifted by the offset, while 
+  // local days have to be worked out by mktime() since they aren't always 24 hours long
+  LocalTime(time, &tm);
+  if(interval == CL_ROLLOVER_HOURLY) {
+    *start = time - ((time + tm.tm_gmtoff) % 3600);
+    *boundary = *start + 3600;
+    return;
+  }
+  tm.tm_sec = 0;
+  tm.tm_min = 0;
+  tm.tm_hour = 0;
+  tm.tm_isdst = -1;
+  *start = mktime(&tm);
+  tm.tm_mday++;
+  tm.tm_hour = 0;
+  tm.tm_isdst = -1;
+  *boundary = mktime(&tm);
+  if(*start == (time_t)-1 || *boundary <= time) {
+    *start = time - ((time + tm.tm_gmtoff) % 86400);
+    *boundary = *start + 86400;
+  }
+}
+
+
+static void QueueJob(ClJobType type, ClHandler *handler, char *path) {
+  ClJob *job = malloc(sizeof(ClJob));
+
+  job->type = type;
+  job->handler = handler;
+  job->path = path;
+  job->next = NULL;
+
+  pthread_mutex_lock(&jobs_mutex);
+  if(StartJobs() != 0) {
+    // Better to do the job right away than not at all
+    pthread_mutex_unlock(&jobs_mutex);
+    RunJob(job);
+    return;
+  }
+  if(jobs_tail != NULL) {
+    jobs_tail->next = job;
+  }
+  else {
+    jobs_head = job;
+  }
+  jobs_tail = job;
+  pthread_cond_signal(&jobs_cond);
+  pthread_mutex_unlock(&jobs_mutex);
+}
+
+
+static int StartJobs() {
+  if(!jobs_running) {
+    if(pthread_create(&jobs_thread, NULL, JobWorker, NULL) != 0) {
+      return -1;
+    }
+    jobs_running = 1;
+  }
+  return 0;
+}
+
+
+static void RemoveTimer(ClHandler *handler) {
+  unsigned long i;
+
+  pthread_mutex_lock(&jobs_mutex);
+  for(i = 0; i < jobs_timers_length; i++) {
+    if(jobs_timers[i] == handler) {
+      memmove(jobs_timers+i, jobs_timers+i+1, (jobs_timers_length-i-1)*sizeof(ClHandler *));
+      jobs_timers_length--;
+      break;
+    }
+  }
+  if(jobs_timers_length == 0 && jobs_timers != NULL) {
+    free(jobs_timers);
+    jobs_timers = NULL;
+  }
+  pthread_mutex_unlock(&jobs_mutex);
+}
+
+
+static uint64_t CurrentMilliseconds() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec*1000 + (uint64_t)now.tv_nsec/1000000;
+}
+
+
+static void WaitJobs() {
+  pthread_mutex_lock(&jobs_mutex);
+  while(jobs_head != NULL || jobs_busy) {
+    pthread_cond_wait(&jobs_idle, &jobs_mutex);
+  }
+  pthread_mutex_unlock(&jobs_mutex);
+}
+
+
+static void StopJobs() {
+  pthread_mutex_lock(&jobs_mutex);
+  if(!jobs_running) {
+    pthread_mutex_unlock(&jobs_mutex);
+    return;
+  }
+  jobs_exiting = 1;
+  pthread_cond_signal(&jobs_cond);
+  pthread_mutex_unlock(&jobs_mutex);
+
+  // The worker finishes every queued job before exiting
+  pthread_join(jobs_thread, NULL);
+  jobs_running = 0;
+  jobs_exiting = 0;
+}
+
+
+static void *JobWorker(void *arg) {
+  unsigned long   i;
+  unsigned long   due_length;
+  uint64_t        now;
+  uint64_t        next;
+  struct timespec deadline;
+  ClJob *         job;
+  ClTsc           measured;
+  ClHandler **    due = NULL;
+
+  // Housekeeping shouldn't compete with the application for the CPU (on Linux, this only lowers 
+  // the priority of the calling thread)
+  setpriority(PRIO_PROCESS, (id_t)CurrentThreadId(), 19);
+
+  pthread_mutex_lock(&jobs_mutex);
+  while(1) {
+    // Keep the TSC's calibration from drifting away from the system clocks while it's in use
+    now = CurrentMilliseconds();
+    next = UINT64_MAX;
+    if(__atomic_load_n(&clock_source, __ATOMIC_RELAXED) == CL_CLOCK_TSC) {
+      if(tsc_clock.deadline <= now) {
+        MeasureTsc(&tsc_clock, &measured);
+        PublishTsc(&measured);
+      }
+      next = tsc_clock.deadline;
+    }
+
+    // Flush the handlers whose timer went off, and find out when the next one does. The handlers 
+    // are flushed without holding the mutex, since writing to them can lead to queueing a job
+    due_length = 0;
+    for(i = 0; i < jobs_timers_length; i++) {
+      if(jobs_timers[i]->flush_deadline <= now) {
+        due = realloc(due, jobs_timers_length*sizeof(ClHandler *));
+        due[due_length++] = jobs_timers[i];
+        jobs_timers[i]->flush_deadline = now + jobs_timers[i]->flush_value;
+      }
+      if(jobs_timers[i]->flush_deadline < next) {
+        next = jobs_timers[i]->flush_deadline;
+      }
+    }
+    if(due_length > 0) {
+      jobs_busy = 1;
+      pthread_mutex_unlock(&jobs_mutex);
+      for(i = 0; i < due_length; i++) {
+        pthread_mutex_lock(&(due[i]->lock));
+        FlushHandler(due[i]);
+        pthread_mutex_unlock(&(due[i]->lock));
+      }
+      pthread_mutex_lock(&jobs_mutex);
+      jobs_busy = 0;
+      if(jobs_head == NULL) {
+        pthread_cond_broadcast(&jobs_idle);
+      }
+      continue;
+    }
+
+    if(jobs_head == NULL && jobs_exiting) {
+      break;
+    }
+    if(jobs_head == NULL) {
+      if(next == UINT64_MAX) {
+        pthread_cond_wait(&jobs_cond, &jobs_mutex);
+      }
+      else {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)((next-now)/1000);
+        deadline.tv_nsec += (long)((next-now)%1000)*1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&jobs_cond, &jobs_mutex, &deadline);
+      }
+      continue;
+    }
+
+    job = jobs_head;
+    jobs_head = job->next;
+    if(jobs_head == NULL) {
+      jobs_tail = NULL;
+    }
+    jobs_busy = 1;
+    pthread_mutex_unlock(&jobs_mutex);
+    RunJob(job);
+    pthread_mutex_lock(&jobs_mutex);
+    jobs_busy = 0;
+    if(jobs_head == NULL) {
+      pthread_cond_broadcast(&jobs_idle);
+    }
+  }
+  pthread_mutex_unlock(&jobs_mutex);
+  if(due != NULL) {
+    free(due);
+  }
+
+  return arg;
+}
+
+
+static void RunJob(ClJob *job) {
+  char *        compressed;
+  unsigned long size;
+  unsigned long compressed_size;
+
+  compressed = malloc((strlen(job->path)+4)*sizeof(char));
+  sprintf(compressed, "%s.gz", job->path);
+
+  switch(job->type) {
+    case CL_JOB_DELETE:
+      // The file may have been compressed since it was rolled over
+      size = FileSize(job->path) + FileSize(compressed);
+      unlink(job->path);
+      unlink(compressed);
+      __atomic_sub_fetch(&(job->handler->rolled_bytes), size, __ATOMIC_RELAXED);
+      break;
+    case CL_JOB_COMPRESS:
+      size = FileSize(job->path);
+      if(CompressFile(job->path, compressed) == 0) {
+        compressed_size = FileSize(compressed);
+        __atomic_add_fetch(&(job->handler->rolled_bytes), compressed_size, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&(job->handler->rolled_bytes), size, __ATOMIC_RELAXED);
+      }
+      break;
+    default:
+      break;
+  }
+
+  free(compressed);
+  free(job->path);
+  free(job);
+}
+
+
+static int CompressFile(const char *path, const char *compressed) {
+  int    fd;
+  int    status = 0;
+  char   block[65536];
+  char * temporary;
+  gzFile gz;
+  ssize_t length;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) {
+    return -1;
+  }
+
+  // Compress into a temporary file first, so the compressed name only ever refers to a whole file
+  temporary = malloc((strlen(compressed)+5)*sizeof(char));
+  sprintf(temporary, "%s.tmp", compressed);
+  gz = gzopen(temporary, "wb");
+  if(gz == NULL) {
+    close(fd);
+    free(temporary);
+    return -1;
+  }
+  while((length = read(fd, block, sizeof(block))) != 0) {
+    if(length < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      status = -1;
+      break;
+    }
+    if(gzwrite(gz, block, (unsigned int)length) != (int)length) {
+      status = -1;
+      break;
+    }
+  }
+  if(gzclose(gz) != Z_OK) {
+    status = -1;
+  }
+  close(fd);
+
+  // Then swap it in for the original
+  if(status == 0 && rename(temporary, compressed) == 0) {
+    unlink(path);
+  }
+  else {
+    unlink(temporary);
+    status = -1;
+  }
+  free(temporary);
+  return status;
+}
+
+
+static unsigned long FileSize(const char *path) {
+  struct stat st;
+
+  return (stat(path, &st) == 0) ? (unsigned long)st.st_size : 0;
+}
+
+
+static int MapHandler(ClHandler *handler) {
+  char          block[4096];
+  unsigned long length;
+  unsigned long used;
+  off_t         end;
+  struct stat   st;
+  void *        map;
+  uint64_t      generation;
+
+  generation = (__atomic_load_n(&(handler->map_cursor), __ATOMIC_RELAXED) >> CL_MAP_OFFSET_BITS) + 1;
+  handler->map = NULL;
+  handler->fd = open(handler->filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(handler->fd < 0 || fstat(handler->fd, &st) != 0) {
+    goto fail;
+  }
+
+  // A segment that wasn't closed cleanly still has its unused tail of null bytes, so skip back 
+  // over it to find where the records end
+  end = st.st_size;
+  while(end > 0) {
+    length = (end < (off_t)sizeof(block)) ? (unsigned long)end : sizeof(block);
+    if(pread(handler->fd, block, length, end-(off_t)length) != (ssize_t)length) {
+      break;
+    }
+    for(used = length; used > 0 && block[used-1] == '\0'; used--);
+    end -= (off_t)(length-used);
+    if(used > 0) {
+      break;
+    }
+  }
+  used = (unsigned long)end;
+  handler->stream_length = used;
+
+  // Let the caller roll the file over if there's no room left in it
+  if(used >= handler->stream_max_length) {
+    __atomic_store_n(&(handler->map_committed), handler->stream_max_length, __ATOMIC_RELAXED);
+    __atomic_store_n(&(handler->map_cursor), 
+                     (generation << CL_MAP_OFFSET_BITS) | handler->stream_max_length, 
+                     __ATOMIC_RELEASE);
+    return 1;
+  }
+
+  // Reserve the disk space up front, since running out of it while writing to the mapping would 
+  // raise SIGBUS rather than fail a write()
+  if(ftruncate(handler->fd, (off_t)handler->stream_max_length) != 0) {
+    goto fail;
+  }
+  posix_fallocate(handler->fd, (off_t)used, (off_t)(handler->stream_max_length-used));
+  map = mmap(NULL, handler->stream_max_length, PROT_READ | PROT_WRITE, MAP_SHARED, handler->fd, 0);
+  if(map == MAP_FAILED) {
+    goto fail;
+  }
+
+  // Publish the segment, writers waiting on the previous one start over once the generation changes
+  handler->map = map;
+  __atomic_store_n(&(handler->map_committed), used, __ATOMIC_RELAXED);
+  __atomic_store_n(&(handler->map_cursor), (generation << CL_MAP_OFFSET_BITS) | used, 
+                   __ATOMIC_RELEASE);
+  return 0;
+
+fail:
+  if(handler->fd >= 0) {
+    close(handler->fd);
+  }
+  handler->fd = -1;
+  handler->stream_length = 0;
+
+  // Leave the segment looking full, so the next record tries to map it again
+  __atomic_store_n(&(handler->map_committed), handler->stream_max_length, __ATOMIC_RELAXED);
+  __atomic_store_n(&(handler->map_cursor), 
+                   (generation << CL_MAP_OFFSET_BITS) | handler->stream_max_length, 
+                   __ATOMIC_RELEASE);
+  return -1;
+}
+
+
+static void UnmapHandler(ClHandler *handler) {
+  if(handler->map != NULL) {
+    munmap(handler->map, handler->stream_max_length);
+    handler->map = NULL;
+  }
+  if(handler->fd >= 0) {
+    // Trim the preallocated space that wasn't used
+    while(ftruncate(handler->fd, (off_t)handler->stream_length) != 0 && errno == EINTR);
+    close(handler->fd);
+    handler->fd = -1;
+  }
+}
+
+
+static void MapWrite(ClHandler *handler, const char *data, unsigned long length) {
+  unsigned long offset;
+  uint64_t      cursor;
+  uint64_t      generation;
+
+  // A record has to fit within a single segment
+  if(length > handler->stream_max_length) {
+    length = handler->stream_max_length;
+  }
+
+  while(1) {
+    cursor = __atomic_fetch_add(&(handler->map_cursor), length, __ATOMIC_ACQUIRE);
+    generation = cursor >> CL_MAP_OFFSET_BITS;
+    offset = (unsigned long)(cursor & CL_MAP_OFFSET_MASK);
+
+    // Most of the time the reserved range is within the segment, and copying into it is all it takes
+    if(offset+length <= handler->stream_max_length) {
+      memcpy(handler->map+offset, data, length);
+      __atomic_add_fetch(&(handler->map_committed), length, __ATOMIC_RELEASE);
+      return;
+    }
+
+    // Exactly one record crosses the end of the segment, and that one rolls the file over once 
+    // every record before it has been copied in
+    if(offset <= handler->stream_max_length) {
+      while(__atomic_load_n(&(handler->map_committed), __ATOMIC_ACQUIRE) != offset) {
+        sched_yield();
+      }
+      handler->stream_length = offset;
+      if(handler->map != NULL || MapHandler(handler) == 1) {
+        // Writers don't need the lock, but it keeps the rollover policy from changing underneath
+        pthread_mutex_lock(&(handler->lock));
+        RolloverHandler(handler);
+        pthread_mutex_unlock(&(handler->lock));
+      }
+      if(handler->map == NULL) {
+        // Couldn't map a new segment, drop the record
+        return;
+      }
+      continue;
+    }
+
+    // Records reserved past the end wait for the new segment, then try again
+    while((__atomic_load_n(&(handler->map_cursor), __ATOMIC_ACQUIRE) >> CL_MAP_OFFSET_BITS) == 
+          generation) {
+      sched_yield();
+    }
+  }
+}
+
+
+static void MapClose(ClHandler *handler, time_t boundary, time_t time) {
+  unsigned long offset;
+  uint64_t      cursor;
+  uint64_t      generation;
+  time_t        start;
+  time_t        next;
+
+  while(1) {
+    // Another thread may have already rolled the file over for this interval
+    cursor = __atomic_load_n(&(handler->map_cursor), __ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&(handler->rollover_boundary), __ATOMIC_ACQUIRE) != boundary) {
+      return;
+    }
+    generation = cursor >> CL_MAP_OFFSET_BITS;
+    offset = (unsigned long)(cursor & CL_MAP_OFFSET_MASK);
+
+    // Nothing was written in the interval, so the segment carries on into the next one
+    if(offset == 0) {
+      pthread_mutex_lock(&(handler->lock));
+      RolloverInterval(handler->rollover_interval, time, &start, &next);
+      if(__atomic_compare_exchange_n(&(handler->rollover_boundary), &boundary, next, 0, 
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        handler->rollover_start = start;
+      }
+      pthread_mutex_unlock(&(handler->lock));
+      return;
+    }
+
+    // Close the segment by moving the cursor past its end, which makes this thread the one that 
+    // rolls it over, just like a record crossing the end would
+    if(offset <= handler->stream_max_length) {
+      if(__atomic_compare_exchange_n(&(handler->map_cursor), &cursor, 
+                                     (generation << CL_MAP_OFFSET_BITS) | 
+                                     (handler->stream_max_length+1), 
+                                     0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        while(__atomic_load_n(&(handler->map_committed), __ATOMIC_ACQUIRE) != offset) {
+          sched_yield();
+        }
+        handler->stream_length = offset;
+        pthread_mutex_lock(&(handler->lock));
+        RolloverHandler(handler);
+        pthread_mutex_unlock(&(handler->lock));
+        return;
+      }
+      continue;
+    }
+
+    // A record is already rolling the segment over, wait for the new one
+    while((__atomic_load_n(&(handler->map_cursor), __ATOMIC_ACQUIRE) >> CL_MAP_OFFSET_BITS) == 
+          generation) {
+      sched_yield();
+    }
+  }
+}
+
+
+static void MapRollover(ClHandler *handler) {
+  unsigned long offset;
+  uint64_t      cursor;
+  uint64_t      generation;
+
+  while(1) {
+    cursor = __atomic_load_n(&(handler->map_cursor), __ATOMIC_ACQUIRE);
+    generation = cursor >> CL_MAP_OFFSET_BITS;
+    offset = (unsigned long)(cursor & CL_MAP_OFFSET_MASK);
+
+    // Nothing was written to the segment, so there's nothing to roll over
+    if(offset == 0) {
+      return;
+    }
+
+    // Close the segment by moving the cursor past its end, like MapClose() does
+    if(offset <= handler->stream_max_length) {
+      if(__atomic_compare_exchange_n(&(handler->map_cursor), &cursor, 
+                                     (generation << CL_MAP_OFFSET_BITS) | 
+                                     (handler->stream_max_length+1), 
+                                     0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        while(__atomic_load_n(&(handler->map_committed), __ATOMIC_ACQUIRE) != offset) {
+          sched_yield();
+        }
+        handler->stream_length = offset;
+        pthread_mutex_lock(&(handler->lock));
+        RolloverHandler(handler);
+        pthread_mutex_unlock(&(handler->lock));
+        return;
+      }
+      continue;
+    }
+
+    // A record is already rolling the segment over, which starts a new file just the same
+    while((__atomic_load_n(&(handler->map_cursor), __ATOMIC_ACQUIRE) >> CL_MAP_OFFSET_BITS) == 
+          generation) {
+      sched_yield();
+    }
+    return;
+  }
+}
+
+
+static int IoAttach(ClHandler *handler, ClIo io) {
+  char *        buffer = handler->flush_buffer;
+  unsigned long buffer_capacity = handler->flush_capacity;
+  unsigned long capacity;
+  int           result = 0;
+
+  // Write out what's buffered so far, the backends bring buffers of their own, of the size the 
+  // flush policy uses (or the default size when each record is written on its own)
+  FlushHandler(handler);
+  capacity = (handler->flush_capacity > 0) ? handler->flush_capacity : CL_FLUSH_LENGTH;
+  if(io == CL_IO_URING) {
+    result = UringAttach(handler, capacity);
+  }
+  else if(io == CL_IO_DIRECT) {
+    result = DirectAttach(handler, capacity);
+  }
+  if(result == 0 && io != CL_IO_WRITE) {
+    if(buffer != NULL) {
+      free(buffer);
+    }
+    handler->io = io;
+  }
+  else if(result != 0) {
+    // Keep writing with write() and the buffer the handler already had
+    handler->flush_buffer = buffer;
+    handler->flush_capacity = buffer_capacity;
+    handler->io = CL_IO_WRITE;
+  }
+  return result;
+}
+
+
+static void IoDetach(ClHandler *handler, int buffered) {
+  // Let everything written so far reach the file, then go back to buffering in memory of the 
+  // handler's own if the policy needs it (unless the caller is about to replace the buffer anyway)
+  FlushHandler(handler);
+  if(handler->uring != NULL) {
+    UringDetach(handler);
+  }
+  if(handler->direct != NULL) {
+    DirectDetach(handler);
+  }
+  handler->io = CL_IO_WRITE;
+  handler->flush_buffer = NULL;
+  if(buffered && handler->flush_policy != CL_FLUSH_RECORD) {
+    handler->flush_buffer = malloc(handler->flush_capacity*sizeof(char));
+  }
+  if(handler->flush_buffer == NULL) {
+    handler->flush_capacity = 0;
+  }
+}
+
+
+static int UringAttach(ClHandler *handler, unsigned long capacity) {
+  struct io_uring_params params;
+  struct iovec           iovecs[CL_URING_BUFFERS];
+  ClUring *              uring;
+  unsigned long          i;
+  int                    fd;
+
+  memset(&params, 0, sizeof(params));
+  fd = (int)syscall(__NR_io_uring_setup, 2*CL_URING_BUFFERS, &params);
+  if(fd < 0) {
+    return -1;
+  }
+  uring = malloc(sizeof(ClUring));
+  memset(uring, 0, sizeof(ClUring));
+  uring->fd = fd;
+
+  // Map the submission and completion rings (a single mapping on kernels that share it) and the 
+  // submission entries
+  uring->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+  uring->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    if(uring->cq_ring_size > uring->sq_ring_size) {
+      uring->sq_ring_size = uring->cq_ring_size;
+    }
+    uring->cq_ring_size = uring->sq_ring_size;
+  }
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, 
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(uring->sq_ring == MAP_FAILED) {
+    uring->sq_ring = NULL;
+    UringDelete(uring);
+    return -1;
+  }
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    uring->cq_ring = uring->sq_ring;
+  }
+  else {
+    uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, 
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if(uring->cq_ring == MAP_FAILED) {
+      uring->cq_ring = NULL;
+      UringDelete(uring);
+      return -1;
+    }
+  }
+  uring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                     fd, IORING_OFF_SQES);
+  if(uring->sqes == MAP_FAILED) {
+    uring->sqes = NULL;
+    UringDelete(uring);
+    return -1;
+  }
+  uring->sq_tail = (unsigned int *)((char *)uring->sq_ring + params.sq_off.tail);
+  uring->sq_mask = (unsigned int *)((char *)uring->sq_ring + params.sq_off.ring_mask);
+  uring->sq_array = (unsigned int *)((char *)uring->sq_ring + params.sq_off.array);
+  uring->cq_head = (unsigned int *)((char *)uring->cq_ring + params.cq_off.head);
+  uring->cq_tail = (unsigned int *)((char *)uring->cq_ring + params.cq_off.tail);
+  uring->cq_mask = (unsigned int *)((char *)uring->cq_ring + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *)((char *)uring->cq_ring + params.cq_off.cqes);
+
+  // Registering the buffers saves the kernel from mapping them on every write. It can fail, e.g. 
+  // when it goes over RLIMIT_MEMLOCK, in which case they're passed as plain addresses instead
+  for(i = 0; i < CL_URING_BUFFERS; i++) {
+    uring->buffers[i] = malloc(capacity*sizeof(char));
+    if(uring->buffers[i] == NULL) {
+      UringDelete(uring);
+      return -1;
+    }
+    iovecs[i].iov_base = uring->buffers[i];
+    iovecs[i].iov_len = capacity;
+  }
+  uring->registered = (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecs, 
+                               CL_URING_BUFFERS) == 0);
+
+  // Fill the first of the ring's buffers
+  handler->uring = uring;
+  handler->flush_buffer = uring->buffers[0];
+  handler->flush_capacity = capacity;
+  UringOpen(handler);
+  return 0;
+}
+
+
+static void UringDetach(ClHandler *handler) {
+  UringDrain(handler);
+  UringDelete(handler->uring);
+  handler->uring = NULL;
+
+  // Appending is safe again now that writes no longer carry their own offsets
+  if(handler->fp != NULL) {
+    lseek(fileno(handler->fp), 0, SEEK_END);
+    fcntl(fileno(handler->fp), F_SETFL, fcntl(fileno(handler->fp), F_GETFL) | O_APPEND);
+  }
+}
+
+
+static void UringDelete(ClUring *uring) {
+  unsigned long i;
+
+  for(i = 0; i < CL_URING_BUFFERS; i++) {
+    if(uring->buffers[i] != NULL) {
+      free(uring->buffers[i]);
+    }
+  }
+  if(uring->sqes != NULL) {
+    munmap(uring->sqes, uring->sqes_size);
+  }
+  if(uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring) {
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  }
+  if(uring->sq_ring != NULL) {
+    munmap(uring->sq_ring, uring->sq_ring_size);
+  }
+  close(uring->fd);
+  free(uring);
+}
+
+
+static void UringOpen(ClHandler *handler) {
+  int fd = fileno(handler->fp);
+
+  // Writes in flight at the same time each carry the offset they were submitted at, so they land 
+  // in order however the kernel completes them. That only holds with appending turned off
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_APPEND);
+  handler->uring->offset = lseek(fd, 0, SEEK_END);
+  if(handler->uring->offset < 0) {
+    handler->uring->offset = 0;
+  }
+}
+
+
+static void UringSubmit(ClHandler *handler) {
+  ClUring *            uring = handler->uring;
+  struct io_uring_sqe *sqe;
+  unsigned long        i = uring->current;
+  unsigned int         tail;
+  int                  fd = (handler->fp != NULL) ? fileno(handler->fp) : -1;
+  long                 submitted;
+
+  if(handler->flush_length > 0 && fd >= 0) {
+    uring->lengths[i] = handler->flush_length;
+    uring->offsets[i] = uring->offset;
+    uring->offset += (off_t)handler->flush_length;
+
+    // Fill in a submission entry for the buffer and publish it to the kernel
+    tail = *(uring->sq_tail);
+    sqe = &(uring->sqes[tail & *(uring->sq_mask)]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = uring->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)uring->buffers[i];
+    sqe->len = (uint32_t)uring->lengths[i];
+    sqe->off = (uint64_t)uring->offsets[i];
+    sqe->buf_index = (uint16_t)i;
+    sqe->user_data = i;
+    uring->sq_array[tail & *(uring->sq_mask)] = tail & *(uring->sq_mask);
+    __atomic_store_n(uring->sq_tail, tail+1, __ATOMIC_RELEASE);
+
+    while(1) {
+      submitted = syscall(__NR_io_uring_enter, uring->fd, 1, 0, 0, NULL, 0);
+      if(submitted >= 0) {
+        break;
+      }
+      if(errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        UringReap(uring, fd, 0);
+        continue;
+      }
+      break;
+    }
+    if(submitted == 1) {
+      uring->busy[i] = 1;
+      uring->in_flight++;
+    }
+    else {
+      // The kernel didn't take the entry, so take it back and write the buffer out right away
+      __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+      WriteAt(fd, uring->buffers[i], uring->lengths[i], uring->offsets[i]);
+    }
+  }
+  handler->flush_length = 0;
+  handler->flush_records = 0;
+
+  // Move on to a free buffer, collecting the writes that completed in the meantime and only 
+  // waiting for one when all of them are still in flight
+  UringReap(uring, fd, 0);
+  while(uring->busy[uring->current]) {
+    for(i = 0; i < CL_URING_BUFFERS && uring->busy[i]; i++);
+    if(i < CL_URING_BUFFERS) {
+      uring->current = i;
+      break;
+    }
+    UringReap(uring, fd, 1);
+  }
+  handler->flush_buffer = uring->buffers[uring->current];
+}
+
+
+static void UringReap(ClUring *uring, int fd, int wait) {
+  struct io_uring_cqe *cqe;
+  unsigned int         head;
+  unsigned long        i;
+  unsigned long        done;
+
+  if(uring->in_flight == 0) {
+    return;
+  }
+  if(wait) {
+    syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  }
+
+  head = *(uring->cq_head);
+  while(head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &(uring->cqes[head & *(uring->cq_mask)]);
+    i = (unsigned long)cqe->user_data;
+
+    // A write the kernel cut short or refused is finished the blocking way, from where it stopped
+    done = (cqe->res > 0) ? (unsigned long)cqe->res : 0;
+    if(done < uring->lengths[i] && fd >= 0) {
+      WriteAt(fd, uring->buffers[i]+done, uring->lengths[i]-done, uring->offsets[i]+(off_t)done);
+    }
+    uring->busy[i] = 0;
+    uring->in_flight--;
+    head++;
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+
+static void UringDrain(ClHandler *handler) {
+  int fd = (handler->fp != NULL) ? fileno(handler->fp) : -1;
+
+  while(handler->uring->in_flight > 0) {
+    UringReap(handler->uring, fd, 1);
+  }
+}
+
+
+static void UringWrite(ClHandler *handler, const char *data, unsigned long length) {
+  // A record too large for the buffers is written directly, after the writes before it
+  UringDrain(handler);
+  if(handler->fp != NULL) {
+    WriteAt(fileno(handler->fp), data, length, handler->uring->offset);
+  }
+  handler->uring->offset += (off_t)length;
+}
+
+
+static int DirectAttach(ClHandler *handler, unsigned long capacity) {
+  ClDirect *direct;
+  void *    staging;
+
+  // The staging buffer holds the part of the last block already in the file ahead of the new 
+  // records, so it gets a block on top of the size the policy asks for
+  capacity = (capacity+CL_DIRECT_ALIGNMENT-1)/CL_DIRECT_ALIGNMENT*CL_DIRECT_ALIGNMENT + 
+             CL_DIRECT_ALIGNMENT;
+  if(posix_memalign(&staging, CL_DIRECT_ALIGNMENT, capacity) != 0) {
+    return -1;
+  }
+  direct = malloc(sizeof(ClDirect));
+  memset(direct, 0, sizeof(ClDirect));
+  direct->staging = staging;
+  direct->capacity = capacity;
+  handler->direct = direct;
+  if(DirectOpen(handler) != 0) {
+    handler->direct = NULL;
+    free(direct->staging);
+    free(direct);
+    return -1;
+  }
+  return 0;
+}
+
+
+static void DirectDetach(ClHandler *handler) {
+  DirectClose(handler);
+  free(handler->direct->staging);
+  free(handler->direct);
+  handler->direct = NULL;
+}
+
+
+static int DirectOpen(ClHandler *handler) {
+  ClDirect *direct = handler->direct;
+  off_t     size;
+  off_t     end;
+
+  // Writes start at the last block boundary, the rest of that block is read back so it can be 
+  // written again along with the records that follow it
+  direct->offset = 0;
+  direct->carry = 0;
+  direct->allocated = 0;
+  direct->fd = open(handler->filename, O_RDWR | O_DIRECT);
+  if(direct->fd >= 0) {
+    size = lseek(direct->fd, 0, SEEK_END);
+    direct->offset = (size > 0) ? size/CL_DIRECT_ALIGNMENT*CL_DIRECT_ALIGNMENT : 0;
+    direct->carry = (unsigned long)(size-direct->offset);
+    if(size < 0 || (direct->carry > 0 && 
+                    pread(direct->fd, direct->staging, CL_DIRECT_ALIGNMENT, direct->offset) != 
+                    (ssize_t)direct->carry)) {
+      close(direct->fd);
+      direct->fd = -1;
+    }
+  }
+  if(direct->fd < 0) {
+    // The handler's buffer is left as it was, the staging buffer may be about to be freed
+    direct->offset = 0;
+    direct->carry = 0;
+    return -1;
+  }
+  handler->flush_buffer = direct->staging+direct->carry;
+  handler->flush_capacity = direct->capacity-direct->carry;
+
+  // Reserve the space the file grows into until it's rolled over, without changing its size, so 
+  // the filesystem doesn't have to allocate extents while records are being written
+  end = (off_t)((handler->stream_max_length < (unsigned long)LONG_MAX-direct->capacity) ? 
+                handler->stream_max_length+direct->capacity : 0);
+  if(end > direct->offset && 
+     fallocate(direct->fd, FALLOC_FL_KEEP_SIZE, direct->offset, end-direct->offset) == 0) {
+    direct->allocated = end;
+  }
+  return 0;
+}
+
+
+static void DirectClose(ClHandler *handler) {
+  ClDirect *direct = handler->direct;
+  off_t     length = direct->offset+(off_t)direct->carry;
+  off_t     end;
+
+  // The last block was written padded to its full size, cut the file back to the records in it 
+  // and give back the space reserved past them
+  if(direct->fd >= 0) {
+    if(ftruncate(direct->fd, length) != 0) {
+      // Leave the padding, the file is still readable
+    }
+    end = (length+CL_DIRECT_ALIGNMENT-1)/CL_DIRECT_ALIGNMENT*CL_DIRECT_ALIGNMENT;
+    if(direct->allocated > end) {
+      fallocate(direct->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, end, direct->allocated-end);
+    }
+    close(direct->fd);
+    direct->fd = -1;
+  }
+  direct->offset = 0;
+  direct->carry = 0;
+  handler->flush_buffer = direct->staging;
+  handler->flush_capacity = direct->capacity;
+}
+
+
+static void DirectFlush(ClHandler *handler) {
+  ClDirect *    direct = handler->direct;
+  unsigned long length = direct->carry+handler->flush_length;
+  unsigned long padded;
+  unsigned long whole;
+
+  if(handler->flush_length > 0) {
+    if(direct->fd >= 0) {
+      // Only whole blocks can be written, so the last one is padded with zeros. It stays in the 
+      // staging buffer and is written again, filled up further, by the next flush
+      padded = (length+CL_DIRECT_ALIGNMENT-1)/CL_DIRECT_ALIGNMENT*CL_DIRECT_ALIGNMENT;
+      whole = length/CL_DIRECT_ALIGNMENT*CL_DIRECT_ALIGNMENT;
+      memset(direct->staging+length, 0, padded-length);
+      WriteAt(direct->fd, direct->staging, padded, direct->offset);
+      direct->offset += (off_t)whole;
+      direct->carry = length-whole;
+      memmove(direct->staging, direct->staging+whole, direct->carry);
+    }
+    else if(handler->fp != NULL) {
+      // The file couldn't be opened for direct I/O after a rollover, fall back to appending
+      WriteMessage(fileno(handler->fp), direct->staging+direct->carry, handler->flush_length);
+    }
+  }
+  handler->flush_buffer = direct->staging+direct->carry;
+  handler->flush_capacity = direct->capacity-direct->carry;
+  handler->flush_length = 0;
+  handler->flush_records = 0;
+}
+
+
+static void DirectWrite(ClHandler *handler, const char *data, unsigned long length) {
+  unsigned long chunk;
+
+  // A record too large for the staging buffer goes through it a piece at a time
+  while(length > 0) {
+    chunk = handler->flush_capacity-handler->flush_length;
+    if(chunk > length) {
+      chunk = length;
+    }
+    memcpy(handler->flush_buffer+handler->flush_length, data, chunk);
+    handler->flush_length += chunk;
+    data += chunk;
+    length -= chunk;
+    DirectFlush(handler);
+  }
+}
+
+
+static void WriteAt(int fd, const char *data, unsigned long length, off_t offset) {
+  ssize_t written;
+
+  while(length > 0) {
+    written = pwrite(fd, data, length, offset);
+    if(written < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    data += written;
+    length -= (unsigned long)written;
+    offset += written;
+  }
+}
+
+
+static int RenderMessage(ClEntry *entry, ClRecord *record, ClBuffer *buffer) {
+  ClPlan *      plan = entry->plan;
+  ClStep *      step;
+  char *        output;
+  unsigned long filename_length = 0;
+  unsigned long function_length = 0;
+  unsigned long reserve;
+  unsigned long start;
+  unsigned long i;
+
+  // Make room for the whole record up front, so each step only has to copy its output
+  if(plan->filenames > 0) {
+    filename_length = strlen(record->filename);
+  }
+  if(plan->functions > 0) {
+    function_length = strlen(record->function);
+  }
+  reserve = plan->messages*record->message_length + plan->filenames*filename_length + 
+            plan->functions*function_length + plan->processes*record->process->longest;
+  if(plan->escaped) {
+    reserve *= CL_JSON_EXPANSION;
+  }
+  reserve += plan->bound;
+
+  // Text handlers write the fields after every message, JSON handlers once at the end
+  if(record->fields_length > 0) {
+    reserve += (plan->messages+plan->escaped)*FieldsBound(record->fields, record->fields_length);
+  }
+  BufferReserve(buffer, reserve);
+  output = buffer->data+buffer->length;
+
+  for(i = 0; i < plan->length; i++) {
+    step = &(plan->steps[i]);
+    switch(step->type) {
+      case CL_FORMAT_TYPE_STRING:
+        memcpy(output, step->text, step->length);
+        output += step->length;
+        break;
+      case CL_FORMAT_TYPE_MESSAGE:
+        if(plan->escaped) {
+          output = EscapeJson(output, record->message, record->message_length);
+          break;
+        }
+        memcpy(output, record->message, record->message_length);
+        output += record->message_length;
+        if(record->fields_length > 0) {
+          output = RenderFields(output, record->fields, record->fields_length, 0);
+        }
+        break;
+      case CL_FORMAT_TYPE_LEVEL:
+        memcpy(output, plan->level_text[record->level], plan->level_length[record->level]);
+        output += plan->level_length[record->level];
+        break;
+      case CL_FORMAT_TYPE_FILENAME:
+        if(plan->escaped) {
+          output = EscapeJson(output, record->filename, filename_length);
+          break;
+        }
+        memcpy(output, record->filename, filename_length);
+        output += filename_length;
+        break;
+      case CL_FORMAT_TYPE_LINE_NUMBER:
+        output += FormatLong(output, record->line);
+        break;
+      case CL_FORMAT_TYPE_FUNCTION:
+        if(plan->escaped) {
+          output = EscapeJson(output, record->function, function_length);
+          break;
+        }
+        memcpy(output, record->function, function_length);
+        output += function_length;
+        break;
+      case CL_FORMAT_TYPE_TIME:
+        // The time can outgrow the space reserved for it, which moves the buffer
+        buffer->length = (unsigned long)(output-buffer->data);
+        start = buffer->length;
+        RenderTime(step->part, &(record->time), buffer);
+        if(plan->escaped) {
+          EscapeRendered(buffer, start);
+        }
+        BufferReserve(buffer, reserve);
+        output = buffer->data+buffer->length;
+        break;
+      case CL_FORMAT_TYPE_DURATION:
+        output = FormatDuration(output, record->uptime);
+        break;
+      case CL_FORMAT_TYPE_ROLLOVER:
+        output += FormatLong(output, (long)entry->handler->rollover_count);
+        break;
+      case CL_FORMAT_TYPE_PROC_ID:
+        memcpy(output, record->process->id_text, record->process->id_length);
+        output += record->process->id_length;
+        break;
+      case CL_FORMAT_TYPE_PROC_NAME:
+        output = RenderText(output, record->process->name, record->process->name_length, 
+                            plan->escaped);
+        break;
+      case CL_FORMAT_TYPE_PROC_EXEC:
+        output = RenderText(output, record->process->executable, 
+                            record->process->executable_length, plan->escaped);
+        break;
+      case CL_FORMAT_TYPE_PROC_USER:
+        output = RenderText(output, record->process->user, record->process->user_length, 
+                            plan->escaped);
+        break;
+      case CL_FORMAT_TYPE_THREAD_ID:
+        output += FormatLong(output, (long)record->thread_id);
+        break;
+      case CL_FORMAT_TYPE_PTHREAD_ID:
+        // TODO: Not portable, maybe allow the user to pass a function pointer for this?
+        // https://stackoverflow.com/questions/34370172/the-thread-id-returned-by-pthread-self-is-not-the-same-thing-as-the-kernel-thr
+        output += FormatLong(output, (long)record->pthread_id);
+        break;
+      case CL_FORMAT_TYPE_THREAD_NAME:
+        output = RenderText(output, record->thread_name, strnlen(record->thread_name, 
+                                                                 CL_THREAD_NAME_LENGTH-1), 
+                            plan->escaped);
+        break;
+      default:
+        break;
+    }
+  }
+
+  // The fields are added to the end of the object, which JSON plans always finish with
+  if(plan->escaped && record->fields_length > 0) {
+    output = RenderFields(output-1, record->fields, record->fields_length, 1);
+    *(output++) = '}';
+  }
+
+  *(output++) = '\n';
+  buffer->length = (unsigned long)(output-buffer->data);
+  return plan->shareable;
+}
+
+
+static void RenderTime(ClFormatPart *part, const struct timespec *time, ClBuffer *buffer) {
+  unsigned long sequence;
+  unsigned long len;
+  unsigned long max;
+  unsigned long i;
+  unsigned long fractions;
+  unsigned char offsets[CL_TIME_FRACTIONS];
+  unsigned char digits[CL_TIME_FRACTIONS];
+  ClTimeCache * cache = part->time_cache;
+
+  // Most records land in the same second as the previous one, in which case the cached text is 
+  // copied as long as no other thread rewrote it in the meantime, then given the record's digits
+  sequence = __atomic_load_n(&(cache->sequence), __ATOMIC_ACQUIRE);
+  if((sequence & 1) == 0 && __atomic_load_n(&(cache->time), __ATOMIC_RELAXED) == time->tv_sec) {
+    len = __atomic_load_n(&(cache->length), __ATOMIC_RELAXED);
+    fractions = __atomic_load_n(&(cache->fractions), __ATOMIC_RELAXED);
+    BufferReserve(buffer, len);
+    memcpy(buffer->data+buffer->length, cache->text, len);
+    memcpy(offsets, cache->offsets, CL_TIME_FRACTIONS);
+    memcpy(digits, cache->digits, CL_TIME_FRACTIONS);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&(cache->sequence), __ATOMIC_RELAXED) == sequence) {
+      for(i = 0; i < fractions; i++) {
+        FormatDigits(buffer->data+buffer->length+offsets[i], 
+                     (unsigned long)time->tv_nsec/fraction_scale[digits[i]], digits[i]);
+      }
+      buffer->length += len;
+      return;
+    }
+  }
+
+  // Otherwise, whichever thread gets to the cache first refreshes it for everyone else
+  if((sequence & 1) == 0 && 
+     __atomic_compare_exchange_n(&(cache->sequence), &sequence, sequence+1, 0, __ATOMIC_ACQUIRE, 
+                                 __ATOMIC_RELAXED)) {
+    len = FormatTime(part->context, time, cache->text, CL_TIME_CACHE_LENGTH, cache);
+    if(len > 0) {
+      BufferReserve(buffer, len);
+      memcpy(buffer->data+buffer->length, cache->text, len);
+      for(i = 0; i < cache->fractions; i++) {
+        FormatDigits(buffer->data+buffer->length+cache->offsets[i], 
+                     (unsigned long)time->tv_nsec/fraction_scale[cache->digits[i]], 
+                     cache->digits[i]);
+      }
+      buffer->length += len;
+    }
+    __atomic_store_n(&(cache->time), (len > 0) ? time->tv_sec : (time_t)-1, __ATOMIC_RELAXED);
+    __atomic_store_n(&(cache->length), len, __ATOMIC_RELAXED);
+    __atomic_store_n(&(cache->sequence), sequence+2, __ATOMIC_RELEASE);
+    if(len > 0) {
+      return;
+    }
+  }
+
+  // The cache is busy or the output doesn't fit in it, so render straight into the buffer. 
+  // FormatTime() returns 0 when the output doesn't fit, so keep growing the space it's given up to 
+  // a sane limit (an empty result is also reported as 0)
+  for(max = CL_TIME_CACHE_LENGTH; max <= 4096; max *= 2) {
+    BufferReserve(buffer, max);
+    len = FormatTime(part->context, time, buffer->data+buffer->length, max, NULL);
+    if(len > 0) {
+      buffer->length += len;
+      break;
+    }
+  }
+}
+
+
+static unsigned long FormatTime(const char *format, const struct timespec *time, char *output, 
+                                unsigned long max, ClTimeCache *cache) {
+  struct tm     tm;
+  char          piece[256];
+  char          spec[4];
+  char *        end;
+  const char *  next;
+  long          year;
+  long          offset;
+  unsigned long length = 0;
+  unsigned long piece_length;
+  int           digits;
+
+  // The numeric specifiers ISO 8601 timestamps are made of are written out directly, each into a 
+  // piece of its own so running out of space is only checked once, and the rest go to strftime()
+  LocalTime(time->tv_sec, &tm);
+  if(cache != NULL) {
+    cache->fractions = 0;
+  }
+  while(*format != '\0') {
+    next = strchrnul(format, '%');
+    if(length+(unsigned long)(next-format) >= max) {
+      return 0;
+    }
+    memcpy(output+length, format, (unsigned long)(next-format));
+    length += (unsigned long)(next-format);
+    if(*next == '\0') {
+      break;
+    }
+    format = next+1;
+    end = piece;
+    year = tm.tm_year+1900L;
+    switch(*format) {
+      case 'Y':
+        end = (year >= 0 && year <= 9999) ? FormatDigits(end, (unsigned long)year, 4) : 
+                                            end+FormatLong(end, year);
+        break;
+      case 'y':
+        end = FormatDigits(end, (unsigned long)(((year%100)+100)%100), 2);
+        break;
+      case 'm':
+        end = FormatDigits(end, (unsigned long)(tm.tm_mon+1), 2);
+        break;
+      case 'd':
+        end = FormatDigits(end, (unsigned long)tm.tm_mday, 2);
+        break;
+      case 'j':
+        end = FormatDigits(end, (unsigned long)(tm.tm_yday+1), 3);
+        break;
+      case 'H':
+        end = FormatDigits(end, (unsigned long)tm.tm_hour, 2);
+        break;
+      case 'M':
+        end = FormatDigits(end, (unsigned long)tm.tm_min, 2);
+        break;
+      case 'S':
+        end = FormatDigits(end, (unsigned long)tm.tm_sec, 2);
+        break;
+      case 's':
+        end += FormatLong(end, (long)time->tv_sec);
+        break;
+      case 'F':
+        end = (year >= 0 && year <= 9999) ? FormatDigits(end, (unsigned long)year, 4) : 
+                                            end+FormatLong(end, year);
+        *(end++) = '-';
+        end = FormatDigits(end, (unsigned long)(tm.tm_mon+1), 2);
+        *(end++) = '-';
+        end = FormatDigits(end, (unsigned long)tm.tm_mday, 2);
+        break;
+      case 'T':
+      case 'R':
+        end = FormatDigits(end, (unsigned long)tm.tm_hour, 2);
+        *(end++) = ':';
+        end = FormatDigits(end, (unsigned long)tm.tm_min, 2);
+        if(*format == 'T') {
+          *(end++) = ':';
+          end = FormatDigits(end, (unsigned long)tm.tm_sec, 2);
+        }
+        break;
+      case 'z':
+      case ':':
+        if(*format == ':' && format[1] != 'z') {
+          goto library;
+        }
+        offset = tm.tm_gmtoff/60;
+        *(end++) = (offset < 0) ? '-' : '+';
+        offset = (offset < 0) ? -offset : offset;
+        end = FormatDigits(end, (unsigned long)(offset/60), 2);
+        if(*format == ':') {
+          *(end++) = ':';
+          format++;
+        }
+        end = FormatDigits(end, (unsigned long)(offset%60), 2);
+        break;
+      case 'N':
+      case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+        // Sub-second digits, as many as precede the N (nanoseconds by default, like date). The 
+        // cached text leaves zeros in their place, for each record to fill in
+        digits = 9;
+        if(*format != 'N') {
+          if(format[1] != 'N') {
+            goto library;
+          }
+          digits = *(format++)-'0';
+        }
+        if(cache == NULL) {
+          end = FormatDigits(end, (unsigned long)time->tv_nsec/fraction_scale[digits], digits);
+          break;
+        }
+        if(cache->fractions == CL_TIME_FRACTIONS) {
+          return 0;
+        }
+        cache->offsets[cache->fractions] = (unsigned char)length;
+        cache->digits[cache->fractions] = (unsigned char)digits;
+        cache->fractions++;
+        end = FormatDigits(end, 0, digits);
+        break;
+      case '%':
+        *(end++) = '%';
+        break;
+      case '\0':
+        // A trailing percent sign is printed as it is
+        *(end++) = '%';
+        format--;
+        break;
+      default:
+      library:
+        // strftime() can't tell an empty result from one that doesn't fit, so it's given plenty
+        spec[0] = '%';
+        spec[1] = *format;
+        spec[2] = '\0';
+        spec[3] = '\0';
+        if((*format == 'E' || *format == 'O') && format[1] != '\0') {
+          spec[2] = *(++format);
+        }
+        end += strftime(piece, sizeof(piece), spec, &tm);
+        break;
+    }
+    piece_length = (unsigned long)(end-piece);
+    if(length+piece_length >= max) {
+      return 0;
+    }
+    memcpy(output+length, piece, piece_length);
+    length += piece_length;
+    format++;
+  }
+  return length;
+}
+
+
+static char *FormatDigits(char *output, unsigned long value, int digits) {
+  int i;
+
+  // Exactly that many digits, zero padded, for values known to fit
+  for(i = digits-1; i >= 0; i--) {
+    output[i] = (char)('0'+value%10);
+    value /= 10;
+  }
+  return output+digits;
+}
+
+
+static char *FormatDuration(char *output, int64_t uptime) {
+  output += FormatUnsigned(output, (unsigned long)(uptime/1000000000));
+  *(output++) = '.';
+  return FormatDigits(output, (unsigned long)(uptime%1000000000)/1000, 6);
+}
+
+
+static void LocalTime(time_t time, struct tm *tm) {
+  time_t shifted;
+
+  pthread_mutex_lock(&(timezone_cache.mutex));
+
+  // Look the offset up again once the local hour it was valid for is over, since that's the 
+  // granularity daylight saving time transitions happen at
+  if(time < timezone_cache.valid_from || time >= timezone_cache.valid_until) {
+    localtime_r(&time, tm);
+    timezone_cache.offset = tm->tm_gmtoff;
+    timezone_cache.is_dst = tm->tm_isdst;
+    timezone_cache.zone = tm->tm_zone;
+    timezone_cache.valid_from = time - ((time + timezone_cache.offset) % 3600);
+    timezone_cache.valid_until = timezone_cache.valid_from + 3600;
+    pthread_mutex_unlock(&(timezone_cache.mutex));
+    return;
+  }
+
+  // Within the hour, converting the shifted UTC time gives the local time without localtime_r() 
+  // having to consult the timezone database
+  shifted = time + timezone_cache.offset;
+  gmtime_r(&shifted, tm);
+  tm->tm_gmtoff = timezone_cache.offset;
+  tm->tm_isdst = timezone_cache.is_dst;
+  tm->tm_zone = timezone_cache.zone;
+  pthread_mutex_unlock(&(timezone_cache.mutex));
+}
+
+
+static unsigned long FormatLong(char *output, long value) {
+  if(value < 0) {
+    *output = '-';
+    return 1+FormatUnsigned(output+1, 0-(unsigned long)value);
+  }
+  return FormatUnsigned(output, (unsigned long)value);
+}
+
+
+static unsigned long FormatUnsigned(char *output, unsigned long value) {
+  char          digits[24];
+  char *        start = FormatDecimal(digits+sizeof(digits), value);
+  unsigned long length = (unsigned long)(digits+sizeof(digits)-start);
+
+  memcpy(output, start, length);
+  return length;
+}
+
+
+static char *RenderText(char *output, const char *data, unsigned long length, int escaped) {
+  if(escaped) {
+    return EscapeJson(output, data, length);
+  }
+  memcpy(output, data, length);
+  return output+length;
+}
+
+
+static char *EscapeJson(char *output, const char *data, unsigned long length) {
+  unsigned long i = 0;
+  unsigned long run;
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  __m128i       chunk;
+  __m128i       special;
+  unsigned int  mask;
+
+  // Look at 16 bytes at a time for a quote, a backslash or a control byte (at most 0x1f, which is 
+  // where taking the unsigned maximum with 0x1f leaves the byte unchanged). Runs without any are 
+  // copied as a whole, and the output always has room for them since it's sized for the worst case
+  while(length-i >= 16) {
+    chunk = _mm_loadu_si128((const __m128i *)(data+i));
+    special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+    mask = (unsigned int)_mm_movemask_epi8(special);
+    if(mask == 0) {
+      _mm_storeu_si128((__m128i *)output, chunk);
+      output += 16;
+      i += 16;
+      continue;
+    }
+    run = (unsigned long)__builtin_ctz(mask);
+    memcpy(output, data+i, run);
+    output = EscapeJsonByte(output+run, (unsigned char)data[i+run]);
+    i += run+1;
+  }
+#endif
+
+  // The rest (or everything, without SSE2) is scanned a byte at a time. Bytes from 0x80 up are 
+  // copied as they are, so UTF-8 text stays readable
+  while(i < length) {
+    run = i;
+    while(i < length && (unsigned char)data[i] >= 0x20 && data[i] != '"' && data[i] != '\\') {
+      i++;
+    }
+    memcpy(output, data+run, i-run);
+    output += i-run;
+    if(i < length) {
+      output = EscapeJsonByte(output, (unsigned char)data[i++]);
+    }
+  }
+  return output;
+}
+
+
+static char *EscapeJsonByte(char *output, unsigned char byte) {
+  static const char hex[] = "0123456789abcdef";
+
+  *(output++) = '\\';
+  switch(byte) {
+    case '"':
+    case '\\':
+      *(output++) = (char)byte;
+      break;
+    case '\n':
+      *(output++) = 'n';
+      break;
+    case '\r':
+      *(output++) = 'r';
+      break;
+    case '\t':
+      *(output++) = 't';
+      break;
+    case '\b':
+      *(output++) = 'b';
+      break;
+    case '\f':
+      *(output++) = 'f';
+      break;
+    default:
+      memcpy(output, "u00", 3);
+      output[3] = hex[byte >> 4];
+      output[4] = hex[byte & 0xf];
+      output += 5;
+      break;
+  }
+  return output;
+}
+
+
+static unsigned long FieldsBound(const ClField *fields, unsigned long fields_length) {
+  unsigned long bound = 0;
+  unsigned long i;
+
+  // The key is escaped and surrounded by a separator, quotes and a colon, while the value takes 
+  // at most 32 bytes unless it's a string, which is quoted and escaped
+  for(i = 0; i < fields_length; i++) {
+    bound += CL_JSON_EXPANSION*strlen(fields[i].key) + 4;
+    if(fields[i].type == CL_FIELD_STRING && fields[i].value.s != NULL) {
+      bound += CL_JSON_EXPANSION*strlen(fields[i].value.s) + 2;
+    }
+    else {
+      bound += 32;
+    }
+  }
+  return bound;
+}
+
+
+static char *RenderFields(char *output, const ClField *fields, unsigned long fields_length, 
+                          int escaped) {
+  unsigned long i;
+  unsigned long length;
+
+  // Text is written as space separated key=value pairs following the message (logfmt), while 
+  // JSON gets a member per field, separated by commas from whatever came before in the object
+  for(i = 0; i < fields_length; i++) {
+    length = strlen(fields[i].key);
+    if(escaped) {
+      if(output[-1] != '{') {
+        *(output++) = ',';
+      }
+      *(output++) = '"';
+      output = EscapeJson(output, fields[i].key, length);
+      *(output++) = '"';
+      *(output++) = ':';
+    }
+    else {
+      *(output++) = ' ';
+      memcpy(output, fields[i].key, length);
+      output += length;
+      *(output++) = '=';
+    }
+    output = RenderValue(output, &(fields[i]), escaped);
+  }
+  return output;
+}
+
+
+static char *RenderValue(char *output, const ClField *field, int escaped) {
+  const char *  string;
+  unsigned long length;
+  unsigned long i;
+  int           quoted;
+
+  switch(field->type) {
+    case CL_FIELD_INT:
+      output += FormatLong(output, (long)field->value.i);
+      break;
+    case CL_FIELD_UINT:
+      output += FormatUnsigned(output, (unsigned long)field->value.u);
+      break;
+    case CL_FIELD_DOUBLE:
+      // JSON has no representation for infinities and NaNs
+      if(escaped && !isfinite(field->value.d)) {
+        memcpy(output, "null", 4);
+        output += 4;
+        break;
+      }
+      output += FormatShortest(output, field->value.d);
+      break;
+    case CL_FIELD_BOOL:
+      string = field->value.u ? "true" : "false";
+      length = strlen(string);
+      memcpy(output, string, length);
+      output += length;
+      break;
+    case CL_FIELD_STRING:
+      string = field->value.s;
+      if(string == NULL) {
+        string = escaped ? "null" : "(null)";
+        length = strlen(string);
+        memcpy(output, string, length);
+        output += length;
+        break;
+      }
+
+      // Text only quotes strings that wouldn't read back as a single value otherwise
+      length = strlen(string);
+      quoted = escaped || length == 0;
+      for(i = 0; !quoted && i < length; i++) {
+        quoted = ((unsigned char)string[i] <= ' ' || string[i] == '=' || string[i] == '"' || 
+                  string[i] == '\\');
+      }
+      if(!quoted) {
+        memcpy(output, string, length);
+        output += length;
+        break;
+      }
+      *(output++) = '"';
+      output = EscapeJson(output, string, length);
+      *(output++) = '"';
+      break;
+    default:
+      break;
+  }
+  return output;
+}
+
+
+static void EscapeRendered(ClBuffer *buffer, unsigned long start) {
+  unsigned long length = buffer->length-start;
+  unsigned long i;
+  char *        copy;
+
+  // Times rarely hold anything that needs escaping, so they're only moved out of the way when they do
+  for(i = start; i < buffer->length; i++) {
+    if((unsigned char)buffer->data[i] < 0x20 || buffer->data[i] == '"' || buffer->data[i] == '\\') {
+      break;
+    }
+  }
+  if(i == buffer->length) {
+    return;
+  }
+  copy = malloc(length*sizeof(char));
+  memcpy(copy, buffer->data+start, length);
+  buffer->length = start;
+  BufferReserve(buffer, CL_JSON_EXPANSION*length);
+  buffer->length = (unsigned long)(EscapeJson(buffer->data+start, copy, length)-buffer->data);
+  free(copy);
+}
+
+
+static void WriteMessage(int fd, const char *data, unsigned long length) {
+  ssize_t written;
+
+  // A single write() keeps the record in one piece, only a short write needs another call
+  while(length > 0) {
+    written = write(fd, data, length);
+    if(written < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    data += written;
+    length -= (unsigned long)written;
+  }
+}
+
+
+static void BufferReserve(ClBuffer *buffer, unsigned long length) {
+  unsigned long capacity;
+  char *        data;
+
+  if(buffer->length+length <= buffer->capacity) {
+    return;
+  }
+
+  capacity = buffer->capacity*2;
+  if(capacity < buffer->length+length) {
+    capacity = buffer->length+length;
+  }
+  if(buffer->on_heap) {
+    buffer->data = realloc(buffer->data, capacity*sizeof(char));
+  }
+  else {
+    // Move off the stack the first time the buffer outgrows it
+    data = malloc(capacity*sizeof(char));
+    memcpy(data, buffer->data, buffer->length);
+    buffer->data = data;
+    buffer->on_heap = 1;
+  }
+  buffer->capacity = capacity;
+}
+
+
+static void BufferAppend(ClBuffer *buffer, const char *data, unsigned long length) {
+  BufferReserve(buffer, length);
+  memcpy(buffer->data+buffer->length, data, length);
+  buffer->length += length;
+}
+
+
+static void BufferPrintf(ClBuffer *buffer, const char *format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  BufferVprintf(buffer, format, args);
+  va_end(args);
+}
+
+
+static void BufferVprintf(ClBuffer *buffer, const char *format, va_list args) {
+  int     len;
+  va_list copy;
+
+  // Try formatting into whatever space is left first, and only grow the buffer if it didn't fit
+  va_copy(copy, args);
+  len = vsnprintf(buffer->data+buffer->length, buffer->capacity-buffer->length, format, copy);
+  va_end(copy);
+  if(len < 0) {
+    return;
+  }
+  if((unsigned long)len >= buffer->capacity-buffer->length) {
+    BufferReserve(buffer, (unsigned long)len+1);
+    vsnprintf(buffer->data+buffer->length, buffer->capacity-buffer->length, format, args);
+  }
+  buffer->length += (unsigned long)len;
+}
+
+
+static void FormatMessage(ClBuffer *buffer, const char *format, va_list args) {
+  int           saved_errno = errno;
+  int           status;
+  unsigned long start = buffer->length;
+  va_list       copy;
+
+  // Format strings Clog can't follow argument by argument (positional arguments, %n, %m) are 
+  // handed to libc as a whole, starting over from the original arguments
+  va_copy(copy, args);
+  status = FormatDirect(buffer, format, copy);
+  va_end(copy);
+  if(status != 0) {
+    buffer->length = start;
+    errno = saved_errno;
+    BufferVprintf(buffer, format, args);
+  }
+
+  // The message is also kept NUL-terminated, for whatever still treats it as a string
+  BufferReserve(buffer, 1);
+  buffer->data[buffer->length] = '\0';
+}
+
+
+static int FormatDirect(ClBuffer *buffer, const char *format, va_list args) {
+  unsigned long i;
+  unsigned long j;
+  ClSpec        spec;
+  ClValue       value;
+
+  for(i = 0; format[i] != '\0'; ) {
+    // Copy text up to the next specifier as is
+    if(format[i] != '%') {
+      j = (unsigned long)(strchrnul(format+i, '%')-format);
+      BufferAppend(buffer, format+i, j-i);
+      i = j;
+      continue;
+    }
+    if(format[i+1] == '%') {
+      BufferAppend(buffer, "%", 1);
+      i += 2;
+      continue;
+    }
+
+    j = ReadSpec(format, i, &spec);
+    if(j == 0) {
+      return -1;
+    }
+    if(spec.width_star) {
+      spec.width = va_arg(args, int);
+      if(spec.width < 0) {
+        spec.left = 1;
+        spec.width = -spec.width;
+      }
+    }
+    if(spec.precision_star) {
+      spec.precision = va_arg(args, int);
+      if(spec.precision < 0) {
+        spec.precision = -1;
+      }
+    }
+
+    // Read the argument as the type the conversion and length modifier call for
+    switch(spec.conversion) {
+      case 'd':
+      case 'i':
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X':
+        switch(spec.length) {
+          case 'l': value.i = (long long)va_arg(args, long);      break;
+          case 'q': value.i = va_arg(args, long long);            break;
+          case 'L': value.i = va_arg(args, long long);            break;
+          case 'j': value.i = (long long)va_arg(args, intmax_t);  break;
+          case 'z': value.i = (long long)va_arg(args, size_t);    break;
+          case 't': value.i = (long long)va_arg(args, ptrdiff_t); break;
+          default:  value.i = (long long)va_arg(args, int);       break;
+        }
+        break;
+      case 'e':
+      case 'E':
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+        if(spec.length == 'L') {
+          value.ld = va_arg(args, long double);
+        }
+        else {
+          value.d = va_arg(args, double);
+        }
+        break;
+      case 'c':
+      case 'C':
+        if(spec.length == 'l' || spec.conversion == 'C') {
+          value.c = va_arg(args, wint_t);
+        }
+        else {
+          value.i = (long long)va_arg(args, int);
+        }
+        break;
+      default:
+        value.p = va_arg(args, const void *);
+        break;
+    }
+    FormatArgument(buffer, &spec, &value);
+    i = j;
+  }
+  return 0;
+}
+
+
+static unsigned long ReadSpec(const char *format, unsigned long i, ClSpec *spec) {
+  memset(spec, 0, sizeof(ClSpec));
+  spec->precision = -1;
+
+  // Flags
+  for(i++; ; i++) {
+    switch(format[i]) {
+      case '-': spec->left = 1;      continue;
+      case '+': spec->plus = 1;      continue;
+      case ' ': spec->space = 1;     continue;
+      case '#': spec->alternate = 1; continue;
+      case '0': spec->zero = 1;      continue;
+      case '\'':
+      case 'I': spec->other = 1;     continue;
+      default:                       break;
+    }
+    break;
+  }
+
+  // Field width and precision, either of which can be taken from an int argument
+  if(format[i] == '*') {
+    spec->width_star = 1;
+    i++;
+  }
+  for(; format[i] >= '0' && format[i] <= '9'; i++) {
+    spec->width = (spec->width < 100000) ? 10*spec->width + (format[i]-'0') : spec->width;
+  }
+  if(format[i] == '$') {
+    return 0;
+  }
+  if(format[i] == '.') {
+    spec->precision = 0;
+    if(format[++i] == '*') {
+      spec->precision_star = 1;
+      i++;
+    }
+    for(; format[i] >= '0' && format[i] <= '9'; i++) {
+      spec->precision = (spec->precision < 100000) ? 10*spec->precision + (format[i]-'0') : 
+                                                     spec->precision;
+    }
+  }
+
+  // Length modifier
+  switch(format[i]) {
+    case 'h':
+      spec->length = (format[i+1] == 'h') ? 'H' : 'h';
+      i += (format[i+1] == 'h') ? 2 : 1;
+      break;
+    case 'l':
+      spec->length = (format[i+1] == 'l') ? 'q' : 'l';
+      i += (format[i+1] == 'l') ? 2 : 1;
+      break;
+    case 'q':
+    case 'L':
+    case 'j':
+    case 'z':
+    case 't':
+      spec->length = format[i++];
+      break;
+    case 'Z':
+      spec->length = 'z';
+      i++;
+      break;
+    default:
+      break;
+  }
+
+  // Conversion. Those that write through or read errno rather than an argument are left to libc
+  switch(format[i]) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+    case 'c': case 'C': case 's': case 'S': case 'p':
+      spec->conversion = format[i];
+      return i+1;
+    default:
+      return 0;
+  }
+}
+
+
+static void FormatArgument(ClBuffer *buffer, const ClSpec *spec, const ClValue *value) {
+  static const char  *null_string = "(null)";
+  const char *        string;
+  unsigned long long  magnitude;
+  long long           signed_value;
+  unsigned long       length;
+  char                character;
+
+  if(spec->other) {
+    FormatLibc(buffer, spec, value);
+    return;
+  }
+  switch(spec->conversion) {
+    case 'd':
+    case 'i':
+      switch(spec->length) {
+        case 'H': signed_value = (signed char)value->i;    break;
+        case 'h': signed_value = (short)value->i;          break;
+        case 'l': signed_value = (long)value->i;           break;
+        case 'j': signed_value = (intmax_t)value->i;       break;
+        case 'z': signed_value = (ssize_t)value->i;        break;
+        case 't': signed_value = (ptrdiff_t)value->i;      break;
+        case 'q':
+        case 'L': signed_value = value->i;                 break;
+        default:  signed_value = (int)value->i;            break;
+      }
+      magnitude = (signed_value < 0) ? 0-(unsigned long long)signed_value : 
+                                       (unsigned long long)signed_value;
+      FormatInteger(buffer, spec, magnitude, signed_value < 0);
+      break;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      switch(spec->length) {
+        case 'H': magnitude = (unsigned char)value->i;      break;
+        case 'h': magnitude = (unsigned short)value->i;     break;
+        case 'l': magnitude = (unsigned long)value->i;      break;
+        case 'j': magnitude = (uintmax_t)value->i;          break;
+        case 'z': magnitude = (size_t)value->i;             break;
+        case 't': magnitude = (size_t)(ptrdiff_t)value->i;  break;
+        case 'q':
+        case 'L': magnitude = (unsigned long long)value->i; break;
+        default:  magnitude = (unsigned int)value->i;       break;
+      }
+      FormatInteger(buffer, spec, magnitude, 0);
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+      if(spec->length == 'L' || spec->precision > CL_FLOAT_PRECISION) {
+        FormatLibc(buffer, spec, value);
+        break;
+      }
+      FormatFloat(buffer, spec, value->d);
+      break;
+    case 'c':
+      if(spec->length == 'l') {
+        FormatLibc(buffer, spec, value);
+        break;
+      }
+      character = (char)(unsigned char)value->i;
+      FormatPadded(buffer, spec, "", 0, 0, &character, 1);
+      break;
+    case 's':
+      if(spec->length == 'l') {
+        FormatLibc(buffer, spec, value);
+        break;
+      }
+
+      // Like glibc, a NULL string prints as (null), unless the precision cuts it short
+      string = (const char *)value->p;
+      if(string == NULL) {
+        string = (spec->precision < 0 || spec->precision >= 6) ? null_string : "";
+      }
+      length = (spec->precision < 0) ? strlen(string) : strnlen(string, (size_t)spec->precision);
+      FormatPadded(buffer, spec, "", 0, 0, string, length);
+      break;
+    case 'p':
+      if(value->p == NULL) {
+        FormatPadded(buffer, spec, "", 0, 0, "(nil)", 5);
+        break;
+      }
+      FormatInteger(buffer, spec, (unsigned long long)(uintptr_t)value->p, 0);
+      break;
+    default:
+      FormatLibc(buffer, spec, value);
+      break;
+  }
+}
+
+
+static void FormatLibc(ClBuffer *buffer, const ClSpec *spec, const ClValue *value) {
+  char text[64];
+  int  k = 0;
+
+  // Rebuild the specification with the width and precision filled in, so the value is the only 
+  // argument left to pass
+  text[k++] = '%';
+  if(spec->left)      text[k++] = '-';
+  if(spec->plus)      text[k++] = '+';
+  if(spec->space)     text[k++] = ' ';
+  if(spec->alternate) text[k++] = '#';
+  if(spec->zero)      text[k++] = '0';
+  if(spec->other)     text[k++] = '\'';
+  if(spec->width > 0) {
+    k += sprintf(text+k, "%d", spec->width);
+  }
+  if(spec->precision >= 0) {
+    k += sprintf(text+k, ".%d", spec->precision);
+  }
+  switch(spec->length) {
+    case 0:   break;
+    case 'H': text[k++] = 'h'; text[k++] = 'h'; break;
+    case 'q': text[k++] = 'l'; text[k++] = 'l'; break;
+    default:  text[k++] = spec->length;         break;
+  }
+  text[k++] = spec->conversion;
+  text[k] = '\0';
+
+  switch(spec->conversion) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+      switch(spec->length) {
+        case 'H':
+        case 'h':
+        case 0:   BufferPrintf(buffer, text, (int)value->i);       break;
+        case 'l': BufferPrintf(buffer, text, (long)value->i);      break;
+        case 'j': BufferPrintf(buffer, text, (intmax_t)value->i);  break;
+        case 'z': BufferPrintf(buffer, text, (size_t)value->i);    break;
+        case 't': BufferPrintf(buffer, text, (ptrdiff_t)value->i); break;
+        default:  BufferPrintf(buffer, text, value->i);            break;
+      }
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      if(spec->length == 'L') {
+        BufferPrintf(buffer, text, value->ld);
+      }
+      else {
+        BufferPrintf(buffer, text, value->d);
+      }
+      break;
+    case 'c':
+    case 'C':
+      if(spec->length == 'l' || spec->conversion == 'C') {
+        BufferPrintf(buffer, text, value->c);
+      }
+      else {
+        BufferPrintf(buffer, text, (int)value->i);
+      }
+      break;
+    default:
+      BufferPrintf(buffer, text, value->p);
+      break;
+  }
+}
+
+
+static void FormatInteger(ClBuffer *buffer, const ClSpec *spec, unsigned long long magnitude, 
+                          int negative) {
+  static const char   lower[] = "0123456789abcdef";
+  static const char   upper[] = "0123456789ABCDEF";
+  const char *        hex = (spec->conversion == 'X') ? upper : lower;
+  char                digits[32];
+  char *              body = digits+sizeof(digits);
+  char                prefix[3];
+  unsigned long       prefix_length = 0;
+  unsigned long       body_length;
+  unsigned long       zeros = 0;
+  unsigned long       total;
+
+  // A precision of 0 prints nothing for 0, other than the 0 that # adds to octal numbers
+  if(magnitude != 0 || spec->precision != 0) {
+    switch(spec->conversion) {
+      case 'o':
+        do {
+          *(--body) = (char)('0' + (magnitude & 7));
+          magnitude >>= 3;
+        } while(magnitude > 0);
+        break;
+      case 'x':
+      case 'X':
+      case 'p':
+        do {
+          *(--body) = hex[magnitude & 15];
+          magnitude >>= 4;
+        } while(magnitude > 0);
+        break;
+      default:
+        body = FormatDecimal(body, magnitude);
+        break;
+    }
+  }
+  body_length = (unsigned long)(digits+sizeof(digits)-body);
+  if(spec->precision > 0 && (unsigned long)spec->precision > body_length) {
+    zeros = (unsigned long)spec->precision - body_length;
+  }
+  if(spec->alternate && spec->conversion == 'o' && zeros == 0 && 
+     (body_length == 0 || *body != '0')) {
+    zeros = 1;
+  }
+
+  // Pointers are printed like %#x, though glibc also gives them a sign if asked to
+  if(negative) {
+    prefix[prefix_length++] = '-';
+  }
+  else if(spec->conversion == 'd' || spec->conversion == 'i' || spec->conversion == 'p') {
+    if(spec->plus) {
+      prefix[prefix_length++] = '+';
+    }
+    else if(spec->space) {
+      prefix[prefix_length++] = ' ';
+    }
+  }
+  if(spec->conversion == 'p' || (spec->alternate && (spec->conversion == 'x' || 
+                                                     spec->conversion == 'X') && 
+                                 body_length > 0 && !(body_length == 1 && *body == '0'))) {
+    prefix[prefix_length++] = '0';
+    prefix[prefix_length++] = (spec->conversion == 'X') ? 'X' : 'x';
+  }
+
+  // The 0 flag pads with zeros after the sign and prefix, unless a precision was given
+  total = prefix_length+zeros+body_length;
+  if(spec->zero && !spec->left && spec->precision < 0 && (unsigned long)spec->width > total) {
+    zeros += (unsigned long)spec->width - total;
+  }
+  FormatPadded(buffer, spec, prefix, prefix_length, zeros, body, body_length);
+}
+
+
+static void FormatFloat(ClBuffer *buffer, const ClSpec *spec, double value) {
+  char          body[CL_FLOAT_DIGITS+CL_FLOAT_PRECISION+16];
+  char          sign[1];
+  unsigned long sign_length = 0;
+  unsigned long body_length;
+  unsigned long zeros = 0;
+
+  if(signbit(value)) {
+    sign[sign_length++] = '-';
+    value = -value;
+  }
+  else if(spec->plus) {
+    sign[sign_length++] = '+';
+  }
+  else if(spec->space) {
+    sign[sign_length++] = ' ';
+  }
+  body_length = FormatFloatBody(body, spec, value);
+
+  // Infinities and NaNs are padded with spaces even with the 0 flag
+  if(spec->zero && !spec->left && isfinite(value) && 
+     (unsigned long)spec->width > sign_length+body_length) {
+    zeros = (unsigned long)spec->width - sign_length - body_length;
+  }
+  FormatPadded(buffer, spec, sign, sign_length, zeros, body, body_length);
+}
+
+
+static unsigned long FormatFloatBody(char *output, const ClSpec *spec, double value) {
+  ClDecimal     decimal;
+  int           upper = (spec->conversion == 'E' || spec->conversion == 'F' || 
+                         spec->conversion == 'G');
+  int           precision = (spec->precision < 0) ? 6 : spec->precision;
+  int           exponent;
+  int           style = spec->conversion | 0x20;
+  int           k;
+  unsigned long length = 0;
+
+  if(isnan(value) || isinf(value)) {
+    memcpy(output, isnan(value) ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf"), 3);
+    return 3;
+  }
+
+  // %g picks %e or %f depending on the exponent the value has once rounded to its precision, and 
+  // drops trailing zeros unless the # flag is set
+  if(style == 'g') {
+    if(precision == 0) {
+      precision = 1;
+    }
+    FloatDigits(value, 0, precision, &decimal);
+    exponent = (decimal.length > 0) ? decimal.point-1 : 0;
+    if(exponent < -4 || exponent >= precision) {
+      style = 'e';
+      precision--;
+    }
+    else {
+      style = 'f';
+      precision = precision-1-exponent;
+    }
+    if(!spec->alternate) {
+      while(decimal.length > 0 && decimal.digits[decimal.length-1] == '0') {
+        decimal.length--;
+      }
+      k = (style == 'e') ? decimal.length-1 : decimal.length-decimal.point;
+      if(k < precision) {
+        precision = (k > 0) ? k : 0;
+      }
+    }
+  }
+  else {
+    FloatDigits(value, style == 'f', (style == 'f') ? precision : precision+1, &decimal);
+  }
+
+  if(style == 'f') {
+    // The integer part, then the fraction, with zeros wherever there are no digits
+    if(decimal.point <= 0) {
+      output[length++] = '0';
+    }
+    for(k = 0; k < decimal.point; k++) {
+      output[length++] = (k < decimal.length) ? decimal.digits[k] : '0';
+    }
+    if(precision > 0 || spec->alternate) {
+      output[length++] = '.';
+    }
+    for(k = decimal.point; k < decimal.point+precision; k++) {
+      output[length++] = (k >= 0 && k < decimal.length) ? decimal.digits[k] : '0';
+    }
+    return length;
+  }
+
+  // A single digit before the point, then the exponent with at least two digits
+  exponent = (decimal.length > 0) ? decimal.point-1 : 0;
+  output[length++] = (decimal.length > 0) ? decimal.digits[0] : '0';
+  if(precision > 0 || spec->alternate) {
+    output[length++] = '.';
+  }
+  for(k = 1; k <= precision; k++) {
+    output[length++] = (k < decimal.length) ? decimal.digits[k] : '0';
+  }
+  output[length++] = upper ? 'E' : 'e';
+  output[length++] = (exponent < 0) ? '-' : '+';
+  if(exponent < 0) {
+    exponent = -exponent;
+  }
+  if(exponent >= 100) {
+    output[length++] = (char)('0' + exponent/100);
+  }
+  output[length++] = (char)('0' + exponent/10%10);
+  output[length++] = (char)('0' + exponent%10);
+  return length;
+}
+
+
+static void FormatPadded(ClBuffer *buffer, const ClSpec *spec, const char *prefix, 
+                         unsigned long prefix_length, unsigned long zeros, const char *body, 
+                         unsigned long body_length) {
+  unsigned long total = prefix_length+zeros+body_length;
+  unsigned long padding = 0;
+  unsigned long k;
+  char *        output;
+
+  if((unsigned long)spec->width > total) {
+    padding = (unsigned long)spec->width - total;
+  }
+
+  // Most arguments have neither a width nor a prefix, and are only copied over
+  BufferReserve(buffer, total+padding);
+  output = buffer->data+buffer->length;
+  if(padding+prefix_length+zeros == 0) {
+    memcpy(output, body, body_length);
+    buffer->length += body_length;
+    return;
+  }
+
+  if(!spec->left) {
+    memset(output, ' ', padding);
+    output += padding;
+  }
+  for(k = 0; k < prefix_length; k++) {
+    *(output++) = prefix[k];
+  }
+  memset(output, '0', zeros);
+  output += zeros;
+  memcpy(output, body, body_length);
+  output += body_length;
+  if(spec->left) {
+    memset(output, ' ', padding);
+    output += padding;
+  }
+  buffer->length = (unsigned long)(output-buffer->data);
+}
+
+
+static char *FormatDecimal(char *end, unsigned long long value) {
+  static const char pairs[] = "0001020304050607080910111213141516171819"
+                              "2021222324252627282930313233343536373839"
+                              "4041424344454647484950515253545556575859"
+                              "6061626364656667686970717273747576777879"
+                              "8081828384858687888990919293949596979899";
+  unsigned long     pair;
+
+  // Two digits at a time from a table, writing backwards from the end of the output
+  while(value >= 100) {
+    pair = (unsigned long)(value % 100)*2;
+    value /= 100;
+    *(--end) = pairs[pair+1];
+    *(--end) = pairs[pair];
+  }
+  if(value >= 10) {
+    pair = (unsigned long)value*2;
+    *(--end) = pairs[pair+1];
+    *(--end) = pairs[pair];
+  }
+  else {
+    *(--end) = (char)('0' + value);
+  }
+  return end;
+}
+
+
+static void FloatDigits(double value, int fixed, int count, ClDecimal *decimal) {
+  char          chunk[24];
+  char *        start;
+  uint32_t      words[36];
+  uint32_t      chunks[40];
+  uint64_t      mantissa;
+  uint64_t      integer = 0;
+  uint64_t      fraction = 0;
+  uint64_t      product;
+  int           exponent;
+  int           shift = 0;
+  int           size = 0;
+  int           chunks_length = 0;
+  int           next = -1;
+  int           sticky = 0;
+  int           places = 0;
+  int           digit;
+  int           k;
+  int           n;
+
+  decimal->length = 0;
+  decimal->point = 0;
+  if(value == 0) {
+    return;
+  }
+
+  // Split the value into an integer mantissa and a power of two, which is exact for every double. 
+  // Subnormals have fewer mantissa bits, the power of two never goes below the smallest one
+  mantissa = (uint64_t)ldexp(frexp(value, &exponent), 53);
+  exponent -= 53;
+  if(exponent < -1074) {
+    mantissa >>= -1074-exponent;
+    exponent = -1074;
+  }
+
+  // The integer part. Small ones fit a single word, larger ones are held as 32-bit words and 
+  // divided down into chunks of nine decimal digits
+  if(exponent >= 0 && exponent <= 10) {
+    integer = mantissa << exponent;
+  }
+  else if(exponent > 10) {
+    size = (exponent+53)/32+1;
+    memset(words, 0, size*sizeof(uint32_t));
+    words[exponent/32] = (uint32_t)(mantissa << (exponent%32));
+    words[exponent/32+1] = (uint32_t)((mantissa << (exponent%32)) >> 32);
+    if(exponent%32 > 11) {
+      words[exponent/32+2] = (uint32_t)(mantissa >> (64-exponent%32));
+    }
+    while(size > 0) {
+      product = 0;
+      for(k = size-1; k >= 0; k--) {
+        product = (product << 32) | words[k];
+        words[k] = (uint32_t)(product/1000000000u);
+        product %= 1000000000u;
+      }
+      chunks[chunks_length++] = (uint32_t)product;
+      while(size > 0 && words[size-1] == 0) {
+        size--;
+      }
+    }
+  }
+  else {
+    shift = -exponent;
+    if(shift < 64) {
+      integer = mantissa >> shift;
+      fraction = mantissa & ((1ull << shift) - 1);
+    }
+    else {
+      fraction = mantissa;
+    }
+  }
+  if(chunks_length > 0) {
+    for(k = chunks_length-1; k >= 0; k--) {
+      start = FormatDecimal(chunk+9, chunks[k]);
+      while(k < chunks_length-1 && start > chunk) {
+        *(--start) = '0';
+      }
+      memcpy(decimal->digits+decimal->length, start, (unsigned long)(chunk+9-start));
+      decimal->length += (int)(chunk+9-start);
+    }
+  }
+  else if(integer > 0) {
+    start = FormatDecimal(chunk+sizeof(chunk), integer);
+    decimal->length = (int)(chunk+sizeof(chunk)-start);
+    memcpy(decimal->digits, start, (unsigned long)decimal->length);
+  }
+  decimal->point = decimal->length;
+
+  // With more integer digits than were asked for, the next one decides the rounding
+  if(!fixed && decimal->length > count) {
+    next = decimal->digits[count]-'0';
+    for(k = count+1; k < decimal->length; k++) {
+      sticky |= (decimal->digits[k] != '0');
+    }
+    sticky |= (fraction != 0);
+    decimal->length = count;
+    RoundDigits(decimal, next > 5 || (next == 5 && (sticky || (decimal->digits[count-1] & 1))));
+    return;
+  }
+
+  // Otherwise the fraction is multiplied out a digit at a time, skipping leading zeros, until one 
+  // past the last digit wanted. Fractions with more than 60 bits are held as 32-bit words instead, 
+  // multiplied by 10^9 at a time
+  if(shift > 60) {
+    size = (shift+30)/32+2;
+    memset(words, 0, size*sizeof(uint32_t));
+    words[0] = (uint32_t)fraction;
+    words[1] = (uint32_t)(fraction >> 32);
+  }
+  while(next < 0) {
+    if(shift <= 60) {
+      if(fraction == 0) {
+        next = 0;
+        break;
+      }
+      fraction *= 10;
+      chunk[0] = (char)('0' + (fraction >> shift));
+      fraction &= (1ull << shift) - 1;
+      n = 1;
+    }
+    else {
+      for(k = 0; k < size && words[k] == 0; k++);
+      if(k == size) {
+        next = 0;
+        break;
+      }
+      product = 0;
+      for(k = 0; k < size; k++) {
+        product += (uint64_t)words[k]*1000000000u;
+        words[k] = (uint32_t)product;
+        product >>= 32;
+      }
+      k = shift/32;
+      product = ((uint64_t)words[k] | ((uint64_t)words[k+1] << 32)) >> (shift%32);
+      words[k] &= (shift%32 == 0) ? 0 : (1u << (shift%32)) - 1;
+      words[k+1] = 0;
+      start = FormatDecimal(chunk+9, product);
+      while(start > chunk) {
+        *(--start) = '0';
+      }
+      n = 9;
+    }
+
+    for(k = 0; k < n; k++) {
+      digit = chunk[k]-'0';
+      if(next >= 0) {
+        sticky |= digit;
+      }
+      else if(fixed ? places == count : decimal->length == count) {
+        next = digit;
+      }
+      else if(digit == 0 && decimal->length == 0) {
+        places++;
+        decimal->point--;
+      }
+      else {
+        places++;
+        decimal->digits[decimal->length++] = chunk[k];
+      }
+    }
+  }
+  if(shift <= 60) {
+    sticky |= (fraction != 0);
+  }
+  else {
+    for(k = 0; k < size; k++) {
+      sticky |= (words[k] != 0);
+    }
+  }
+
+  // Round half to even, like glibc does for exact ties
+  digit = (decimal->length > 0) ? decimal->digits[decimal->length-1]-'0' : 0;
+  RoundDigits(decimal, next > 5 || (next == 5 && (sticky || (digit & 1))));
+}
+
+
+static void RoundDigits(ClDecimal *decimal, int up) {
+  int k;
+
+  if(!up) {
+    return;
+  }
+  for(k = decimal->length-1; k >= 0; k--) {
+    if(decimal->digits[k] != '9') {
+      decimal->digits[k]++;
+      return;
+    }
+    decimal->length--;
+  }
+
+  // Every digit carried over (or there were none), leaving a single 1 one place further left
+  decimal->digits[0] = '1';
+  decimal->length = 1;
+  decimal->point++;
+}
+
+
+static unsigned long FormatShortest(char *output, double value) {
+  char          text[40];
+  unsigned long length = 0;
+  unsigned long body_length = 0;
+  ClSpec        spec;
+  int           precision;
+
+  // The fewest significant digits, from 15 up, that still read back as the same double
+  memset(&spec, 0, sizeof(ClSpec));
+  spec.conversion = 'g';
+  if(signbit(value)) {
+    text[length++] = '-';
+  }
+  for(precision = 15; precision <= 17; precision++) {
+    spec.precision = precision;
+    body_length = FormatFloatBody(text+length, &spec, fabs(value));
+    text[length+body_length] = '\0';
+    if(!isfinite(value) || strtod(text, NULL) == value) {
+      break;
+    }
+  }
+  memcpy(output, text, length+body_length);
+  return length+body_length;
+}
+
+
+static int AsyncLog(ClRecord *record, const char *message, va_list *args) {
+  int           len;
+  int           blocked = 0;
+  long          encoded = -1;
+  unsigned long pos;
+  ClAsyncSlot * slot;
+  ClSite *      site;
+  ClBuffer      buffer;
+  va_list       copy;
+
+  // Register as a producer before checking that the writer thread is still running, so 
+  // ClStopAsync() can't free the ring buffer out from under this call
+  __atomic_add_fetch(&async_producers, 1, __ATOMIC_SEQ_CST);
+  if(!__atomic_load_n(&async_running, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch(&async_producers, 1, __ATOMIC_SEQ_CST);
+    return 0;
+  }
+
+  // When the message can be replayed from its arguments, formatting it is left to the writer 
+  // thread. Structured records have no arguments, only their message and fields
+  site = (args != NULL) ? FindSite(record->filename, record->line, record->function, message) : NULL;
+
+  // Claim a slot, applying the backpressure policy while the ring buffer is full
+  while((slot = AsyncClaim(&pos)) == NULL) {
+    if(async_policy == CL_ASYNC_POLICY_DROP_NEWEST) {
+      __atomic_add_fetch(&async_stats.dropped_newest, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&async_producers, 1, __ATOMIC_SEQ_CST);
+      return 1;
+    }
+    else if(async_policy == CL_ASYNC_POLICY_DROP_OLDEST && AsyncDequeue(NULL)) {
+      __atomic_add_fetch(&async_stats.dropped_oldest, 1, __ATOMIC_RELAXED);
+    }
+    else {
+      if(!blocked && async_policy == CL_ASYNC_POLICY_BLOCK) {
+        blocked = 1;
+        __atomic_add_fetch(&async_stats.blocked, 1, __ATOMIC_RELAXED);
+      }
+      AsyncWake();
+      sched_yield();
+    }
+  }
+
+  // Copy the arguments (or if that's not possible, format the message) straight into the claimed 
+  // slot, along with the fields of structured records, then publish it to the writer thread
+  slot->record = *record;
+  if(site != NULL) {
+    va_copy(copy, *args);
+    encoded = EncodeArguments(site, copy, (unsigned char *)slot->message, CL_ASYNC_MESSAGE_LENGTH);
+    va_end(copy);
+  }
+  if(args == NULL) {
+    slot->record.arguments_length = PackFields(&(slot->record), slot->message, 
+                                               CL_ASYNC_MESSAGE_LENGTH);
+    len = (int)slot->record.message_length;
+  }
+  else if(encoded >= 0) {
+    slot->record.site = site;
+    slot->record.arguments_length = (unsigned long)encoded;
+    len = 0;
+  }
+  else {
+    slot->record.site = NULL;
+    slot->record.arguments_length = 0;
+    buffer.data = slot->message;
+    buffer.length = 0;
+    buffer.capacity = CL_ASYNC_MESSAGE_LENGTH;
+    buffer.on_heap = 0;
+    FormatMessage(&buffer, message, *args);
+
+    // Messages that don't fit the slot are truncated
+    len = (int)buffer.length;
+    if(buffer.on_heap) {
+      len = CL_ASYNC_MESSAGE_LENGTH - 1;
+      memcpy(slot->message, buffer.data, len);
+      slot->message[len] = '\0';
+      free(buffer.data);
+    }
+  }
+  slot->record.message = NULL;
+  slot->record.message_length = (unsigned long)len;
+  __atomic_store_n(&(slot->sequence), pos+1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&async_stats.enqueued, 1, __ATOMIC_RELAXED);
+
+  __atomic_sub_fetch(&async_producers, 1, __ATOMIC_SEQ_CST);
+  AsyncWake();
+  return 1;
+}
+
+
+static ClAsyncSlot *AsyncClaim(unsigned long *pos) {
+  long          diff;
+  unsigned long seq;
+  ClAsyncSlot * slot;
+
+  *pos = __atomic_load_n(&async_head, __ATOMIC_RELAXED);
+  while(1) {
+    slot = &(async_slots[*pos & async_mask]);
+    seq = __atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE);
+    diff = (long)seq - (long)*pos;
+
+    // The slot is free for this position, try to take it before another producer does
+    if(diff == 0) {
+      if(__atomic_compare_exchange_n(&async_head, pos, *pos+1, 1, __ATOMIC_RELAXED, 
+                                     __ATOMIC_RELAXED)) {
+        return slot;
+      }
+    }
+    // The slot still holds a record from the previous lap, the ring buffer is full
+    else if(diff < 0) {
+      return NULL;
+    }
+    // Another producer took the slot, try again at the new position
+    else {
+      *pos = __atomic_load_n(&async_head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+
+static int AsyncDequeue(ClAsyncSlot *slot) {
+  long          diff;
+  unsigned long pos;
+  unsigned long seq;
+  ClAsyncSlot * current;
+
+  pos = __atomic_load_n(&async_tail, __ATOMIC_RELAXED);
+  while(1) {
+    current = &(async_slots[pos & async_mask]);
+    seq = __atomic_load_n(&(current->sequence), __ATOMIC_ACQUIRE);
+    diff = (long)seq - (long)(pos+1);
+    if(diff == 0) {
+      if(__atomic_compare_exchange_n(&async_tail, &pos, pos+1, 1, __ATOMIC_RELAXED, 
+                                     __ATOMIC_RELAXED)) {
+        break;
+      }
+    }
+    // The slot hasn't been published yet, the ring buffer is empty
+    else if(diff < 0) {
+      return 0;
+    }
+    else {
+      pos = __atomic_load_n(&async_tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  // Copy the record out (unless it's being dropped) before handing the slot back to producers
+  if(slot != NULL) {
+    slot->record = current->record;
+    if(current->record.fields != NULL) {
+      memcpy(slot->message, current->message, current->record.arguments_length);
+      UnpackFields(&(slot->record), slot->message);
+    }
+    else if(current->record.site != NULL) {
+      memcpy(slot->message, current->message, current->record.arguments_length);
+      slot->record.arguments = (const unsigned char *)slot->message;
+    }
+    else {
+      memcpy(slot->message, current->message, current->record.message_length);
+      slot->message[current->record.message_length] = '\0';
+      slot->record.message = slot->message;
+    }
+  }
+  __atomic_store_n(&(current->sequence), pos+async_mask+1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+
+static unsigned long PackFields(ClRecord *record, char *output, unsigned long max) {
+  unsigned long length = record->message_length;
+  unsigned long used;
+  unsigned long count = 0;
+  unsigned long key_length;
+  unsigned long value_length;
+  unsigned long i;
+  ClField *     fields;
+
+  // The message comes first, followed by the fields and then the text of their keys and strings. 
+  // Pointers are stored as offsets from the start, since the slot is copied before it's read
+  if(length > max-1) {
+    length = max-1;
+  }
+  memcpy(output, record->message, length);
+  output[length] = '\0';
+  record->message_length = length;
+  used = (length+1 + __alignof__(ClField)-1) & ~(unsigned long)(__alignof__(ClField)-1);
+  fields = (ClField *)(output+used);
+  used += record->fields_length*sizeof(ClField);
+
+  // Fields are kept in order for as long as they fit
+  for(i = 0; used <= max && i < record->fields_length; i++) {
+    key_length = strlen(record->fields[i].key)+1;
+    value_length = 0;
+    if(record->fields[i].type == CL_FIELD_STRING && record->fields[i].value.s != NULL) {
+      value_length = strlen(record->fields[i].value.s)+1;
+    }
+    if(used+key_length+value_length > max) {
+      break;
+    }
+    fields[count] = record->fields[i];
+    memcpy(output+used, record->fields[i].key, key_length);
+    fields[count].key = (const char *)(uintptr_t)used;
+    used += key_length;
+    if(value_length > 0) {
+      memcpy(output+used, record->fields[i].value.s, value_length);
+      fields[count].value.s = (const char *)(uintptr_t)used;
+      used += value_length;
+    }
+    count++;
+  }
+  record->fields = (count > 0) ? (const ClField *)(uintptr_t)((char *)fields-output) : NULL;
+  record->fields_length = count;
+  return (count > 0) ? used : length+1;
+}
+
+
+static void UnpackFields(ClRecord *record, char *base) {
+  unsigned long i;
+  ClField *     fields = (ClField *)(base+(uintptr_t)record->fields);
+
+  for(i = 0; i < record->fields_length; i++) {
+    fields[i].key = base+(uintptr_t)fields[i].key;
+    if(fields[i].type == CL_FIELD_STRING && fields[i].value.s != NULL) {
+      fields[i].value.s = base+(uintptr_t)fields[i].value.s;
+    }
+  }
+  record->fields = fields;
+  record->message = base;
+}
+
+
+static void AsyncWake() {
+  // Only pay for the mutex when the writer thread is actually asleep
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&async_sleeping, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&async_mutex);
+    pthread_cond_signal(&async_cond);
+    pthread_mutex_unlock(&async_mutex);
+  }
+}
+
+
+static void *AsyncWriter(void *arg) {
+  unsigned long       seq;
+  unsigned long       tail;
+  struct timespec     deadline;
+  static ClAsyncSlot  slot;
+
+  while(1) {
+    if(AsyncDequeue(&slot)) {
+      DispatchRecord(&(slot.record));
+      continue;
+    }
+
+    // Once ClStopAsync() has waited out every producer, an empty ring buffer means we're done
+    if(__atomic_load_n(&async_exiting, __ATOMIC_SEQ_CST)) {
+      break;
+    }
+
+    // Sleep until a producer wakes us up. The ring buffer is checked again after announcing that 
+    // we're asleep so a record published in between isn't left waiting, and the timeout bounds 
+    // the delay in case a wake up is missed anyway
+    pthread_mutex_lock(&async_mutex);
+    __atomic_store_n(&async_sleeping, 1, __ATOMIC_SEQ_CST);
+    tail = __atomic_load_n(&async_tail, __ATOMIC_SEQ_CST);
+    seq = __atomic_load_n(&(async_slots[tail & async_mask].sequence), __ATOMIC_SEQ_CST);
+    if(seq != tail+1 && !__atomic_load_n(&async_exiting, __ATOMIC_SEQ_CST)) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += 100000000;
+      if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&async_cond, &async_mutex, &deadline);
+    }
+    __atomic_store_n(&async_sleeping, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&async_mutex);
+  }
+
+  return arg;
+}
+
+
+static ClSite *FindSite(const char *filename, long line, const char *function, const char *message) {
+  int           arguments_length = 0;
+  unsigned long i;
+  unsigned long j;
+  unsigned long hash;
+  unsigned long start;
+  ClArgument *  arguments;
+  ClSite *      site;
+
+  // Format strings and filenames are almost always literals, so their addresses and the line 
+  // number identify the call site without having to hash the strings themselves
+  hash = (unsigned long)message ^ ((unsigned long)filename << 7) ^ ((unsigned long)line*2654435761ul);
+  hash ^= hash >> 29;
+  start = (hash*0x9e3779b97f4a7c15ul) >> 17;
+  for(i = start & (CL_SITE_COUNT-1); ; i = (i+1) & (CL_SITE_COUNT-1)) {
+    site = __atomic_load_n(&(sites[i]), __ATOMIC_ACQUIRE);
+    if(site == NULL) {
+      break;
+    }
+    if(site->message_key == message && site->filename_key == filename && site->line == line) {
+      // A format string built at runtime may have been rewritten since, in which case it can't be 
+      // described by the site anymore
+      if(site->signature == NULL || strcmp(site->message, message) != 0) {
+        return NULL;
+      }
+      return site;
+    }
+  }
+
+  pthread_mutex_lock(&sites_mutex);
+
+  // Another thread may have added the site while we were waiting for the mutex
+  for(i = start & (CL_SITE_COUNT-1); sites[i] != NULL; i = (i+1) & (CL_SITE_COUNT-1)) {
+    if(sites[i]->message_key == message && sites[i]->filename_key == filename && 
+       sites[i]->line == line) {
+      pthread_mutex_unlock(&sites_mutex);
+      return (sites[i]->signature != NULL && strcmp(sites[i]->message, message) == 0) ? 
+             sites[i] : 
+             NULL;
+    }
+  }
+
+  // Keep the table at most half full so probing stays short
+  if(sites_length >= CL_SITE_COUNT/2) {
+    pthread_mutex_unlock(&sites_mutex);
+    return NULL;
+  }
+
+  // Every specifier consumes at least one character, which bounds the number of arguments
+  arguments = malloc((strlen(message)+1)*sizeof(ClArgument));
+  for(j = 0; message[j] != '\0'; ) {
+    if(message[j] != '%') {
+      j++;
+      continue;
+    }
+    j = ParseSpecifier(message, j, arguments, &arguments_length);
+    if(j == 0) {
+      // Formats that can't be replayed from the argument bytes are remembered as such (without a 
+      // signature) so they aren't parsed again on every call
+      free(arguments);
+      arguments = NULL;
+      arguments_length = 0;
+      break;
+    }
+  }
+
+  site = malloc(sizeof(ClSite));
+  sites_length++;
+  site->id = sites_length;
+  site->filename_key = filename;
+  site->message_key = message;
+  site->line = line;
+  site->filename = malloc((strlen(filename)+1)*sizeof(char));
+  strcpy(site->filename, filename);
+  site->function = malloc((strlen(function)+1)*sizeof(char));
+  strcpy(site->function, function);
+  site->message = malloc((strlen(message)+1)*sizeof(char));
+  strcpy(site->message, message);
+  site->signature = NULL;
+  site->signature_length = (unsigned long)arguments_length;
+  if(arguments != NULL) {
+    site->signature = malloc((arguments_length+1)*sizeof(unsigned char));
+    for(j = 0; j < (unsigned long)arguments_length; j++) {
+      site->signature[j] = (unsigned char)arguments[j];
+    }
+    free(arguments);
+  }
+  __atomic_store_n(&(sites[i]), site, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&sites_mutex);
+  return site->signature != NULL ? site : NULL;
+}
+
+
+static void DeleteSites() {
+  unsigned long i;
+
+  pthread_mutex_lock(&sites_mutex);
+  for(i = 0; i < CL_SITE_COUNT; i++) {
+    if(sites[i] != NULL) {
+      free(sites[i]->filename);
+      free(sites[i]->function);
+      free(sites[i]->message);
+      if(sites[i]->signature != NULL) {
+        free(sites[i]->signature);
+      }
+      free(sites[i]);
+      sites[i] = NULL;
+    }
+  }
+  sites_length = 0;
+  pthread_mutex_unlock(&sites_mutex);
+}
+
+
+static unsigned long ParseSpecifier(const char *message, unsigned long i, ClArgument *arguments, 
+                                    int *arguments_length) {
+  int           length = 0;
+  unsigned long start = i;
+
+  // Skip the '%' and any flags
+  i++;
+  if(message[i] == '%') {
+    return i+1;
+  }
+  while(message[i] != '\0' && strchr("-+ #0'I", message[i]) != NULL) {
+    i++;
+  }
+
+  // Field width, where '*' takes it from an int argument. Positional arguments (%1$d) aren't 
+  // supported, since the arguments are captured in the order they're passed
+  if(message[i] == '*') {
+    arguments[(*arguments_length)++] = CL_ARGUMENT_INT;
+    i++;
+  }
+  else {
+    while(message[i] >= '0' && message[i] <= '9') {
+      i++;
+    }
+  }
+  if(message[i] == '$') {
+    return 0;
+  }
+
+  // Precision
+  if(message[i] == '.') {
+    i++;
+    if(message[i] == '*') {
+      arguments[(*arguments_length)++] = CL_ARGUMENT_INT;
+      i++;
+    }
+    else {
+      while(message[i] >= '0' && message[i] <= '9') {
+        i++;
+      }
+    }
+  }
+
+  // Length modifier
+  switch(message[i]) {
+    case 'h':
+      i += (message[i+1] == 'h') ? 2 : 1;
+      break;
+    case 'l':
+      if(message[i+1] == 'l') {
+        length = CL_ARGUMENT_LONG_LONG;
+        i += 2;
+      }
+      else {
+        length = CL_ARGUMENT_LONG;
+        i++;
+      }
+      break;
+    case 'q':
+      length = CL_ARGUMENT_LONG_LONG;
+      i++;
+      break;
+    case 'L':
+      length = CL_ARGUMENT_LONG_DOUBLE;
+      i++;
+      break;
+    case 'j':
+      length = CL_ARGUMENT_INTMAX;
+      i++;
+      break;
+    case 'z':
+    case 'Z':
+      length = CL_ARGUMENT_SIZE;
+      i++;
+      break;
+    case 't':
+      length = CL_ARGUMENT_PTRDIFF;
+      i++;
+      break;
+    default:
+      break;
+  }
+
+  // The specifier is replayed from a fixed size copy, so don't accept absurdly long ones
+  if(i-start > 60) {
+    return 0;
+  }
+
+  // Conversion, which decides the type of the argument along with the length modifier
+  switch(message[i]) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      if(length == CL_ARGUMENT_LONG_DOUBLE) {
+        return 0;
+      }
+      arguments[(*arguments_length)++] = (length == 0) ? CL_ARGUMENT_INT : (ClArgument)length;
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      if(length != 0 && length != CL_ARGUMENT_LONG && length != CL_ARGUMENT_LONG_DOUBLE) {
+        return 0;
+      }
+      arguments[(*arguments_length)++] = (length == CL_ARGUMENT_LONG_DOUBLE) ? 
+                                         CL_ARGUMENT_LONG_DOUBLE : 
+                                         CL_ARGUMENT_DOUBLE;
+      break;
+    case 'c':
+      if(length != 0) {
+        return 0;
+      }
+      arguments[(*arguments_length)++] = CL_ARGUMENT_INT;
+      break;
+    case 's':
+      if(length != 0) {
+        return 0;
+      }
+      arguments[(*arguments_length)++] = CL_ARGUMENT_STRING;
+      break;
+    case 'p':
+      arguments[(*arguments_length)++] = CL_ARGUMENT_POINTER;
+      break;
+    default:
+      // %n writes through its argument and %m reads errno, neither of which can be deferred
+      return 0;
+  }
+
+  return i+1;
+}
+
+
+static long EncodeArguments(ClSite *site, va_list args, unsigned char *output, unsigned long max) {
+  unsigned long i;
+  unsigned long size;
+  unsigned long length = 0;
+  uint32_t      string_length;
+  const char *  string;
+  union {
+    int         i;
+    long        l;
+    long long   ll;
+    size_t      z;
+    intmax_t    j;
+    ptrdiff_t   t;
+    double      d;
+    long double ld;
+    void *      p;
+  } value;
+
+  // Arguments are copied with their native size and representation, the decoder checks that it 
+  // runs on a machine with the same layout
+  for(i = 0; i < site->signature_length; i++) {
+    switch(site->signature[i]) {
+      case CL_ARGUMENT_INT:
+        value.i = va_arg(args, int);
+        size = sizeof(int);
+        break;
+      case CL_ARGUMENT_LONG:
+        value.l = va_arg(args, long);
+        size = sizeof(long);
+        break;
+      case CL_ARGUMENT_LONG_LONG:
+        value.ll = va_arg(args, long long);
+        size = sizeof(long long);
+        break;
+      case CL_ARGUMENT_SIZE:
+        value.z = va_arg(args, size_t);
+        size = sizeof(size_t);
+        break;
+      case CL_ARGUMENT_INTMAX:
+        value.j = va_arg(args, intmax_t);
+        size = sizeof(intmax_t);
+        break;
+      case CL_ARGUMENT_PTRDIFF:
+        value.t = va_arg(args, ptrdiff_t);
+        size = sizeof(ptrdiff_t);
+        break;
+      case CL_ARGUMENT_DOUBLE:
+        value.d = va_arg(args, double);
+        size = sizeof(double);
+        break;
+      case CL_ARGUMENT_LONG_DOUBLE:
+        // Clear the padding so the output doesn't depend on whatever was on the stack
+        memset(&value, 0, sizeof(value));
+        value.ld = va_arg(args, long double);
+        size = sizeof(long double);
+        break;
+      case CL_ARGUMENT_POINTER:
+        value.p = va_arg(args, void *);
+        size = sizeof(void *);
+        break;
+      case CL_ARGUMENT_STRING:
+        // Strings are copied as a length (all bits set for NULL) followed by the terminated text
+        string = va_arg(args, const char *);
+        string_length = (string != NULL) ? (uint32_t)strlen(string) : UINT32_MAX;
+        size = (string != NULL) ? string_length+1 : 0;
+        if(length+sizeof(uint32_t)+size > max) {
+          return -1;
+        }
+        memcpy(output+length, &string_length, sizeof(uint32_t));
+        length += sizeof(uint32_t);
+        if(string != NULL) {
+          memcpy(output+length, string, size);
+          length += size;
+        }
+        continue;
+      default:
+        return -1;
+    }
+    if(length+size > max) {
+      return -1;
+    }
+    memcpy(output+length, &value, size);
+    length += size;
+  }
+
+  return (long)length;
+}
+
+
+static int ReplayMessage(const char *message, const unsigned char *arguments, 
+                         unsigned long arguments_length, ClBuffer *buffer) {
+  int           star;
+  int           classes_length;
+  unsigned long i;
+  unsigned long j;
+  unsigned long n;
+  unsigned long pos = 0;
+  uint32_t      string_length;
+  ClArgument    classes[3];
+  ClSpec        spec;
+  ClValue       value;
+  union {
+    int         i;
+    long        l;
+    long long   ll;
+    size_t      z;
+    intmax_t    j;
+    ptrdiff_t   t;
+    double      d;
+    long double ld;
+    void *      p;
+  } stored;
+
+  for(i = 0; message[i] != '\0'; ) {
+    // Copy text up to the next specifier as is
+    if(message[i] != '%') {
+      for(j = i; message[j] != '\0' && message[j] != '%'; j++);
+      BufferAppend(buffer, message+i, j-i);
+      i = j;
+      continue;
+    }
+
+    classes_length = 0;
+    j = ParseSpecifier(message, i, classes, &classes_length);
+    if(j == 0) {
+      return -1;
+    }
+    if(classes_length == 0) {
+      BufferAppend(buffer, "%", 1);
+      i = j;
+      continue;
+    }
+    if(ReadSpec(message, i, &spec) != j) {
+      return -1;
+    }
+
+    // Apply the captured width and precision for any '*'
+    for(n = 0; n+1 < (unsigned long)classes_length; n++) {
+      if(pos+sizeof(int) > arguments_length) {
+        return -1;
+      }
+      memcpy(&star, arguments+pos, sizeof(int));
+      pos += sizeof(int);
+      if(spec.width_star && n == 0) {
+        spec.width = (star < 0) ? -star : star;
+        spec.left |= (star < 0);
+      }
+      else {
+        // A negative precision is taken as if it were omitted
+        spec.precision = (star < 0) ? -1 : star;
+      }
+    }
+
+    // Then replay the value itself
+    if(classes[classes_length-1] == CL_ARGUMENT_STRING) {
+      if(pos+sizeof(uint32_t) > arguments_length) {
+        return -1;
+      }
+      memcpy(&string_length, arguments+pos, sizeof(uint32_t));
+      pos += sizeof(uint32_t);
+      if(string_length == UINT32_MAX) {
+        value.p = NULL;
+      }
+      else if(pos+string_length+1 > arguments_length || arguments[pos+string_length] != '\0') {
+        return -1;
+      }
+      else {
+        value.p = arguments+pos;
+        pos += string_length+1;
+      }
+      FormatArgument(buffer, &spec, &value);
+      i = j;
+      continue;
+    }
+    switch(classes[classes_length-1]) {
+      case CL_ARGUMENT_INT:         n = sizeof(int);         break;
+      case CL_ARGUMENT_LONG:        n = sizeof(long);        break;
+      case CL_ARGUMENT_LONG_LONG:   n = sizeof(long long);   break;
+      case CL_ARGUMENT_SIZE:        n = sizeof(size_t);      break;
+      case CL_ARGUMENT_INTMAX:      n = sizeof(intmax_t);    break;
+      case CL_ARGUMENT_PTRDIFF:     n = sizeof(ptrdiff_t);   break;
+      case CL_ARGUMENT_DOUBLE:      n = sizeof(double);      break;
+      case CL_ARGUMENT_LONG_DOUBLE: n = sizeof(long double); break;
+      case CL_ARGUMENT_POINTER:     n = sizeof(void *);      break;
+      default:                      return -1;
+    }
+    if(pos+n > arguments_length) {
+      return -1;
+    }
+    memcpy(&stored, arguments+pos, n);
+    pos += n;
+    switch(classes[classes_length-1]) {
+      case CL_ARGUMENT_INT:         value.i = stored.i;              break;
+      case CL_ARGUMENT_LONG:        value.i = stored.l;              break;
+      case CL_ARGUMENT_LONG_LONG:   value.i = stored.ll;             break;
+      case CL_ARGUMENT_SIZE:        value.i = (long long)stored.z;   break;
+      case CL_ARGUMENT_INTMAX:      value.i = stored.j;              break;
+      case CL_ARGUMENT_PTRDIFF:     value.i = stored.t;              break;
+      case CL_ARGUMENT_DOUBLE:      value.d = stored.d;              break;
+      case CL_ARGUMENT_LONG_DOUBLE: value.ld = stored.ld;            break;
+      default:                      value.p = stored.p;              break;
+    }
+    FormatArgument(buffer, &spec, &value);
+    i = j;
+  }
+
+  return 0;
+}
+
+
+static void EncodeRecord(ClEntry *entry, ClRecord *record, ClBuffer *buffer) {
+  ClHandler *   handler = entry->handler;
+  unsigned char level = (unsigned char)record->level;
+  uint32_t      id;
+  uint32_t      nanoseconds = (uint32_t)record->time.tv_nsec;
+  uint32_t      length;
+  int32_t       thread_id = (int32_t)record->thread_id;
+  int32_t       process_id = (int32_t)record->process->id;
+  int64_t       line;
+  int64_t       seconds = (int64_t)record->time.tv_sec;
+  uint64_t      value;
+  unsigned long bits = 8*sizeof(unsigned long);
+  unsigned long start;
+
+  // Every file starts with a header describing the machine and process that wrote it and the 
+  // handler's format. The process ID is stored with each record instead, since a forked child keeps 
+  // writing to the same file
+  if((__atomic_load_n(&(handler->binary_sites[0]), __ATOMIC_RELAXED) & 1ul) == 0) {
+    BufferAppend(buffer, &binary_header, 1);
+    BufferAppend(buffer, binary_magic, sizeof(binary_magic));
+    BufferAppend(buffer, (const char *)&binary_version, 1);
+    BufferAppend(buffer, (const char *)binary_layout, sizeof(binary_layout));
+    BufferAppend(buffer, (const char *)handler->id, sizeof(uuid_t));
+    value = (uint64_t)handler->rollover_count;
+    BufferAppend(buffer, (const char *)&value, sizeof(uint64_t));
+    EncodeString(buffer, entry->format);
+    EncodeString(buffer, record->process->name);
+    EncodeString(buffer, record->process->executable);
+    EncodeString(buffer, record->process->user);
+  }
+
+  // Records without a call site couldn't be deferred, so their formatted message is stored instead
+  if(record->site == NULL) {
+    BufferAppend(buffer, &binary_text, 1);
+    BufferAppend(buffer, (const char *)&level, 1);
+    BufferAppend(buffer, (const char *)&seconds, sizeof(int64_t));
+    BufferAppend(buffer, (const char *)&nanoseconds, sizeof(uint32_t));
+    BufferAppend(buffer, (const char *)&thread_id, sizeof(int32_t));
+    value = (uint64_t)record->pthread_id;
+    BufferAppend(buffer, (const char *)&value, sizeof(uint64_t));
+    BufferAppend(buffer, (const char *)&process_id, sizeof(int32_t));
+    if(entry->plan->thread_names) {
+      EncodeString(buffer, record->thread_name);
+    }
+    if(entry->plan->durations) {
+      BufferAppend(buffer, (const char *)&(record->uptime), sizeof(int64_t));
+    }
+    line = (int64_t)record->line;
+    BufferAppend(buffer, (const char *)&line, sizeof(int64_t));
+    EncodeString(buffer, record->filename);
+    EncodeString(buffer, record->function);
+
+    // Structured fields are stored as the text they'd be rendered as, following the message
+    start = buffer->length;
+    length = (uint32_t)record->message_length;
+    BufferAppend(buffer, (const char *)&length, sizeof(uint32_t));
+    BufferAppend(buffer, record->message, record->message_length);
+    if(record->fields_length > 0) {
+      BufferReserve(buffer, FieldsBound(record->fields, record->fields_length));
+      buffer->length = (unsigned long)(RenderFields(buffer->data+buffer->length, record->fields, 
+                                                    record->fields_length, 0)-buffer->data);
+      length = (uint32_t)(buffer->length-start-sizeof(uint32_t));
+      memcpy(buffer->data+start, &length, sizeof(uint32_t));
+    }
+    return;
+  }
+
+  // Describe the call site the first time it shows up in the file
+  id = (uint32_t)record->site->id;
+  if((__atomic_load_n(&(handler->binary_sites[id/bits]), __ATOMIC_RELAXED) & 
+      (1ul << (id%bits))) == 0) {
+    BufferAppend(buffer, &binary_site, 1);
+    BufferAppend(buffer, (const char *)&id, sizeof(uint32_t));
+    line = (int64_t)record->site->line;
+    BufferAppend(buffer, (const char *)&line, sizeof(int64_t));
+    EncodeString(buffer, record->site->filename);
+    EncodeString(buffer, record->site->function);
+    EncodeString(buffer, record->site->message);
+  }
+
+  BufferAppend(buffer, &binary_event, 1);
+  BufferAppend(buffer, (const char *)&id, sizeof(uint32_t));
+  BufferAppend(buffer, (const char *)&level, 1);
+  BufferAppend(buffer, (const char *)&seconds, sizeof(int64_t));
+  BufferAppend(buffer, (const char *)&nanoseconds, sizeof(uint32_t));
+  BufferAppend(buffer, (const char *)&thread_id, sizeof(int32_t));
+  value = (uint64_t)record->pthread_id;
+  BufferAppend(buffer, (const char *)&value, sizeof(uint64_t));
+  BufferAppend(buffer, (const char *)&process_id, sizeof(int32_t));
+  if(entry->plan->thread_names) {
+    EncodeString(buffer, record->thread_name);
+  }
+  if(entry->plan->durations) {
+    BufferAppend(buffer, (const char *)&(record->uptime), sizeof(int64_t));
+  }
+  length = (uint32_t)record->arguments_length;
+  BufferAppend(buffer, (const char *)&length, sizeof(uint32_t));
+  BufferAppend(buffer, (const char *)record->arguments, record->arguments_length);
+}
+
+
+static void MarkSites(ClHandler *handler, ClRecord *record) {
+  unsigned long id;
+  unsigned long bits = 8*sizeof(unsigned long);
+
+  // Only marked once the entry has been written, so another thread can't write an event for the 
+  // site ahead of its description (at worst, both threads describe it)
+  __atomic_fetch_or(&(handler->binary_sites[0]), 1ul, __ATOMIC_RELAXED);
+  if(record->site != NULL) {
+    id = record->site->id;
+    __atomic_fetch_or(&(handler->binary_sites[id/bits]), 1ul << (id%bits), __ATOMIC_RELAXED);
+  }
+}
+
+
+static void EncodeString(ClBuffer *buffer, const char *string) {
+  uint32_t length = (uint32_t)strlen(string);
+
+  BufferAppend(buffer, (const char *)&length, sizeof(uint32_t));
+  BufferAppend(buffer, string, length);
+}
+
+
+static int DecodeBytes(FILE *input, void *output, unsigned long length) {
+  return (fread(output, 1, length, input) == length) ? 0 : -1;
+}
+
+
+static char *DecodeString(FILE *input) {
+  uint32_t length;
+  char *   string;
+
+  // Anything longer than this is a corrupt length rather than a real string
+  if(DecodeBytes(input, &length, sizeof(uint32_t)) != 0 || length > (1u << 24)) {
+    return NULL;
+  }
+  string = malloc((length+1)*sizeof(char));
+  if(DecodeBytes(input, string, length) != 0) {
+    free(string);
+    return NULL;
+  }
+  string[length] = '\0';
+  return string;
+}
+
+
+static void ParseFormat(char *format, ClFormatPart **parsed_format, 
+                        unsigned long *parsed_format_length) {
+  unsigned long i;
+  unsigned long j;
+  unsigned long old_i;
+  unsigned long old_j;
+  unsigned long len = 0;
+  unsigned long format_len = (unsigned long)strlen(format);
+  unsigned long caches = 0;
+  unsigned long text_length = 0;
+  ClFormatPart *packed;
+  ClTimeCache * cache;
+  char *        text;
+
+  // Create the format part(s) that correspond to each specifier, as well as each static string of 
+  // characters within the format string. i and j start at the beginning of the string and i is 
+  // incremented until a specifier is found, at which point the difference between i and j is used 
+  // to capture the static string preceeding the specifier, then the specifier is captured, then j   
+  // is set to the position just after the specifier to prepare for capturing the next sequence.
+  for(i = 0, j = 0; i < format_len; i++) {
+    if(format[i] == '%') {
+      switch(format[i+1]) {
+        case 'm':
+          CreateFormatParts(format, parsed_format, &len, i, j);
+          (*parsed_format)[len].type = CL_FORMAT_TYPE_MESSAGE;
+          (*parsed_format)[len].context = NULL;
+          len++;
+          // Set i to to be the specifier symbol (in this case the 'L') and set j to be the 
+          // character that follows it
+          i++;
+          j = i + 1;
           break;
         case 'l':
           CreateFormatParts(format, parsed_format, &len, i, j);
@@ -794,6 +6563,14 @@ static void ParseFormat(char *format, ClFormatPart **parsed_format,
           i++;
           j = i + 1;
           break;
+        case 'N':
+          CreateFormatParts(format, parsed_format, &len, i, j);
+          (*parsed_format)[len].type = CL_FORMAT_TYPE_THREAD_NAME;
+          (*parsed_format)[len].context = NULL;
+          len++;
+          i++;
+          j = i + 1;
+          break;
         case 'g':
           if(format[i+2] == '(') {
             old_i = i;
@@ -837,7 +6614,7 @@ static void ParseFormat(char *format, ClFormatPart **parsed_format,
         case '%':
           CreateFormatParts(format, parsed_format, &len, i, j);
           (*parsed_format)[len].type = CL_FORMAT_TYPE_STRING;
-          (*parsed_format)[len].context = malloc(2*sizeof(char));
+          (*parsed_format)[len].context = malloc(3*sizeof(char));
           strcpy((*parsed_format)[len].context, "%%");
           len++;
           i++;
@@ -852,11 +6629,426 @@ static void ParseFormat(char *format, ClFormatPart **parsed_format,
 
   // If there is a static string at the end of the format string, parse it
   CreateFormatParts(format, parsed_format, &len, i, j);
-  
+
+  // Move the parts into a single block along with an empty cache for each time part's rendered 
+  // output and the text of their contexts, so the parts aren't spread across the heap
+  for(i = 0; i < len; i++) {
+    if((*parsed_format)[i].type == CL_FORMAT_TYPE_TIME) {
+      caches++;
+    }
+    if((*parsed_format)[i].context != NULL) {
+      text_length += strlen((*parsed_format)[i].context)+1;
+    }
+  }
+  if(len > 0) {
+    packed = malloc(len*sizeof(ClFormatPart) + caches*sizeof(ClTimeCache) + text_length*sizeof(char));
+    if(packed == NULL) {
+      // Without the block, the format is left empty rather than half parsed
+      for(i = 0; i < len; i++) {
+        free((*parsed_format)[i].context);
+      }
+      free(*parsed_format);
+      *parsed_format = NULL;
+      *parsed_format_length = 0;
+      return;
+    }
+    cache = (ClTimeCache *)(packed+len);
+    text = (char *)(cache+caches);
+    for(i = 0; i < len; i++) {
+      packed[i].type = (*parsed_format)[i].type;
+      packed[i].context = NULL;
+      packed[i].time_cache = NULL;
+      if((*parsed_format)[i].context != NULL) {
+        packed[i].context = text;
+        strcpy(text, (*parsed_format)[i].context);
+        text += strlen(text)+1;
+        free((*parsed_format)[i].context);
+      }
+      if(packed[i].type == CL_FORMAT_TYPE_TIME) {
+        packed[i].time_cache = cache++;
+        memset(packed[i].time_cache, 0, sizeof(ClTimeCache));
+        packed[i].time_cache->time = (time_t)-1;
+      }
+    }
+    free(*parsed_format);
+    *parsed_format = packed;
+  }
+
   *parsed_format_length = len;
 }
 
 
+static void DeleteFormat(ClFormatPart *parsed_format, unsigned long parsed_format_length) {
+  // The contexts and time caches were packed into the same block as the parts by ParseFormat()
+  if(parsed_format == NULL || parsed_format_length == 0) {
+    return;
+  }
+  free(parsed_format);
+}
+
+
+static ClPlan *CompileFormat(ClFormatPart *parsed_format, unsigned long parsed_format_length) {
+  ClPlan *      plan;
+  ClStep *      step = NULL;
+  char *        text;
+  unsigned long i;
+  unsigned long length;
+  unsigned long steps = 0;
+  unsigned long text_length = 0;
+  unsigned long level_max = 0;
+  int           literal = 0;
+
+  // Size the block, one step per run of string and SGR parts and per part that prints something, 
+  // followed by the text of the runs and the levels
+  for(i = 0; i < parsed_format_length; i++) {
+    switch(parsed_format[i].type) {
+      case CL_FORMAT_TYPE_STRING:
+      case CL_FORMAT_TYPE_SGR_MODIFY:
+      case CL_FORMAT_TYPE_SGR_RESET:
+        if(parsed_format[i].context != NULL && strlen(parsed_format[i].context) > 0) {
+          text_length += strlen(parsed_format[i].context);
+          steps += !literal;
+          literal = 1;
+        }
+        break;
+      case CL_FORMAT_TYPE_MESSAGE:
+      case CL_FORMAT_TYPE_LEVEL:
+      case CL_FORMAT_TYPE_FILENAME:
+      case CL_FORMAT_TYPE_LINE_NUMBER:
+      case CL_FORMAT_TYPE_FUNCTION:
+      case CL_FORMAT_TYPE_TIME:
+      case CL_FORMAT_TYPE_DURATION:
+      case CL_FORMAT_TYPE_ROLLOVER:
+      case CL_FORMAT_TYPE_PROC_ID:
+      case CL_FORMAT_TYPE_PROC_NAME:
+      case CL_FORMAT_TYPE_PROC_EXEC:
+      case CL_FORMAT_TYPE_PROC_USER:
+      case CL_FORMAT_TYPE_THREAD_ID:
+      case CL_FORMAT_TYPE_PTHREAD_ID:
+      case CL_FORMAT_TYPE_THREAD_NAME:
+        steps++;
+        literal = 0;
+        break;
+      default:
+        // Nothing is printed for the part, so it doesn't separate the strings around it either
+        break;
+    }
+  }
+  for(i = 0; i <= CL_LOG_LEVEL_TRACE && levels != NULL; i++) {
+    text_length += strlen(levels[i].parsed_level);
+  }
+  plan = malloc(sizeof(ClPlan) + steps*sizeof(ClStep) + text_length*sizeof(char));
+  memset(plan, 0, sizeof(ClPlan));
+  plan->shareable = 1;
+  text = (char *)(plan->steps+steps);
+
+  // The levels are copied in as they're rendered, SGR modifiers and all
+  for(i = 0; i <= CL_LOG_LEVEL_TRACE; i++) {
+    plan->level_text[i] = text;
+    plan->level_length[i] = (levels != NULL) ? strlen(levels[i].parsed_level) : 0;
+    memcpy(text, (levels != NULL) ? levels[i].parsed_level : "", plan->level_length[i]);
+    text += plan->level_length[i];
+    if(plan->level_length[i] > level_max) {
+      level_max = plan->level_length[i];
+    }
+  }
+
+  // Fill in the steps, adding up how much each one can print. Numbers take at most 20 digits and 
+  // a sign, times are reserved as much as their cache holds and make room for more themselves
+  literal = 0;
+  plan->bound = 1;
+  for(i = 0; i < parsed_format_length; i++) {
+    switch(parsed_format[i].type) {
+      case CL_FORMAT_TYPE_STRING:
+      case CL_FORMAT_TYPE_SGR_MODIFY:
+      case CL_FORMAT_TYPE_SGR_RESET:
+        if(parsed_format[i].context == NULL || strlen(parsed_format[i].context) == 0) {
+          break;
+        }
+        if(!literal) {
+          step = &(plan->steps[plan->length++]);
+          step->type = CL_FORMAT_TYPE_STRING;
+          step->text = text;
+          step->length = 0;
+          step->part = NULL;
+          literal = 1;
+        }
+        length = strlen(parsed_format[i].context);
+        memcpy(text, parsed_format[i].context, length);
+        text += length;
+        step->length += length;
+        plan->bound += length;
+        break;
+      case CL_FORMAT_TYPE_MESSAGE:
+      case CL_FORMAT_TYPE_LEVEL:
+      case CL_FORMAT_TYPE_FILENAME:
+      case CL_FORMAT_TYPE_LINE_NUMBER:
+      case CL_FORMAT_TYPE_FUNCTION:
+      case CL_FORMAT_TYPE_TIME:
+      case CL_FORMAT_TYPE_DURATION:
+      case CL_FORMAT_TYPE_ROLLOVER:
+      case CL_FORMAT_TYPE_PROC_ID:
+      case CL_FORMAT_TYPE_PROC_NAME:
+      case CL_FORMAT_TYPE_PROC_EXEC:
+      case CL_FORMAT_TYPE_PROC_USER:
+      case CL_FORMAT_TYPE_THREAD_ID:
+      case CL_FORMAT_TYPE_PTHREAD_ID:
+      case CL_FORMAT_TYPE_THREAD_NAME:
+        step = &(plan->steps[plan->length++]);
+        step->type = parsed_format[i].type;
+        step->text = NULL;
+        step->length = 0;
+        step->part = &(parsed_format[i]);
+        literal = 0;
+        if(step->type == CL_FORMAT_TYPE_MESSAGE) {
+          plan->messages++;
+        }
+        else if(step->type == CL_FORMAT_TYPE_LEVEL) {
+          plan->bound += level_max;
+        }
+        else if(step->type == CL_FORMAT_TYPE_FILENAME) {
+          plan->filenames++;
+        }
+        else if(step->type == CL_FORMAT_TYPE_FUNCTION) {
+          plan->functions++;
+        }
+        else if(step->type == CL_FORMAT_TYPE_TIME) {
+          plan->bound += CL_TIME_CACHE_LENGTH;
+        }
+        else if(step->type == CL_FORMAT_TYPE_PROC_NAME || step->type == CL_FORMAT_TYPE_PROC_EXEC || 
+                step->type == CL_FORMAT_TYPE_PROC_USER) {
+          plan->processes++;
+        }
+        else if(step->type == CL_FORMAT_TYPE_THREAD_NAME) {
+          plan->bound += CL_THREAD_NAME_LENGTH;
+          plan->thread_names = 1;
+        }
+        else if(step->type == CL_FORMAT_TYPE_DURATION) {
+          plan->bound += 24;
+          plan->durations = 1;
+        }
+        else {
+          plan->bound += 24;
+        }
+
+        // The rollover count belongs to the handler, so the output can't be reused by other handlers
+        if(step->type == CL_FORMAT_TYPE_ROLLOVER) {
+          plan->shareable = 0;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  plan->json = CompileJson(parsed_format, parsed_format_length);
+  return plan;
+}
+
+
+static ClPlan *CompileJson(ClFormatPart *parsed_format, unsigned long parsed_format_length) {
+  static const char *keys[CL_FORMAT_TYPE_THREAD_NAME+1] = {
+    [CL_FORMAT_TYPE_MESSAGE] = "message",
+    [CL_FORMAT_TYPE_LEVEL] = "level",
+    [CL_FORMAT_TYPE_FILENAME] = "file",
+    [CL_FORMAT_TYPE_LINE_NUMBER] = "line",
+    [CL_FORMAT_TYPE_FUNCTION] = "function",
+    [CL_FORMAT_TYPE_TIME] = "time",
+    [CL_FORMAT_TYPE_DURATION] = "duration",
+    [CL_FORMAT_TYPE_ROLLOVER] = "rollover",
+    [CL_FORMAT_TYPE_PROC_ID] = "pid",
+    [CL_FORMAT_TYPE_PROC_NAME] = "process",
+    [CL_FORMAT_TYPE_PROC_EXEC] = "executable",
+    [CL_FORMAT_TYPE_PROC_USER] = "user",
+    [CL_FORMAT_TYPE_THREAD_ID] = "thread_id",
+    [CL_FORMAT_TYPE_PTHREAD_ID] = "pthread_id",
+    [CL_FORMAT_TYPE_THREAD_NAME] = "thread_name"
+  };
+  ClPlan *      plan;
+  ClStep *      step;
+  ClFormatType  type;
+  char *        text;
+  unsigned long i;
+  unsigned long j;
+  unsigned long length;
+  unsigned long text_length = 3;
+  unsigned long level_max = 0;
+  unsigned long seen = 0;
+  unsigned long between = 0;
+  int           in_time = 0;
+  int           quoted;
+
+  // Size the block generously, with every part becoming at most two steps (a field along with the 
+  // text in front of it), every string escaped as much as it could be, and room for each key
+  for(i = 0; i < parsed_format_length; i++) {
+    if(parsed_format[i].context != NULL) {
+      text_length += CL_JSON_EXPANSION*strlen(parsed_format[i].context);
+    }
+    text_length += 24;
+  }
+  for(i = 0; i <= CL_LOG_LEVEL_TRACE && levels != NULL; i++) {
+    text_length += CL_JSON_EXPANSION*strlen(levels[i].level_string);
+  }
+  plan = malloc(sizeof(ClPlan) + (2*parsed_format_length+1)*sizeof(ClStep) + 
+                text_length*sizeof(char));
+  memset(plan, 0, sizeof(ClPlan));
+  plan->shareable = 1;
+  plan->escaped = 1;
+  text = (char *)(plan->steps+2*parsed_format_length+1);
+
+  // Levels are written by name, without their SGR modifiers or the padding that lines them up
+  for(i = 0; i <= CL_LOG_LEVEL_TRACE; i++) {
+    plan->level_text[i] = text;
+    length = (levels != NULL) ? strlen(levels[i].level_string) : 0;
+    while(length > 0 && levels[i].level_string[length-1] == ' ') {
+      length--;
+    }
+    text = EscapeJson(text, (levels != NULL) ? levels[i].level_string : "", length);
+    plan->level_length[i] = (unsigned long)(text-plan->level_text[i]);
+    if(plan->level_length[i] > level_max) {
+      level_max = plan->level_length[i];
+    }
+  }
+
+  // Each field becomes a member named after it, the first time it shows up. A run of time parts 
+  // makes up a single member, along with the strings between them (so a date and a time of day 
+  // read as one timestamp), while any other string or SGR part is dropped
+  plan->bound = 1;
+  for(i = 0; i < parsed_format_length; i++) {
+    type = parsed_format[i].type;
+    switch(type) {
+      case CL_FORMAT_TYPE_MESSAGE:
+      case CL_FORMAT_TYPE_LEVEL:
+      case CL_FORMAT_TYPE_FILENAME:
+      case CL_FORMAT_TYPE_LINE_NUMBER:
+      case CL_FORMAT_TYPE_FUNCTION:
+      case CL_FORMAT_TYPE_TIME:
+      case CL_FORMAT_TYPE_DURATION:
+      case CL_FORMAT_TYPE_ROLLOVER:
+      case CL_FORMAT_TYPE_PROC_ID:
+      case CL_FORMAT_TYPE_PROC_NAME:
+      case CL_FORMAT_TYPE_PROC_EXEC:
+      case CL_FORMAT_TYPE_PROC_USER:
+      case CL_FORMAT_TYPE_THREAD_ID:
+      case CL_FORMAT_TYPE_PTHREAD_ID:
+      case CL_FORMAT_TYPE_THREAD_NAME:
+        if(type == CL_FORMAT_TYPE_TIME && in_time) {
+          for(j = between; j < i; j++) {
+            if(parsed_format[j].type == CL_FORMAT_TYPE_STRING && parsed_format[j].context != NULL) {
+              JsonText(plan, &text, parsed_format[j].context, strlen(parsed_format[j].context), 1);
+            }
+          }
+        }
+        else {
+          if(in_time) {
+            JsonText(plan, &text, "\"", 1, 0);
+            in_time = 0;
+          }
+          if(seen & (1ul << type)) {
+            break;
+          }
+          quoted = (type != CL_FORMAT_TYPE_LINE_NUMBER && type != CL_FORMAT_TYPE_DURATION && 
+                    type != CL_FORMAT_TYPE_ROLLOVER && type != CL_FORMAT_TYPE_PROC_ID && 
+                    type != CL_FORMAT_TYPE_THREAD_ID && type != CL_FORMAT_TYPE_PTHREAD_ID);
+          JsonText(plan, &text, (seen == 0) ? "{\"" : ",\"", 2, 0);
+          JsonText(plan, &text, keys[type], strlen(keys[type]), 0);
+          JsonText(plan, &text, quoted ? "\":\"" : "\":", quoted ? 3 : 2, 0);
+          seen |= 1ul << type;
+        }
+
+        step = &(plan->steps[plan->length++]);
+        step->type = type;
+        step->text = NULL;
+        step->length = 0;
+        step->part = &(parsed_format[i]);
+        if(type == CL_FORMAT_TYPE_MESSAGE) {
+          plan->messages++;
+        }
+        else if(type == CL_FORMAT_TYPE_LEVEL) {
+          plan->bound += level_max;
+        }
+        else if(type == CL_FORMAT_TYPE_FILENAME) {
+          plan->filenames++;
+        }
+        else if(type == CL_FORMAT_TYPE_FUNCTION) {
+          plan->functions++;
+        }
+        else if(type == CL_FORMAT_TYPE_TIME) {
+          plan->bound += CL_JSON_EXPANSION*CL_TIME_CACHE_LENGTH;
+        }
+        else if(type == CL_FORMAT_TYPE_PROC_NAME || type == CL_FORMAT_TYPE_PROC_EXEC || 
+                type == CL_FORMAT_TYPE_PROC_USER) {
+          plan->processes++;
+        }
+        else if(type == CL_FORMAT_TYPE_THREAD_NAME) {
+          plan->bound += CL_JSON_EXPANSION*CL_THREAD_NAME_LENGTH;
+          plan->thread_names = 1;
+        }
+        else if(type == CL_FORMAT_TYPE_DURATION) {
+          plan->bound += 24;
+          plan->durations = 1;
+        }
+        else {
+          plan->bound += 24;
+        }
+        if(type == CL_FORMAT_TYPE_ROLLOVER) {
+          plan->shareable = 0;
+        }
+
+        // The time is closed once something other than another time part follows it
+        if(type == CL_FORMAT_TYPE_TIME) {
+          in_time = 1;
+          between = i+1;
+        }
+        else if(quoted) {
+          JsonText(plan, &text, "\"", 1, 0);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  if(in_time) {
+    JsonText(plan, &text, "\"", 1, 0);
+  }
+  JsonText(plan, &text, (seen == 0) ? "{}" : "}", (seen == 0) ? 2 : 1, 0);
+  return plan;
+}
+
+
+static void JsonText(ClPlan *plan, char **text, const char *data, unsigned long length, int escape) {
+  ClStep *step;
+  char *  end;
+
+  // Text is always appended to the end of the block, so it extends the last step when that's text
+  if(plan->length == 0 || plan->steps[plan->length-1].type != CL_FORMAT_TYPE_STRING) {
+    step = &(plan->steps[plan->length++]);
+    step->type = CL_FORMAT_TYPE_STRING;
+    step->text = *text;
+    step->length = 0;
+    step->part = NULL;
+  }
+  step = &(plan->steps[plan->length-1]);
+  if(escape) {
+    end = EscapeJson(*text, data, length);
+  }
+  else {
+    memcpy(*text, data, length);
+    end = *text+length;
+  }
+  step->length += (unsigned long)(end-*text);
+  plan->bound += (unsigned long)(end-*text);
+  *text = end;
+}
+
+
+static void DeletePlan(ClPlan *plan) {
+  if(plan != NULL) {
+    free(plan->json);
+    free(plan);
+  }
+}
+
+
 static void CreateFormatParts(char *format, ClFormatPart **parsed_format, unsigned long *len, 
                               unsigned long i, unsigned long j) {
   // If i and j aren't the same, there are one or more characters that make up a static string
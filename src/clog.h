@@ -26,17 +26,38 @@
 #define CLOG_H
 
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <math.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <wchar.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
 #include <unistd.h>
+#include <pwd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 #include <uuid/uuid.h>
+#include <zlib.h>
 #include <time.h>
 #include <pthread.h> 
+#include <sched.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
 
 /*
   ===============================================================================================
@@ -71,6 +92,17 @@
 
 #define CL_MIN_STREAM_LENGTH 1024
 
+// The number of message bytes (including the terminating null byte) stored per record in 
+// asynchronous mode. Records are stored as their raw arguments where possible and formatted by the 
+// writer thread, otherwise longer messages are truncated
+#ifndef CL_ASYNC_MESSAGE_LENGTH
+#define CL_ASYNC_MESSAGE_LENGTH 512
+#endif
+
+// The number of bytes (including the terminating null byte) kept of a thread's name, the same limit 
+// Linux puts on them
+#define CL_THREAD_NAME_LENGTH 16
+
 /*
   ==========================================================================================
   CLOG API: ENUMERATIONS
@@ -100,12 +132,18 @@ typedef enum cl_log_level_e {
   NOTES:
   - When a handler's stream_type field is set to CL_STREAM_DISK, its name field must also be set 
   to either an existing filename or a new filename.
+  - CL_STREAM_MMAP is a file that's preallocated stream_max_length bytes at a time and mapped into 
+  memory, so records are copied into the page cache without a system call and survive the process 
+  crashing. The file rolls over once the next record doesn't fit, and is trimmed to the bytes 
+  actually written when it's closed (after a crash, the unused tail is left as null bytes, which is 
+  skipped over when the file is opened again). Records longer than stream_max_length are truncated.
  */
 typedef enum cl_stream_e {
   CL_STREAM_CONSOLE = 0,
   CL_STREAM_FILE    = 1,
   CL_STREAM_PIPE    = 2,
-  CL_STREAM_STRING  = 3
+  CL_STREAM_STRING  = 3,
+  CL_STREAM_MMAP    = 4
 } ClStream;
 
 /*
@@ -126,6 +164,155 @@ typedef enum cl_sgr_e {
   CL_SGR_ON  = 1
 } ClSgr;
 
+/*
+  DESCRIPTION:
+  Enumeration describing what happens to a message logged in asynchronous mode when the ring buffer 
+  is full.
+  
+  VALUES:
+  - CL_ASYNC_POLICY_BLOCK: The logging thread waits until the writer thread frees up a slot.
+  - CL_ASYNC_POLICY_DROP_NEWEST: The message being logged is discarded.
+  - CL_ASYNC_POLICY_DROP_OLDEST: The oldest message still waiting in the ring buffer is discarded to 
+  make room for the message being logged.
+ */
+typedef enum cl_async_policy_e {
+  CL_ASYNC_POLICY_BLOCK       = 0,
+  CL_ASYNC_POLICY_DROP_NEWEST = 1,
+  CL_ASYNC_POLICY_DROP_OLDEST = 2
+} ClAsyncPolicy;
+
+/*
+  DESCRIPTION:
+  Enumeration describing how a handler writes records to its stream.
+  
+  VALUES:
+  - CL_ENCODING_TEXT: Each record is rendered as a line of text according to the handler's format.
+  - CL_ENCODING_BINARY: Each record is written as a compact binary entry holding a call site ID, a 
+  timestamp, and the raw bytes of the message's arguments. Each call site's filename, function, line 
+  number, and message format string is written once per file, along with the handler's format, so 
+  the text can be rebuilt later with ClDecode() (or the clog-decode tool). Only supported for 
+  handlers with a stream_type of CL_STREAM_FILE.
+  - CL_ENCODING_JSON: Each record is written as a JSON object on a line of its own (JSON Lines). The 
+  object has a member for each field the handler's format prints (time, level, file, line, function, 
+  thread_id, pthread_id, message, rollover), in the order they appear in it. Strings and SGR 
+  parts of the format are left out, except for strings between consecutive time parts, which are 
+  kept as part of the time.
+ */
+typedef enum cl_encoding_e {
+  CL_ENCODING_TEXT   = 0,
+  CL_ENCODING_BINARY = 1,
+  CL_ENCODING_JSON   = 2
+} ClEncoding;
+
+/*
+  DESCRIPTION:
+  Enumeration describing how a handler's files are compressed once they've been rolled over.
+  
+  VALUES:
+  - CL_COMPRESSION_NONE: Rolled-over files are left as they are.
+  - CL_COMPRESSION_GZIP: Rolled-over files are compressed with gzip by a low priority background 
+  thread, then renamed to <filename>.<n>.gz, so logging to the new file never waits on it.
+ */
+typedef enum cl_compression_e {
+  CL_COMPRESSION_NONE = 0,
+  CL_COMPRESSION_GZIP = 1
+} ClCompression;
+
+/*
+  DESCRIPTION:
+  Enumeration describing when a handler's file is rolled over based on time, in addition to it 
+  reaching stream_max_length bytes.
+  
+  VALUES:
+  - CL_ROLLOVER_NONE: The file is only rolled over based on its size.
+  - CL_ROLLOVER_HOURLY: The file is also rolled over at the start of every local hour.
+  - CL_ROLLOVER_DAILY: The file is also rolled over at local midnight.
+  
+  NOTES:
+  - With a time-based rollover, rolled-over files are named after the interval they were written 
+  in, <filename>.<YYYYMMDDHH>.<n> or <filename>.<YYYYMMDD>.<n>, where n keeps counting up across 
+  intervals.
+ */
+typedef enum cl_rollover_interval_e {
+  CL_ROLLOVER_NONE   = 0,
+  CL_ROLLOVER_HOURLY = 1,
+  CL_ROLLOVER_DAILY  = 2
+} ClRolloverInterval;
+
+/*
+  DESCRIPTION:
+  Enumeration describing when the records a handler has buffered are written out to its stream.
+  
+  VALUES:
+  - CL_FLUSH_RECORD: Every record is written as soon as it's logged (the default).
+  - CL_FLUSH_RECORDS: Records are written once flush_value of them are buffered.
+  - CL_FLUSH_BYTES: Records are written once flush_value bytes of them are buffered.
+  - CL_FLUSH_TIME: Records are written every flush_value milliseconds by a background thread.
+  
+  NOTES:
+  - Whatever the policy, a record at or above the handler's flush_level severity is written right 
+  away along with everything buffered before it, and so is a record that doesn't fit in the buffer.
+  - Anything other than CL_FLUSH_RECORD trades losing the buffered records if the process dies for 
+  far fewer write() calls.
+ */
+typedef enum cl_flush_policy_e {
+  CL_FLUSH_RECORD  = 0,
+  CL_FLUSH_RECORDS = 1,
+  CL_FLUSH_BYTES   = 2,
+  CL_FLUSH_TIME    = 3
+} ClFlushPolicy;
+
+/*
+  DESCRIPTION:
+  Enumeration describing how a CL_STREAM_FILE handler hands its records to the kernel.
+  
+  VALUES:
+  - CL_IO_WRITE: Records are written with blocking write() calls (the default).
+  - CL_IO_URING: Buffered records are submitted through an io_uring, and the logging thread only 
+  waits for a write to complete when all of the handler's buffers are still in flight.
+  - CL_IO_DIRECT: Buffered records are written with O_DIRECT from block-aligned buffers, bypassing 
+  the page cache, into space reserved with fallocate() up to stream_max_length.
+  
+  NOTES:
+  - With CL_IO_URING, records are still buffered according to the handler's flush policy, with 
+  CL_FLUSH_RECORD each record is submitted on its own, which costs more than a write() does. It pays 
+  off with a policy that batches records.
+  - With CL_IO_DIRECT, only whole blocks can be written, so until the file is rolled over or the 
+  handler is deleted, its last block is padded with zeros (which readers of the live file see). 
+  Every flush rewrites that block, so it's best paired with a policy that batches records too.
+ */
+typedef enum cl_io_e {
+  CL_IO_WRITE  = 0,
+  CL_IO_URING  = 1,
+  CL_IO_DIRECT = 2
+} ClIo;
+
+/*
+  DESCRIPTION:
+  Enumeration describing the clock records are timestamped with.
+  
+  VALUES:
+  - CL_CLOCK_REALTIME: CLOCK_REALTIME, with nanosecond resolution (the default).
+  - CL_CLOCK_COARSE: CLOCK_REALTIME_COARSE, which is cheaper to read but only advances once per 
+  kernel tick (typically every 1 to 4 milliseconds).
+  - CL_CLOCK_TSC: The CPU's timestamp counter, which the logging thread reads with a single 
+  instruction. The ticks are converted to the time when the record is written (by the writer 
+  thread in asynchronous mode), from a calibration against CLOCK_REALTIME and CLOCK_MONOTONIC that 
+  the background thread refreshes every second. Only available on x86-64 CPUs whose TSC is 
+  invariant, i.e. keeps a constant rate through frequency changes and sleep states.
+  
+  NOTES:
+  - The first two clocks are read through the vDSO, so taking a timestamp doesn't enter the kernel. 
+  The %d duration is measured with the matching monotonic clock.
+  - Between calibrations, CL_CLOCK_TSC timestamps don't follow adjustments to the system clock, 
+  and each calibration can move them by as much as the TSC and the system clock drifted apart.
+ */
+typedef enum cl_clock_source_e {
+  CL_CLOCK_REALTIME = 0,
+  CL_CLOCK_COARSE   = 1,
+  CL_CLOCK_TSC      = 2
+} ClClockSource;
+
 typedef enum cl_format_type_e {
   CL_FORMAT_TYPE_STRING      = 0,
   CL_FORMAT_TYPE_MESSAGE     = 1,
@@ -145,7 +332,8 @@ typedef enum cl_format_type_e {
   CL_FORMAT_TYPE_THREAD_ID   = 15,
   CL_FORMAT_TYPE_PTHREAD_ID  = 16,
   CL_FORMAT_TYPE_SGR_MODIFY  = 17,
-  CL_FORMAT_TYPE_SGR_RESET   = 18
+  CL_FORMAT_TYPE_SGR_RESET   = 18,
+  CL_FORMAT_TYPE_THREAD_NAME = 19
 } ClFormatType;
 
 typedef enum cl_sgr_type_e {
@@ -197,9 +385,19 @@ typedef struct cl_level_s {
   char *     parsed_level;
 } ClLevel;
 
+/*
+  DESCRIPTION:
+  Struct describing a single piece of a parsed format string.
+
+  FIELDS:
+  - type: What the part prints.
+  - context: The static string printed by string and SGR parts, or the strftime() format of time parts.
+  - time_cache: Internal cache of the most recently printed second for time parts, NULL otherwise.
+ */
 typedef struct cl_format_part_s {
-  ClFormatType  type;
-  char *       context;
+  ClFormatType             type;
+  char *                   context;
+  struct cl_time_cache_s * time_cache;
 } ClFormatPart;
 
 /*
@@ -229,46 +427,235 @@ typedef struct cl_format_part_s {
   per Clog's format string specification.
   - parsed_format: The parsed version of the format field which is used internally.
   - parsed_format_length: The length of the parsed_format array field.
+  - plan: Internal compiled form of parsed_format that records are rendered with, shared along with 
+  it.
   - min_level: The most critical (numerically smallest) severity level the handler will log.
   - max_level: The least critical (numerically largest) severity level the handler will log.
-  - rollover_count: the current number of times the log has rolled over its maximum length.
+  - rollover_count: the current number of times the log has rolled over its maximum length, which 
+  is also the index the file is given the next time it rolls over (<filename>.<rollover_count>). 
+  When the handler is created, it starts past the highest index already in use.
+  - rollover_max: The maximum number of rolled-over files kept, after which the oldest ones are 
+  deleted in the background. 0 keeps all of them.
   - sgr_output: Enables or disables SGR text modifiers in the output.
+  - encoding: Whether records are written as text, as binary entries, or as JSON objects.
+  - binary_sites: Internal bitmap of the call sites already described in the current file when the 
+  encoding field is set to CL_ENCODING_BINARY (bit 0 tracks the file header), NULL otherwise.
+  - map: Internal mapping of the current file segment when the stream_type field is set to 
+  CL_STREAM_MMAP, NULL otherwise.
+  - map_cursor: Internal reservation counter for the mapping, holding the segment's generation in 
+  its upper 16 bits and the offset of the next record in the rest.
+  - map_committed: Internal count of the bytes that have been copied into the current segment.
+  - ring: The memory holding the most recent records when the stream_type field is set to 
+  CL_STREAM_STRING, NULL otherwise.
+  - ring_head: The total number of bytes ever written to the ring, the next record is written at 
+  this position modulo stream_max_length.
+  - ring_dump: The handler the ring is written out to when a CL_LOG_LEVEL_FATAL record is logged, 
+  see ClSetHandlerDump().
+  - spill: The records held back while the pipe is full when the stream_type field is set to 
+  CL_STREAM_PIPE, NULL otherwise.
+  - dropped_records: The number of records that were dropped because the pipe was full (and spill 
+  had no room left) or had no reader, or that were cut short to PIPE_BUF bytes.
+  - dropped_bytes: The number of bytes dropped along with them, or cut off them.
+  - lock: Internal lock serializing writes to the handler's stream (and spill, for CL_STREAM_PIPE). 
+  Each handler has its own, so threads writing to different handlers never wait on each other. 
+  CL_STREAM_MMAP and CL_STREAM_STRING handlers don't need it, records reserve their space atomically.
+  - rolled: Internal list of the paths of the rolled-over files still kept, oldest first.
+  - rolled_length: The length of the rolled array field.
+  - rolled_bytes: The number of bytes the rolled-over files still kept take up on disk, as they 
+  are compressed.
+  - compression: How rolled-over files are compressed.
+  - rollover_interval: When the file is rolled over based on time, see ClSetHandlerRollover().
+  - rollover_start: The start of the interval the current file is being written in.
+  - rollover_boundary: The time at which the current file is next rolled over (the end of the 
+  interval), precomputed so that each record only has to compare its time against it.
+  - flush_policy: When buffered records are written out, see ClSetHandlerFlush().
+  - flush_value: The number of records, bytes or milliseconds the flush_policy field refers to.
+  - flush_level: The least critical (numerically largest) severity level that's written right away.
+  - flush_buffer: The records waiting to be written out when the flush_policy field isn't set to 
+  CL_FLUSH_RECORD, NULL otherwise.
+  - flush_length: The number of bytes in flush_buffer.
+  - flush_capacity: The size of flush_buffer.
+  - flush_records: The number of records in flush_buffer.
+  - flush_deadline: Internal time at which the background thread next flushes the handler when the 
+  flush_policy field is set to CL_FLUSH_TIME, in milliseconds of CLOCK_MONOTONIC.
+  - io: How the handler hands records to the kernel, see ClSetHandlerIo().
+  - uring: Internal io_uring the handler submits its writes through when the io field is set to 
+  CL_IO_URING, NULL otherwise. flush_buffer then points into one of its buffers.
+  - direct: Internal O_DIRECT descriptor and staging buffer the handler writes through when the io 
+  field is set to CL_IO_DIRECT, NULL otherwise. flush_buffer then points into the staging buffer.
   
   NOTES: 
   - By default, the library allocates two handlers automatically when ClInit() is called. These are 
   meant to provide sensible defaults for the user to get started with, and can be modified or deleted
   just like any other handler.
   - The name and rollover_count fields are only used when the stream_type field is set to 
-  CL_STREAM_FILE.
+  CL_STREAM_FILE or CL_STREAM_MMAP.
   - The stream_length and stream_max_length fields are only used when the stream_type field is set 
-  to CL_STREAM_FILE or CL_STREAM_STRING.
+  to CL_STREAM_FILE, CL_STREAM_MMAP, or CL_STREAM_STRING. For CL_STREAM_MMAP, stream_length is only 
+  updated when a segment is closed, map_cursor tracks it in between. For CL_STREAM_STRING, 
+  stream_max_length is the size of the ring (rounded up to a power of two), and ring_head is used in 
+  place of stream_length.
+  - For CL_STREAM_PIPE, the write end is switched to non-blocking mode, and each record is written 
+  with a single write() of at most PIPE_BUF bytes (longer records are truncated) so it's atomic. 
+  While the pipe is full, up to stream_max_length bytes of records are held back in spill 
+  (stream_length of them are in use), and written out coalesced in as few writes as possible once 
+  the reader catches up, records that don't fit are dropped. The application should ignore SIGPIPE 
+  if the reader can go away.
   - The min_level and max_level fields can define a range, or be the same for a single level, however 
   if their values are invalid (i.e. min_level is greater than max_level, etc.), the handler will 
   disable itself, as if the logging field was set to CL_LOGGING_OFF.
+  - Handlers can be created, deleted and reconfigured with the ClSetHandler*() functions while other 
+  threads are logging, without them taking a lock. A record keeps being written with the handlers and 
+  configuration it started with, and ClDeleteHandler() waits for the records still writing to the 
+  handler before freeing it. The logging, format, min_level, max_level and encoding fields shouldn't 
+  be written to directly, since logging calls wouldn't see the change.
+  - Handlers are allocated aligned to a cache line, along with the name, extension and filename 
+  strings. The fields every record reads come first, followed by the ones written while the lock 
+  is held and the counters written atomically, with the fields only used when configuring or 
+  rolling over the handler last.
   - The sgr_output field is set to CL_SGR_OFF for all streams that aren't of type CL_STREAM_CONSOLE 
   by default. It can however be turned back on for non-console streams, which would cause the SGR 
   text modifiers to be printed in their raw, non-escaped format.
  */
 typedef struct cl_handler_s {
-  uuid_t        id;
+  ClStream      stream_type;
   ClLogging     logging;
-  int           fd;
+  ClLogLevel    min_level;
+  ClLogLevel    max_level;
   FILE *        fp;
-  ClStream      stream_type;
-  unsigned long stream_length;
+  int           fd;
+  ClEncoding    encoding;
   unsigned long stream_max_length;
+  struct cl_plan_s *plan;
+  time_t        rollover_boundary;
+  char *        map;
+  char *        ring;
+  char *        spill;
+  unsigned long *binary_sites;
+  struct cl_uring_s *uring;
+  struct cl_direct_s *direct;
+  unsigned long flush_value;
+  ClFlushPolicy flush_policy;
+  ClLogLevel    flush_level;
+  ClIo          io;
+  ClSgr         sgr_output;
+  pthread_mutex_t lock;
+  unsigned long stream_length;
+  char *        flush_buffer;
+  unsigned long flush_length;
+  unsigned long flush_capacity;
+  unsigned long flush_records;
+  uint64_t      map_cursor;
+  unsigned long map_committed;
+  uint64_t      ring_head;
+  unsigned long dropped_records;
+  unsigned long dropped_bytes;
+  unsigned long rolled_bytes;
+  uuid_t        id;
   char *        name;
   char *        extension;
   char *        filename;
-  unsigned long rollover_count;
-  unsigned long rollover_max;
-  ClSgr         sgr_output;
   char *        format;
   ClFormatPart *parsed_format;
   unsigned long parsed_format_length;
-  ClLogLevel    min_level;
-  ClLogLevel    max_level;
-} ClHandler;
+  unsigned long rollover_count;
+  unsigned long rollover_max;
+  struct cl_handler_s *ring_dump;
+  char **       rolled;
+  unsigned long rolled_length;
+  ClCompression compression;
+  ClRolloverInterval rollover_interval;
+  time_t        rollover_start;
+  uint64_t      flush_deadline;
+} __attribute__((aligned(64))) ClHandler;
+
+/*
+  DESCRIPTION:
+  Struct describing the contents of a CL_STREAM_STRING handler's ring, oldest record first, as up to 
+  two spans of memory within the ring itself (the second one is only set once the ring has wrapped 
+  around).
+
+  FIELDS:
+  - first: The start of the oldest records.
+  - first_length: The number of bytes in the first span.
+  - second: The start of the newest records, or NULL.
+  - second_length: The number of bytes in the second span.
+
+  NOTES:
+  - Nothing is copied, so records logged to the handler while the spans are being read can 
+  overwrite them. Disable the handler's logging first if the snapshot has to be consistent.
+ */
+typedef struct cl_snapshot_s {
+  const char *  first;
+  unsigned long first_length;
+  const char *  second;
+  unsigned long second_length;
+} ClSnapshot;
+
+/*
+  DESCRIPTION:
+  Struct containing counters describing the state of asynchronous mode since it was last started.
+
+  FIELDS:
+  - enqueued: The number of messages handed off to the writer thread.
+  - dropped_newest: The number of messages discarded under CL_ASYNC_POLICY_DROP_NEWEST.
+  - dropped_oldest: The number of messages discarded under CL_ASYNC_POLICY_DROP_OLDEST.
+  - blocked: The number of logging calls that had to wait under CL_ASYNC_POLICY_BLOCK.
+ */
+typedef struct cl_async_stats_s {
+  unsigned long enqueued;
+  unsigned long dropped_newest;
+  unsigned long dropped_oldest;
+  unsigned long blocked;
+} ClAsyncStats;
+
+/*
+  DESCRIPTION:
+  Enumeration of the types of values a structured field can hold.
+
+  VALUES:
+  - CL_FIELD_INT: A signed integer, written in decimal.
+  - CL_FIELD_UINT: An unsigned integer, written in decimal.
+  - CL_FIELD_DOUBLE: A floating point number, written with enough digits to read back the same 
+  value. JSON handlers write infinities and NaNs as null.
+  - CL_FIELD_STRING: A NUL-terminated string, or NULL. Text handlers quote it when it's empty or 
+  holds a space, an equals sign, a quote, a backslash or a control byte.
+  - CL_FIELD_BOOL: true or false.
+ */
+typedef enum cl_field_type_e {
+  CL_FIELD_INT    = 0,
+  CL_FIELD_UINT   = 1,
+  CL_FIELD_DOUBLE = 2,
+  CL_FIELD_STRING = 3,
+  CL_FIELD_BOOL   = 4
+} ClFieldType;
+
+/*
+  DESCRIPTION:
+  Struct describing a single key and typed value passed to the LOG_*_KV() macros. Build them with 
+  the CL_INT(), CL_UINT(), CL_DOUBLE(), CL_STR() and CL_BOOL() macros rather than by hand.
+
+  FIELDS:
+  - key: The name of the field, which should be a valid identifier for the output to be parseable.
+  - type: Which member of value is set.
+  - value: The value, stored according to type.
+ */
+typedef struct cl_field_s {
+  const char * key;
+  ClFieldType  type;
+  union {
+    long long          i;
+    unsigned long long u;
+    double             d;
+    const char *       s;
+  } value;
+} ClField;
+
+#define CL_INT(key, value)    ((ClField){(key), CL_FIELD_INT,    {.i = (long long)(value)}})
+#define CL_UINT(key, value)   ((ClField){(key), CL_FIELD_UINT,   {.u = (unsigned long long)(value)}})
+#define CL_DOUBLE(key, value) ((ClField){(key), CL_FIELD_DOUBLE, {.d = (double)(value)}})
+#define CL_STR(key, value)    ((ClField){(key), CL_FIELD_STRING, {.s = (value)}})
+#define CL_BOOL(key, value)   ((ClField){(key), CL_FIELD_BOOL,   {.u = (value) ? 1 : 0}})
 
 /*
   ===============================================================================================
@@ -278,6 +665,47 @@ typedef struct cl_handler_s {
   ===============================================================================================
  */
 
+/*
+  DESCRIPTION:
+  The least severe level that the logging macros below are compiled in for. Any call for a less 
+  severe (numerically larger) level compiles to nothing, and its arguments are never evaluated.
+  
+  NOTES:
+  - Define it before including this header or on the command line, using either a ClLogLevel value 
+  or its integer equivalent (e.g. -DCLOG_MIN_LEVEL=CL_LOG_LEVEL_INFO strips every LOG_DEBUG() and 
+  LOG_TRACE() call from a release build).
+  - Defaults to CL_LOG_LEVEL_TRACE, which compiles in every call.
+ */
+#ifndef CLOG_MIN_LEVEL
+#define CLOG_MIN_LEVEL CL_LOG_LEVEL_TRACE
+#endif
+
+/*
+  [INTERNAL]
+  DESCRIPTION:
+  Bitmask of the severity levels accepted by at least one handler with logging turned on, where bit 
+  n corresponds to the level with the numeric value n. It's kept up to date by the functions that 
+  create, delete, and configure handlers, and should only be read through ClIsEnabled().
+ */
+extern unsigned int cl_level_mask;
+
+/*
+  DESCRIPTION:
+  Function that checks whether any handler would record a message of the given severity level. Use 
+  it to guard expensive work that only exists to produce a log message.
+
+  PARAMETERS:
+  - level:
+    - TYPE: ClLogLevel
+    - DESCRIPTION: The severity level to check.
+
+  RETURNS:
+  1 if at least one handler accepts the level, 0 otherwise.
+ */
+static inline int ClIsEnabled(ClLogLevel level) {
+  return (int)((__atomic_load_n(&cl_level_mask, __ATOMIC_RELAXED) >> level) & 1);
+}
+
 /*
   DESCRIPTION:
   Macro functions corresponding to each of the different logging severity levels.
@@ -296,13 +724,15 @@ typedef struct cl_handler_s {
   parameter.
   - Just like functions such as printf(), fprintf(), etc, if your optional arguments don't match your 
   format specifiers, or vice versa, the behavior is undefined and can result in garbage output.
+  - Calls for levels less severe than CLOG_MIN_LEVEL are compiled out, so don't rely on side effects 
+  in their arguments.
  */
-#define LOG_FATAL(...) ClLog(CL_LOG_LEVEL_FATAL, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
-#define LOG_ERROR(...) ClLog(CL_LOG_LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
-#define LOG_WARN(...)  ClLog(CL_LOG_LEVEL_WARN,  __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
-#define LOG_INFO(...)  ClLog(CL_LOG_LEVEL_INFO,  __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
-#define LOG_DEBUG(...) ClLog(CL_LOG_LEVEL_DEBUG, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
-#define LOG_TRACE(...) ClLog(CL_LOG_LEVEL_TRACE, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOG_FATAL(...) CL_LOG_AT(CL_LOG_LEVEL_FATAL, __VA_ARGS__)
+#define LOG_ERROR(...) CL_LOG_AT(CL_LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  CL_LOG_AT(CL_LOG_LEVEL_WARN,  __VA_ARGS__)
+#define LOG_INFO(...)  CL_LOG_AT(CL_LOG_LEVEL_INFO,  __VA_ARGS__)
+#define LOG_DEBUG(...) CL_LOG_AT(CL_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) CL_LOG_AT(CL_LOG_LEVEL_TRACE, __VA_ARGS__)
 
 /*
   DESCRIPTION:
@@ -324,8 +754,74 @@ typedef struct cl_handler_s {
   - It is recommended that you use the functions defined above as opposed to this function since 
   they are explicit about the severity of the log message per their names while saving you a 
   parameter.
+  - Just like the functions above, the arguments are only evaluated if at least one handler accepts 
+  the level.
+ */
+#define LOG(level, ...) CL_LOG_AT(level, __VA_ARGS__)
+
+/*
+  DESCRIPTION:
+  Macro functions that log a plain message along with structured fields, one for each severity 
+  level, plus LOG_KV() which takes the level as its first parameter.
+
+  PARAMETERS:
+  - message:
+    - TYPE: const char *
+    - DESCRIPTION: The message, which is written as it is rather than used as a format string.
+  - ...:
+    - TYPE: ClField
+    - DESCRIPTION: One or more fields built with CL_INT(), CL_UINT(), CL_DOUBLE(), CL_STR() or 
+    CL_BOOL(), e.g. LOG_INFO_KV("request done", CL_INT("status", 200), CL_STR("path", path)).
+
+  NOTES:
+  - Text handlers write the fields after the message as key=value pairs separated by spaces. JSON 
+  handlers write them as members of the record's object after the fields from the format, so keys 
+  shouldn't repeat the format's (time, level, message...). Binary handlers store the text version.
+  - The values are copied or written out before the call returns, including in asynchronous mode.
+  There, a record takes up a single slot, and fields that don't fit in it after the message are 
+  left out.
+  - Nothing is parsed at runtime, each field costs about the same no matter how it's used.
  */
-#define LOG(level, ...) ClLog(level, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOG_FATAL_KV(message, ...) CL_LOG_KV_AT(CL_LOG_LEVEL_FATAL, message, __VA_ARGS__)
+#define LOG_ERROR_KV(message, ...) CL_LOG_KV_AT(CL_LOG_LEVEL_ERROR, message, __VA_ARGS__)
+#define LOG_WARN_KV(message, ...)  CL_LOG_KV_AT(CL_LOG_LEVEL_WARN,  message, __VA_ARGS__)
+#define LOG_INFO_KV(message, ...)  CL_LOG_KV_AT(CL_LOG_LEVEL_INFO,  message, __VA_ARGS__)
+#define LOG_DEBUG_KV(message, ...) CL_LOG_KV_AT(CL_LOG_LEVEL_DEBUG, message, __VA_ARGS__)
+#define LOG_TRACE_KV(message, ...) CL_LOG_KV_AT(CL_LOG_LEVEL_TRACE, message, __VA_ARGS__)
+#define LOG_KV(level, message, ...) CL_LOG_KV_AT(level, message, __VA_ARGS__)
+
+/*
+  [INTERNAL]
+  DESCRIPTION:
+  Macro function that the logging macros above expand to. When the level is less severe than 
+  CLOG_MIN_LEVEL, the condition is a compile-time constant and the call is removed entirely, while 
+  the arguments are still type-checked against ClLog()'s declaration. Otherwise, a level that no 
+  handler accepts costs a load and a branch, and the arguments aren't evaluated.
+
+  NOTES:
+  - The level expression may be evaluated more than once.
+ */
+#define CL_LOG_AT(level, ...)                                          \
+  do {                                                                 \
+    if((level) <= CLOG_MIN_LEVEL && ClIsEnabled(level)) {              \
+      ClLog(level, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__);     \
+    }                                                                  \
+  } while(0)
+
+/*
+  [INTERNAL]
+  DESCRIPTION:
+  Macro function that the structured logging macros above expand to, which works like CL_LOG_AT(). 
+  The fields are gathered into an array on the stack, so their count is known at compile time.
+ */
+#define CL_LOG_KV_AT(level, message, ...)                                            \
+  do {                                                                               \
+    if((level) <= CLOG_MIN_LEVEL && ClIsEnabled(level)) {                            \
+      ClLogKv(level, __FILE__, __LINE__, __FUNCTION__, message,                      \
+              (const ClField[]){__VA_ARGS__},                                        \
+              sizeof((const ClField[]){__VA_ARGS__})/sizeof(ClField));               \
+    }                                                                                \
+  } while(0)
 
 /*
   DESCRIPTION:
@@ -343,6 +839,7 @@ typedef struct cl_handler_s {
     - format: "%t(%Y-%m-%d%) %t(%H:%M:%S%) %l %g(%fK%)(%f:%L)%g(%F%): %m"
     - parsed_format: <generated at runtime>
     - parsed_format_length: <generated at runtime>
+    - plan: <generated at runtime>
     - min_level: CL_LOG_LEVEL_FATAL
     - max_level: CL_LOG_LEVEL_ERROR
     - rollover_count: 0 <not used>
@@ -358,6 +855,7 @@ typedef struct cl_handler_s {
     - format: "%t(%Y-%m-%d%) %t(%H:%M:%S%) %l %g(%fK%)(%f:%L)%g(%F%): %m"
     - parsed_format: <generated at runtime>
     - parsed_format_length: <generated at runtime>
+    - plan: <generated at runtime>
     - min_level: CL_LOG_LEVEL_WARN
     - max_level: CL_LOG_LEVEL_TRACE
     - rollover_count: 0 <not used>
@@ -372,6 +870,43 @@ void ClInit();
  */
 void ClCleanup();
 
+/*
+  DESCRIPTION:
+  Function that switches the library into asynchronous mode. Logging calls only capture the level, 
+  location, time, and formatted message of each record into a preallocated lock-free ring buffer, 
+  and a dedicated writer thread drains the ring buffer into the handlers.
+
+  PARAMETERS:
+  - capacity:
+    - TYPE: unsigned long
+    - DESCRIPTION: The number of records the ring buffer can hold, rounded up to a power of two.
+  - policy:
+    - TYPE: ClAsyncPolicy
+    - DESCRIPTION: What to do with a message when the ring buffer is full.
+
+  RETURNS:
+  0 on success, or -1 if asynchronous mode is already running or couldn't be started.
+
+  NOTES:
+  - Messages longer than CL_ASYNC_MESSAGE_LENGTH-1 bytes are truncated.
+  - Handlers can be created, modified, and deleted while asynchronous mode is running. A record goes 
+  to the handlers that exist when the writer thread writes it out, not when it was logged.
+ */
+int ClStartAsync(unsigned long capacity, ClAsyncPolicy policy);
+
+/*
+  DESCRIPTION:
+  Function that writes out every record still waiting in the ring buffer, stops the writer thread, 
+  and switches the library back into synchronous mode. Called automatically by ClCleanup().
+ */
+void ClStopAsync();
+
+/*
+  DESCRIPTION:
+  Function that copies the counters of asynchronous mode into stats.
+ */
+void ClGetAsyncStats(ClAsyncStats *stats);
+
 /*
   DESCRIPTION:
   Resets the state of the library to its state after initialization had finished.
@@ -387,6 +922,190 @@ ClHandler *ClCreateHandler(int fd, FILE *fp, ClStream stream_type, unsigned long
 
 void ClDeleteHandler(ClHandler *handler);
 
+/*
+  DESCRIPTION:
+  Function that sets how a handler writes records to its stream.
+
+  RETURNS:
+  0 on success, or -1 if the handler's stream type doesn't support the encoding.
+
+  NOTES:
+  - If the handler's file already has content written in a different encoding, it's rolled over 
+  first so a single file never mixes encodings.
+ */
+int ClSetHandlerEncoding(ClHandler *handler, ClEncoding encoding);
+
+/*
+  DESCRIPTION:
+  Function that sets how a handler's files are compressed once they've been rolled over. Only files 
+  rolled over from then on are compressed.
+
+  RETURNS:
+  0 on success, or -1 if the handler's stream type isn't CL_STREAM_FILE or CL_STREAM_MMAP.
+ */
+int ClSetHandlerCompression(ClHandler *handler, ClCompression compression);
+
+/*
+  DESCRIPTION:
+  Function that sets when a handler's file is rolled over based on time. Size-based rollover keeps 
+  applying on top of it. If the file already has content, its interval is taken from the time it was 
+  last modified, so a file left over from an earlier interval is rolled over by the next record.
+
+  RETURNS:
+  0 on success, or -1 if the handler's stream type isn't CL_STREAM_FILE or CL_STREAM_MMAP.
+ */
+int ClSetHandlerRollover(ClHandler *handler, ClRolloverInterval interval);
+
+/*
+  DESCRIPTION:
+  Function that sets when a handler writes out the records it has buffered. Anything already 
+  buffered is written out first.
+
+  PARAMETERS:
+  - handler:
+    - TYPE: ClHandler *
+    - DESCRIPTION: The handler to configure.
+  - policy:
+    - TYPE: ClFlushPolicy
+    - DESCRIPTION: When buffered records are written out.
+  - value:
+    - TYPE: unsigned long
+    - DESCRIPTION: The number of records, bytes or milliseconds the policy refers to (ignored for 
+    CL_FLUSH_RECORD).
+  - flush_level:
+    - TYPE: ClLogLevel
+    - DESCRIPTION: The least critical severity level that's still written right away, e.g. 
+    CL_LOG_LEVEL_ERROR so errors are never held back.
+
+  RETURNS:
+  0 on success, or -1 if the handler's stream type isn't CL_STREAM_CONSOLE or CL_STREAM_FILE, or 
+  the value is 0 for a policy that needs one. Also -1 if the handler's io_uring or O_DIRECT backend 
+  couldn't be set up again for the new policy, in which case the policy still applies but the 
+  handler uses write() (see ClSetHandlerIo()).
+ */
+int ClSetHandlerFlush(ClHandler *handler, ClFlushPolicy policy, unsigned long value, 
+                      ClLogLevel flush_level);
+
+/*
+  DESCRIPTION:
+  Function that writes out the records every handler has buffered, as well as the records held 
+  back while a CL_STREAM_PIPE handler's pipe was full (as far as the pipe takes them). ClCleanup() 
+  and ClDeleteHandler() do so as well.
+
+  NOTES:
+  - In asynchronous mode, records still queued for the writer thread aren't covered, see 
+  ClStopAsync().
+ */
+void ClFlush();
+
+/*
+  DESCRIPTION:
+  Function that sets how a CL_STREAM_FILE handler hands its records to the kernel. Anything already 
+  buffered is written out first.
+
+  RETURNS:
+  0 on success, or -1 if the handler's stream type isn't CL_STREAM_FILE, or io_uring or O_DIRECT 
+  isn't available (e.g. O_DIRECT on tmpfs), in which case the handler uses write().
+
+  NOTES:
+  - With CL_IO_URING, the file is written at explicit offsets rather than in append mode, so other 
+  processes shouldn't append to the same file.
+  - A write the kernel completes short or fails is finished with a blocking pwrite().
+ */
+int ClSetHandlerIo(ClHandler *handler, ClIo io);
+
+/*
+  DESCRIPTION:
+  Function that describes the records currently held by a handler with its stream_type field set 
+  to CL_STREAM_STRING, without copying them. If the ring has wrapped around, the partly overwritten 
+  oldest record is left out.
+
+  RETURNS:
+  0 on success, or -1 if the handler isn't a CL_STREAM_STRING handler.
+ */
+int ClGetHandlerSnapshot(ClHandler *handler, ClSnapshot *snapshot);
+
+/*
+  DESCRIPTION:
+  Function that makes a CL_STREAM_STRING handler write the records it holds to another handler 
+  whenever it logs a CL_LOG_LEVEL_FATAL record (which is the last record written out), so detailed 
+  records can be kept in memory and only written out when something goes wrong.
+
+  PARAMETERS:
+  - handler:
+    - TYPE: ClHandler *
+    - DESCRIPTION: The CL_STREAM_STRING handler. Its level range has to include CL_LOG_LEVEL_FATAL.
+  - target:
+    - TYPE: ClHandler *
+    - DESCRIPTION: The handler the records are written to as is, or NULL to stop dumping them.
+
+  RETURNS:
+  0 on success, or -1 if the handler isn't a CL_STREAM_STRING handler or the target doesn't write 
+  text.
+ */
+int ClSetHandlerDump(ClHandler *handler, ClHandler *target);
+
+/*
+  DESCRIPTION:
+  Function that rebuilds the text of the records in a file written by a handler with its encoding 
+  field set to CL_ENCODING_BINARY, using the format the handler had when the file was written.
+
+  PARAMETERS:
+  - input:
+    - TYPE: FILE *
+    - DESCRIPTION: The binary log, opened for reading.
+  - output:
+    - TYPE: FILE *
+    - DESCRIPTION: Where the rebuilt text is written.
+
+  RETURNS:
+  0 on success, or -1 if the input isn't a valid binary log (records decoded up until that point 
+  are still written).
+
+  NOTES:
+  - The binary log has to be decoded on a machine with the same type sizes and byte order as the one 
+  that wrote it.
+  - The library must be initialized, since records are rendered with the current severity levels.
+ */
+int ClDecode(FILE *input, FILE *output);
+
+/*
+  DESCRIPTION:
+  Function that enables or disables logging for a handler.
+ */
+void ClSetHandlerLogging(ClHandler *handler, ClLogging logging);
+
+/*
+  DESCRIPTION:
+  Function that sets the range of severity levels a handler logs.
+
+  PARAMETERS:
+  - handler:
+    - TYPE: ClHandler *
+    - DESCRIPTION: The handler to configure.
+  - min_level:
+    - TYPE: ClLogLevel
+    - DESCRIPTION: The most critical (numerically smallest) severity level the handler will log.
+  - max_level:
+    - TYPE: ClLogLevel
+    - DESCRIPTION: The least critical (numerically largest) severity level the handler will log.
+
+  RETURNS:
+  0 on success, or -1 if the range is invalid, in which case the handler is left unchanged.
+ */
+int ClSetHandlerLevels(ClHandler *handler, ClLogLevel min_level, ClLogLevel max_level);
+
+/*
+  DESCRIPTION:
+  Function that sets the format string a handler uses for printing each log message, per the 
+  specification described for ClSetFormat(). A NULL or empty format restores the default one.
+
+  NOTES:
+  - Records already being written keep the previous format, which is freed once they're done.
+  - A CL_ENCODING_BINARY handler's file is rolled over first, since its header describes the format.
+ */
+void ClSetHandlerFormat(ClHandler *handler, char *format);
+
 /*
   DESCRIPTION: Function that sets the format string to use for printing each log message.
   
@@ -424,12 +1143,16 @@ void ClDeleteHandler(ClHandler *handler);
     - %t(*%)
       - NAME: Time
       - DESCRIPTION: Any type of time-related text as described by strftime()'s specifiers, represented
-      here as an asterisk. The contents of the parentheses get passed to strftime() as its format string.
+      here as an asterisk. The contents of the parentheses are used as a strftime() format string, 
+      which can also contain %N for the nanoseconds of the timestamp, or %3N, %6N and %9N for its 
+      milliseconds, microseconds and nanoseconds (as the date command takes them), and %:z for the 
+      UTC offset with a colon. For instance, %t(%FT%T.%6N%:z%) prints an RFC 3339 timestamp.
     - %d
       - NAME: Duration
-      - DESCRIPTION: The time since ClInit() was called. If the init function was called towards 
-      the beginning of execution in a user's process (as it typically should be), this specifier's value
-      can be used to estimate the duration of how long the process has been running.
+      - DESCRIPTION: The time since ClInit() was called, in seconds with 6 decimal places, measured 
+      with a monotonic clock. If the init function was called towards the beginning of execution in 
+      a user's process (as it typically should be), this specifier's value can be used to estimate 
+      the duration of how long the process has been running.
     - %r
       - NAME: Log Rollover Count
       - DESCRIPTION: The current log rollover count, i.e. the number of times the log of the associated 
@@ -445,13 +1168,15 @@ void ClDeleteHandler(ClHandler *handler);
       - DESCRIPTION: The id of the process in which the log message was generated.
     - %n
       - NAME: Process Name
-      - DESCRIPTION: The name of the process in which the log message was generated.
+      - DESCRIPTION: The name of the process in which the log message was generated, as it was 
+      invoked (without its directory).
     - %x
       - NAME: Process Executable
       - DESCRIPTION: The path to the process's executable in which the log message was generated.
     - %u
       - NAME: Process User
-      - DESCRIPTION: The user that executed the process in which the log message was generated.
+      - DESCRIPTION: The user that executed the process in which the log message was generated (its 
+      effective user, or the user ID if it has no name).
     - %T
       - NAME: Thread ID
       - DESCRIPTION: Using the Linux syscall gettid(), the id of the thread in which the 
@@ -460,6 +1185,10 @@ void ClDeleteHandler(ClHandler *handler);
       - NAME: Pthread ID
       - DESCRIPTION: Using the POSIX function pthread_self(), the id of the thread in which 
       the message was generated.
+    - %N
+      - NAME: Thread Name
+      - DESCRIPTION: The name of the thread in which the message was generated, as set with 
+      ClSetThreadName(), or otherwise the name the thread had the first time it logged something.
     - %g(*%)
       - NAME: SGR Text Modifiers
       - DESCRIPTION: Modifiers to change the way text is rendered when printed to a console output 
@@ -556,6 +1285,12 @@ void ClDeleteHandler(ClHandler *handler);
   to one of the valid specifiers listed above.
   - For the time specifier, information on valid specifiers for inside of the parantheses can be found 
   in the relevant <time.h> documentation for strftime().
+  - The numeric time specifiers (%Y, %y, %m, %d, %j, %H, %M, %S, %s, %F, %T, %R, %z and the 
+  sub-second ones) are formatted by Clog itself, and the rest by strftime(). Either way, the text 
+  is only rebuilt once per second, with the sub-second digits filled in for each record.
+  - The process ID, name, executable, and user are looked up once by ClInit() (the ID is updated in 
+  the child process after a fork), and the thread ID and name once per thread, so printing them costs 
+  no more than copying a string.
  */
 void ClSetFormat(char *format);
 
@@ -591,6 +1326,39 @@ char *ClGetFormat();
  */
 void ClSetLevelSGR(ClLogLevel level, char *sgr_modifiers);
 
+/*
+  DESCRIPTION:
+  Function that sets the name printed for the calling thread's messages by the %N format specifier. 
+  The name the operating system has for the thread is left as is.
+
+  PARAMETERS:
+  - name:
+    - TYPE: const char *
+    - DESCRIPTION: The name, truncated to CL_THREAD_NAME_LENGTH-1 bytes. An empty name goes back to 
+    the name the operating system has for the thread.
+
+  RETURNS:
+  0 on success, or -1 if name is NULL.
+ */
+int ClSetThreadName(const char *name);
+
+/*
+  DESCRIPTION:
+  Function that sets the clock records are timestamped with, CL_CLOCK_REALTIME by default. Setting 
+  CL_CLOCK_TSC calibrates the TSC, which takes about 10 milliseconds, and ClInit() calibrates it 
+  again if it's still in use.
+
+  PARAMETERS:
+  - source:
+    - TYPE: ClClockSource
+    - DESCRIPTION: The clock to read.
+
+  RETURNS:
+  0 on success, or -1 if the clock isn't available on this system (for CL_CLOCK_TSC, if the CPU's 
+  TSC isn't invariant), in which case records keep being timestamped with the previous clock.
+ */
+int ClSetClockSource(ClClockSource source);
+
 /*
   [INTERNAL]
   DESCRIPTION:
@@ -604,6 +1372,18 @@ void ClSetLevelSGR(ClLogLevel level, char *sgr_modifiers);
   macros can reference it in their definitions.
  */
 void ClLog(ClLogLevel level, const char *filename, long line, const char *function, 
-           const char *message, ...);
+           const char *message, ...) __attribute__((format(printf, 5, 6)));
+
+/*
+  [INTERNAL]
+  DESCRIPTION:
+  Function for recording the given message and structured fields to the target output stream(s).
+
+  WARNING:
+  Like ClLog(), this is only declared here so the LOG_*_KV() macros can reference it. Use those 
+  instead.
+ */
+void ClLogKv(ClLogLevel level, const char *filename, long line, const char *function, 
+             const char *message, const ClField *fields, unsigned long fields_length);
 
 #endif
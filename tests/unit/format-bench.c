@@ -0,0 +1,87 @@
+// The formatter is internal to the library, so it's built into the benchmark
+#include "clog.c"
+
+// Each message is formatted into the same buffer over and over, once by Clog's formatter and once
+// by vsnprintf(). The two take turns for a few rounds and the fastest round of each is kept, so
+// whatever else the machine is doing at the time doesn't end up in the numbers
+#define BENCH(name, iterations, format, ...)                                                       \
+  do {                                                                                             \
+    for(round = 0; round < rounds; round++) {                                                      \
+      start = Now();                                                                               \
+      for(i = 0; i < iterations; i++) {                                                            \
+        Clog(&buffer, format, __VA_ARGS__);                                                        \
+      }                                                                                            \
+      elapsed = (Now()-start)/iterations;                                                          \
+      clog = (round == 0 || elapsed < clog) ? elapsed : clog;                                      \
+      start = Now();                                                                               \
+      for(i = 0; i < iterations; i++) {                                                            \
+        Glibc(output, format, __VA_ARGS__);                                                        \
+      }                                                                                            \
+      elapsed = (Now()-start)/iterations;                                                          \
+      glibc = (round == 0 || elapsed < glibc) ? elapsed : glibc;                                   \
+    }                                                                                              \
+    printf("%-14s clog %6.1f ns  glibc %6.1f ns  %5.2fx\n", name, clog, glibc, glibc/clog);        \
+  } while(0)
+
+static volatile char sink;
+
+
+static double Now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec*1e9+(double)now.tv_nsec;
+}
+
+
+static __attribute__((noinline)) void Clog(ClBuffer *buffer, const char *format, ...) {
+  va_list args;
+
+  buffer->length = 0;
+  va_start(args, format);
+  FormatMessage(buffer, format, args);
+  va_end(args);
+  sink = buffer->data[buffer->length/2];
+}
+
+
+static __attribute__((noinline)) void Glibc(char *output, const char *format, ...) {
+  va_list args;
+  int     length;
+
+  va_start(args, format);
+  length = vsnprintf(output, CL_MESSAGE_LENGTH, format, args);
+  va_end(args);
+  sink = output[length/2];
+}
+
+
+int main(int argc, char **argv) {
+  char             data[CL_MESSAGE_LENGTH];
+  char             output[CL_MESSAGE_LENGTH];
+  double           start;
+  double           elapsed;
+  double           clog = 0;
+  double           glibc = 0;
+  long             i;
+  int              round;
+  int              rounds = 5;
+  ClBuffer         buffer = {data, 0, CL_MESSAGE_LENGTH, 0};
+  volatile int     integer = 123456;
+  volatile long    wide = -9876543210L;
+  volatile double  real = 3.14159265;
+
+  BENCH("integers", 500000, "request %d took %u ms from %ld", integer, (unsigned)integer, wide);
+  BENCH("hex/string", 500000, "user %s id %08x ptr %p", "alice", (unsigned)integer, (void *)data);
+  BENCH("float %f", 500000, "value %f ratio %.3f", real, real/7);
+  BENCH("float %g/%e", 300000, "value %g ratio %e", real, real*1e20);
+  BENCH("float %.17g", 500000, "exact %.17g", real/7);
+  BENCH("float huge %f", 20000, "huge %f", real*1e300);
+  BENCH("mixed", 300000, "[%5d] %-10s %.2f %x %c", integer, "name", real, (unsigned)integer, 'x');
+  BENCH("text", 1000000, "a plain message without any arguments%s", "");
+
+  if(buffer.on_heap) {
+    free(buffer.data);
+  }
+  return 0;
+}
@@ -0,0 +1,215 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include "clog.h"
+
+// Every message is logged to a string handler that prints nothing but the message, and the record
+// it appends to the ring is compared against what snprintf() makes of the same arguments
+#define CHECK(format, ...)                                                                         \
+  do {                                                                                             \
+    head = handler->ring_head;                                                                     \
+    snprintf(expected, sizeof(expected), format, ##__VA_ARGS__);                                   \
+    ClLog(CL_LOG_LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, format, ##__VA_ARGS__);             \
+    Compare(format, head);                                                                         \
+  } while(0)
+
+static ClHandler *    handler;
+static char           expected[8192];
+static uint64_t       head;
+static uint64_t       random_state = 88172645463325252ull;
+static unsigned long  failures = 0;
+static unsigned long  total = 0;
+
+static const char *flags[] = {"", "-", "+", " ", "#", "0", "-0", "+0", "#0", "- ", "+#", "-+#0 "};
+static const char *widths[] = {"", "1", "5", "12", "30"};
+static const char *precisions[] = {"", ".", ".0", ".1", ".3", ".6", ".10", ".17", ".25", ".40",
+                                   ".80", ".100"};
+static const char *integer_conversions[] = {"d", "i", "u", "x", "X", "o", "hhd", "hd", "ld", "lld",
+                                            "zu", "jd", "td", "lx", "hhu", "llo"};
+static const char *float_conversions[] = {"f", "F", "e", "E", "g", "G", "a", "lf", "le", "lg"};
+static const long long integers[] = {0, 1, -1, 7, -42, 255, 256, 1000, 99999, -100000, 2147483647LL,
+                                     -2147483648LL, 4294967295LL, 9223372036854775807LL,
+                                     -9223372036854775807LL-1, 1234567890123LL};
+static const double floats[] = {0.0, -0.0, 1.0, -1.0, 0.5, 1.5, 2.5, 0.125, 3.14159265358979, 1e10,
+                                1e-10, 1e100, 1e-100, 1e300, 1e-300, 1.7976931348623157e308,
+                                4.9e-324, 2.2250738585072014e-308, 123456789.987654321, 0.1, 0.2,
+                                0.3, 9.5, 99.5, 0.05, 0.015, 0.0001, 0.00001, 999999.5, 9999995.0,
+                                1e15, 1e16, 1e17, 1e21, 1e22, 1e23, 5e-5, 123.456, 1.0/3, 2.0/3,
+                                INFINITY, -INFINITY, NAN, -NAN, 0.999999999, 9.9999995e-5, 1e-5,
+                                12345678901234567890.0, 7.0e22, 18446744073709551616.0};
+static const char *random_formats[] = {"%.17g", "%g", "%e", "%.3e", "%f", "%.0f", "%.20e", "%.30f",
+                                       "%#g", "%.40g", "%.1f", "%.15g"};
+
+
+static void Compare(const char *format, uint64_t start) {
+  char          actual[sizeof(expected)+1];
+  unsigned long i;
+  unsigned long length;
+  unsigned long mask = handler->stream_max_length-1;
+
+  // The record is the message and a newline, wherever the ring wrapped around within it
+  length = (unsigned long)(handler->ring_head-start);
+  if(length > sizeof(actual)-1) {
+    length = sizeof(actual)-1;
+  }
+  for(i = 0; i < length; i++) {
+    actual[i] = handler->ring[(start+i) & mask];
+  }
+  actual[length] = '\0';
+
+  total++;
+  if(length == 0 || actual[length-1] != '\n' || length-1 != strlen(expected) ||
+     memcmp(actual, expected, length-1) != 0) {
+    if(failures++ < 100) {
+      fprintf(stderr, "FAIL \"%s\": expected \"%s\", got \"%.*s\"\n", format, expected,
+              (int)(length > 0 ? length-1 : 0), actual);
+    }
+  }
+}
+
+
+static uint64_t Random() {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+
+static void CheckIntegers(const char *spec, const char *conversion) {
+  char          format[64];
+  unsigned long i;
+  long long     value;
+
+  snprintf(format, sizeof(format), "<%%%s%s>", spec, conversion);
+  for(i = 0; i < sizeof(integers)/sizeof(integers[0]); i++) {
+    value = integers[i];
+    if(strncmp(conversion, "ll", 2) == 0) {
+      CHECK(format, value);
+    }
+    else if(conversion[0] == 'l') {
+      CHECK(format, (long)value);
+    }
+    else if(conversion[0] == 'z') {
+      CHECK(format, (size_t)value);
+    }
+    else if(conversion[0] == 'j') {
+      CHECK(format, (intmax_t)value);
+    }
+    else if(conversion[0] == 't') {
+      CHECK(format, (ptrdiff_t)value);
+    }
+    else {
+      CHECK(format, (int)value);
+    }
+  }
+}
+
+
+static void CheckFloats(const char *spec, const char *conversion) {
+  char          format[64];
+  unsigned long i;
+  int           alternate;
+
+  // glibc drops the trailing zeros '#' keeps with %g when rounding carries into a new digit (it 
+  // prints 999999.5 as 1.e+06 rather than 1.00000e+06), so that's the one case not compared
+  alternate = strchr(spec, '#') != NULL && strpbrk(conversion, "gG") != NULL;
+  snprintf(format, sizeof(format), "<%%%s%s>", spec, conversion);
+  for(i = 0; i < sizeof(floats)/sizeof(floats[0]); i++) {
+    if(alternate && floats[i] == 999999.5) {
+      continue;
+    }
+    CHECK(format, floats[i]);
+  }
+}
+
+
+static void CheckOthers(const char *spec) {
+  char format[64];
+
+  snprintf(format, sizeof(format), "<%%%ss>", spec);
+  CHECK(format, "hello world");
+  CHECK(format, "");
+  CHECK(format, (char *)NULL);
+  snprintf(format, sizeof(format), "<%%%sc>", spec);
+  CHECK(format, 'Z');
+  snprintf(format, sizeof(format), "<%%%sp>", spec);
+  CHECK(format, (void *)0x1234abcd);
+  CHECK(format, (void *)0);
+}
+
+
+int main(int argc, char **argv) {
+  char          spec[32];
+  char          big[3000];
+  double        value;
+  uint64_t      bits;
+  unsigned long f;
+  unsigned long w;
+  unsigned long p;
+  unsigned long c;
+  unsigned long i;
+
+  // The default handlers would print every message too
+  ClInit();
+  if(freopen("/dev/null", "w", stdout) == NULL) {
+    return 1;
+  }
+  handler = ClCreateHandler(0, NULL, CL_STREAM_STRING, 1 << 16, NULL, NULL, 0, "%m",
+                            CL_LOG_LEVEL_FATAL, CL_LOG_LEVEL_TRACE);
+  if(handler == NULL) {
+    return 1;
+  }
+
+  // Every combination of flags, width, and precision with every conversion
+  for(f = 0; f < sizeof(flags)/sizeof(flags[0]); f++) {
+    for(w = 0; w < sizeof(widths)/sizeof(widths[0]); w++) {
+      for(p = 0; p < sizeof(precisions)/sizeof(precisions[0]); p++) {
+        snprintf(spec, sizeof(spec), "%s%s%s", flags[f], widths[w], precisions[p]);
+        for(c = 0; c < sizeof(integer_conversions)/sizeof(integer_conversions[0]); c++) {
+          CheckIntegers(spec, integer_conversions[c]);
+        }
+        for(c = 0; c < sizeof(float_conversions)/sizeof(float_conversions[0]); c++) {
+          CheckFloats(spec, float_conversions[c]);
+        }
+        CheckOthers(spec);
+      }
+    }
+  }
+
+  // Random doubles over the whole range, and every other one with few significant digits
+  for(i = 0; i < 300000; i++) {
+    bits = Random();
+    memcpy(&value, &bits, sizeof(double));
+    if(i & 1) {
+      value = (double)(Random() % 2000000)/(double)(1+Random() % 1000);
+    }
+    CHECK(random_formats[i % (sizeof(random_formats)/sizeof(random_formats[0]))], value);
+  }
+
+  // Literal text, '*' arguments, and what's left to the C library
+  CHECK("%s", "");
+  CHECK("plain text only");
+  CHECK("%%|%d%%", 3);
+  CHECK("%*d|%-*d|%.*f|%*.*e", 5, 1, -5, 2, 3, 2.5, -8, 2, 1.5);
+  CHECK("%'d %'.2f", 1234567, 1234567.891);
+  CHECK("%lc %ls", (wint_t)L'x', L"wide");
+  CHECK("%La %Lf %Lg", 1.5L, 2.5L, 1e300L);
+  CHECK("%2$d %1$d", 1, 2);
+  CHECK("%hhx %hx", 300, 70000);
+  CHECK("%#o %#.0o %#x %#.0x %.0d|", 0, 0, 0, 0, 0);
+  CHECK("%.3d|%+.0d|% .0d|", 3, 0, 0);
+  CHECK("%#.0f %#.0e %#g %#.3g %g %G", 1.0, 1.0, 1.0, 100.0, 1e-5, 1e-5);
+  memset(big, 'a', sizeof(big)-1);
+  big[sizeof(big)-1] = '\0';
+  CHECK("[%s] %d", big, 5);
+  CHECK("%2000d|%-1500.100f", 7, 1.0/7);
+
+  fprintf(stderr, "%lu of %lu messages differ from snprintf()\n", failures, total);
+  ClCleanup();
+  return failures != 0;
+}
@@ -0,0 +1,36 @@
+#include "clog.h"
+
+// Rebuilds the text of binary logs (see CL_ENCODING_BINARY), reading the files given as arguments 
+// in order, or stdin if there are none, and writing the text to stdout
+int main(int argc, char **argv) {
+  int   i;
+  int   status = 0;
+  FILE *fp;
+
+  ClInit();
+
+  if(argc < 2) {
+    if(ClDecode(stdin, stdout) != 0) {
+      fprintf(stderr, "clog-decode: stdin: not a valid binary log\n");
+      status = 1;
+    }
+  }
+  for(i = 1; i < argc; i++) {
+    fp = fopen(argv[i], "rb");
+    if(fp == NULL) {
+      fprintf(stderr, "clog-decode: %s: %s\n", argv[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    if(ClDecode(fp, stdout) != 0) {
+      fprintf(stderr, "clog-decode: %s: not a valid binary log\n", argv[i]);
+      status = 1;
+    }
+    fclose(fp);
+  }
+
+  fflush(stdout);
+  ClCleanup();
+
+  return status;
+}